@@ -0,0 +1,169 @@
+#include "capture.h"
+#include "trace.h"
+
+#define CAPTURE_MAX_GAP     3600000000U     /* us */
+#define CAPTURE_BUF_SIZE    65536
+
+CaptureWriter::CaptureWriter()
+    : _file (NULL)
+    , _last (0)
+    , _written (0)
+    , _limit (0)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(&_lock);
+#else
+    pthread_mutex_init(&_lock, NULL);
+#endif
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+#ifdef _WIN32
+    DeleteCriticalSection(&_lock);
+#else
+    pthread_mutex_destroy(&_lock);
+#endif
+}
+
+void CaptureWriter::lock()
+{
+#ifdef _WIN32
+    EnterCriticalSection(&_lock);
+#else
+    pthread_mutex_lock(&_lock);
+#endif
+}
+
+void CaptureWriter::unlock()
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&_lock);
+#else
+    pthread_mutex_unlock(&_lock);
+#endif
+}
+
+bool CaptureWriter::open(const char* path, uint32_t limit)
+{
+    CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION};
+    FILE* file;
+
+    close();
+    file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return false;
+    }
+    lock();
+    _last = trace_now();
+    _written = sizeof(header);
+    _limit = limit;
+    _file = file;
+    unlock();
+    return true;
+}
+
+void CaptureWriter::close()
+{
+    lock();
+    if (_file) {
+        fclose(_file);
+        _file = NULL;
+    }
+    unlock();
+}
+
+/* disconnects are flushed, so a capture of a crashed service has whole connections */
+void CaptureWriter::record(uint32_t conn, uint16_t kind, const void* data, uint32_t size)
+{
+    CaptureRecord record;
+    uint64_t now, gap;
+
+    if (!_file) {
+        return;
+    }
+    if (size > CAPTURE_MAX_DATA) {
+        size = CAPTURE_MAX_DATA;
+    }
+    lock();
+    if (!_file || _written + sizeof(record) + size > _limit) {
+        unlock();
+        return;
+    }
+    now = trace_now();
+    gap = now - _last;
+    _last = now;
+    record.time = (uint32_t)(gap < CAPTURE_MAX_GAP ? gap : CAPTURE_MAX_GAP);
+    record.conn = conn;
+    record.kind = kind;
+    record.size = (uint16_t)size;
+    fwrite(&record, sizeof(record), 1, _file);
+    if (size) {
+        fwrite(data, size, 1, _file);
+    }
+    _written += sizeof(record) + size;
+    if (kind == CAPTURE_DISCONNECT) {
+        fflush(_file);
+    }
+    unlock();
+}
+
+CaptureReader::CaptureReader()
+    : _file (NULL)
+    , _time (0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    close();
+}
+
+bool CaptureReader::open(const char* path)
+{
+    CaptureHeader header;
+
+    close();
+    _file = fopen(path, "rb");
+    if (!_file) {
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, _file) != 1 || header.magic != CAPTURE_MAGIC ||
+            header.version != CAPTURE_VERSION) {
+        close();
+        return false;
+    }
+    _time = 0;
+    return true;
+}
+
+void CaptureReader::close()
+{
+    if (_file) {
+        fclose(_file);
+        _file = NULL;
+    }
+}
+
+bool CaptureReader::read(CaptureEvent* event)
+{
+    CaptureRecord record;
+
+    if (!_file || fread(&record, sizeof(record), 1, _file) != 1 ||
+            record.size > CAPTURE_MAX_DATA ||
+            (record.size && fread(event->data, record.size, 1, _file) != 1)) {
+        return false;
+    }
+    _time += record.time;
+    event->time = _time;
+    event->conn = record.conn;
+    event->kind = record.kind;
+    event->size = record.size;
+    return true;
+}
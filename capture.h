@@ -0,0 +1,89 @@
+#ifndef _H_CAPTURE
+#define _H_CAPTURE
+
+#include <stdio.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define CAPTURE_MAGIC       0x50414355  /* "UCAP" */
+#define CAPTURE_VERSION     1
+#define CAPTURE_MAX_DATA    1024        /* the pipe buffer size of the service */
+
+/* start of a capture file, followed by the records */
+typedef struct CaptureHeader {
+    uint32_t magic;
+    uint32_t version;
+} CaptureHeader;
+
+enum {
+    CAPTURE_CONNECT = 1,    /* a client connected, no data */
+    CAPTURE_REQUEST,        /* a message as read from the pipe or the ring */
+    CAPTURE_REPLY,
+    CAPTURE_DISCONNECT,     /* no data */
+};
+
+/* followed by size bytes of data. time is in us since the previous record, so
+   records stay small; a gap longer than an hour is cut to an hour */
+typedef struct CaptureRecord {
+    uint32_t time;
+    uint32_t conn;
+    uint16_t kind;
+    uint16_t size;
+} CaptureRecord;
+
+/* Optional binary capture of the protocol traffic of the service, to replay its load
+   with usbclerk-replay. record() is a flag test while not capturing, then appends to a
+   buffered file until limit bytes are written. */
+class CaptureWriter {
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+    bool open(const char* path, uint32_t limit);
+    void close();
+    bool capturing() { return _file != NULL; }
+    void record(uint32_t conn, uint16_t kind, const void* data, uint32_t size);
+
+private:
+    void lock();
+    void unlock();
+
+private:
+#ifdef _WIN32
+    CRITICAL_SECTION _lock;
+#else
+    pthread_mutex_t _lock;
+#endif
+    FILE* volatile _file;
+    uint64_t _last;
+    uint32_t _written;
+    uint32_t _limit;
+};
+
+/* a record with its time since the start of the capture */
+typedef struct CaptureEvent {
+    uint64_t time;
+    uint32_t conn;
+    uint16_t kind;
+    uint16_t size;
+    uint8_t data[CAPTURE_MAX_DATA];
+} CaptureEvent;
+
+class CaptureReader {
+public:
+    CaptureReader();
+    ~CaptureReader();
+    bool open(const char* path);
+    void close();
+    /* false at the end of the capture or on a truncated record */
+    bool read(CaptureEvent* event);
+
+private:
+    FILE* _file;
+    uint64_t _time;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include "devicemap.h"
+#include "vdlog.h"
+
+DeviceMap::DeviceMap(const WCHAR* key)
+    : _key (key)
+{
+}
+
+void DeviceMap::subkey(UINT16 vid, UINT16 pid, WCHAR* name)
+{
+    _snwprintf(name, MAX_PATH, L"%s\\VID_%04X&PID_%04X", _key, vid, pid);
+}
+
+static bool get_string(HKEY hkey, const WCHAR* name, WCHAR* value, DWORD len)
+{
+    DWORD size = len * sizeof(WCHAR), type;
+
+    if (RegQueryValueEx(hkey, name, NULL, &type, (LPBYTE)value, &size) != ERROR_SUCCESS ||
+            type != REG_SZ || size < sizeof(WCHAR)) {
+        return false;
+    }
+    /* registry strings are not always terminated */
+    value[size / sizeof(WCHAR) < len ? size / sizeof(WCHAR) : len - 1] = L'\0';
+    return true;
+}
+
+static bool set_string(HKEY hkey, const WCHAR* name, const WCHAR* value)
+{
+    return RegSetValueEx(hkey, name, 0, REG_SZ, (const BYTE*)value,
+                         (DWORD)(wcslen(value) + 1) * sizeof(WCHAR)) == ERROR_SUCCESS;
+}
+
+bool DeviceMap::get(UINT16 vid, UINT16 pid, DeviceMapEntry* entry)
+{
+    WCHAR name[MAX_PATH];
+    HKEY hkey;
+    bool ret;
+
+    subkey(vid, pid, name);
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, name, 0, KEY_READ, &hkey) != ERROR_SUCCESS) {
+        return false;
+    }
+    ret = get_string(hkey, L"InstanceId", entry->instance_id, DEVICE_MAP_ID_LEN) &&
+          get_string(hkey, L"InfName", entry->inf_name, DEVICE_MAP_INF_LEN);
+    RegCloseKey(hkey);
+    return ret;
+}
+
+bool DeviceMap::set(UINT16 vid, UINT16 pid, const DeviceMapEntry* entry)
+{
+    WCHAR name[MAX_PATH];
+    HKEY hkey;
+    LONG err;
+    bool ret;
+
+    subkey(vid, pid, name);
+    err = RegCreateKeyEx(HKEY_LOCAL_MACHINE, name, 0, NULL, REG_OPTION_NON_VOLATILE,
+                         KEY_WRITE, NULL, &hkey, NULL);
+    if (err != ERROR_SUCCESS) {
+        vd_printf("Failed creating device map key %S: %ld", name, err);
+        return false;
+    }
+    ret = set_string(hkey, L"InstanceId", entry->instance_id) &&
+          set_string(hkey, L"InfName", entry->inf_name);
+    RegCloseKey(hkey);
+    if (!ret) {
+        vd_printf("Failed writing device map key %S", name);
+        remove(vid, pid);
+    }
+    return ret;
+}
+
+void DeviceMap::remove(UINT16 vid, UINT16 pid)
+{
+    WCHAR name[MAX_PATH];
+
+    subkey(vid, pid, name);
+    RegDeleteKey(HKEY_LOCAL_MACHINE, name);
+}
+
+void DeviceMap::list(DeviceMapIds* ids)
+{
+    WCHAR name[MAX_PATH];
+    DWORD len;
+    UINT16 vid, pid;
+    HKEY hkey;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, _key, 0, KEY_READ, &hkey) != ERROR_SUCCESS) {
+        return;
+    }
+    for (DWORD i = 0; ; i++) {
+        len = MAX_PATH;
+        if (RegEnumKeyEx(hkey, i, name, &len, NULL, NULL, NULL, NULL) != ERROR_SUCCESS) {
+            break;
+        }
+        if (swscanf(name, L"VID_%04hX&PID_%04hX", &vid, &pid) == 2) {
+            ids->push_back((DWORD)vid << 16 | pid);
+        }
+    }
+    RegCloseKey(hkey);
+}
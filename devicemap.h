@@ -0,0 +1,37 @@
+#ifndef _H_DEVICEMAP
+#define _H_DEVICEMAP
+
+#include <windows.h>
+#include <list>
+
+#define DEVICE_MAP_ID_LEN   200     /* MAX_DEVICE_ID_LEN */
+#define DEVICE_MAP_INF_LEN  MAX_PATH
+
+typedef struct DeviceMapEntry {
+    WCHAR instance_id[DEVICE_MAP_ID_LEN];
+    WCHAR inf_name[DEVICE_MAP_INF_LEN];     /* published name, e.g. oem12.inf */
+} DeviceMapEntry;
+
+/* a device of the map, vid << 16 | pid */
+typedef std::list<DWORD> DeviceMapIds;
+
+/* Persistent map of the devices the service installed WinUSB for, to their device
+   instance & published INF, in a registry subkey VID_xxxx&PID_xxxx per device. It
+   saves driver operations the SetupAPI walks; entries may be stale, e.g. after a
+   manual driver change, so users check them against the device. */
+class DeviceMap {
+public:
+    DeviceMap(const WCHAR* key);
+    bool get(UINT16 vid, UINT16 pid, DeviceMapEntry* entry);
+    bool set(UINT16 vid, UINT16 pid, const DeviceMapEntry* entry);
+    void remove(UINT16 vid, UINT16 pid);
+    void list(DeviceMapIds* ids);
+
+private:
+    void subkey(UINT16 vid, UINT16 pid, WCHAR* name);
+
+private:
+    const WCHAR* _key;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#include "filteropt.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <vector>
+
+#define FILTEROPT_FIELDS 4
+
+typedef std::vector<struct usbredirfilter_rule> Rules;
+
+static const int field_max[FILTEROPT_FIELDS] = {255, 65535, 65535, 65535};
+static const char *field_name[FILTEROPT_FIELDS] = {"class", "vendor", "product", "version"};
+
+static int get_field(const struct usbredirfilter_rule *rule, int field)
+{
+    switch (field) {
+    case 0: return rule->device_class;
+    case 1: return rule->vendor_id;
+    case 2: return rule->product_id;
+    default: return rule->device_version_bcd;
+    }
+}
+
+static void set_field(struct usbredirfilter_rule *rule, int field, int value)
+{
+    switch (field) {
+    case 0: rule->device_class = value; break;
+    case 1: rule->vendor_id = value; break;
+    case 2: rule->product_id = value; break;
+    default: rule->device_version_bcd = value; break;
+    }
+}
+
+/* every device matched by b is matched by a */
+static bool covers(const struct usbredirfilter_rule *a, const struct usbredirfilter_rule *b)
+{
+    for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+        if (get_field(a, f) != -1 && get_field(a, f) != get_field(b, f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* some device is matched by both a and b */
+static bool overlaps(const struct usbredirfilter_rule *a, const struct usbredirfilter_rule *b)
+{
+    for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+        if (get_field(a, f) != -1 && get_field(b, f) != -1 &&
+                get_field(a, f) != get_field(b, f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_rule(FILE *out, const struct usbredirfilter_rule *rule)
+{
+    for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+        if (get_field(rule, f) == -1) {
+            fprintf(out, "-1,");
+        } else {
+            fprintf(out, f ? "0x%04x," : "0x%02x,", get_field(rule, f));
+        }
+    }
+    fprintf(out, "%d", rule->allow ? 1 : 0);
+}
+
+static void report_rule(FILE *out, const char *what, const struct usbredirfilter_rule *rule,
+                        int index)
+{
+    if (!out) {
+        return;
+    }
+    fprintf(out, "rule %d (", index);
+    print_rule(out, rule);
+    fprintf(out, ") %s", what);
+}
+
+/* removes rules covered by an earlier rule, they can never match */
+static int remove_shadowed(Rules &rules, std::vector<int> &index, FILE *out)
+{
+    int removed = 0;
+
+    for (size_t j = 1; j < rules.size(); j++) {
+        for (size_t i = 0; i < j; i++) {
+            if (covers(&rules[i], &rules[j])) {
+                report_rule(out, "is shadowed by", &rules[j], index[j]);
+                if (out) {
+                    fprintf(out, " rule %d\n", index[i]);
+                }
+                rules.erase(rules.begin() + j);
+                index.erase(index.begin() + j);
+                removed++;
+                j--;
+                break;
+            }
+        }
+    }
+    return removed;
+}
+
+/* a rule is redundant when every device it matches would get the same verdict from
+   the following rules: each later overlapping rule up to the first one covering it
+   has the same verdict, or the default has it if no later rule covers it */
+static bool is_redundant(const Rules &rules, size_t j, int default_allow)
+{
+    int allow = !!rules[j].allow;
+
+    for (size_t k = j + 1; k < rules.size(); k++) {
+        if (!overlaps(&rules[j], &rules[k])) {
+            continue;
+        }
+        if (!!rules[k].allow != allow) {
+            return false;
+        }
+        if (covers(&rules[k], &rules[j])) {
+            return true;
+        }
+    }
+    return !!default_allow == allow;
+}
+
+static int remove_redundant(Rules &rules, std::vector<int> &index, int default_allow,
+                            FILE *out)
+{
+    int removed = 0;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        for (size_t j = rules.size(); j-- > 0;) {
+            if (is_redundant(rules, j, default_allow)) {
+                report_rule(out, "is redundant\n", &rules[j], index[j]);
+                rules.erase(rules.begin() + j);
+                index.erase(index.begin() + j);
+                removed++;
+                changed = true;
+            }
+        }
+    }
+    return removed;
+}
+
+/* merges a run of adjacent rules with the same verdict, equal in all fields but one,
+   whose values in that field cover all of its domain, into a single wildcard rule */
+static int merge_adjacent(Rules &rules, std::vector<int> &index, FILE *out)
+{
+    int merged = 0;
+
+    for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+        for (size_t start = 0; start < rules.size(); start++) {
+            std::set<int> values;
+            size_t end;
+
+            if (get_field(&rules[start], f) == -1) {
+                continue;
+            }
+            for (end = start; end < rules.size(); end++) {
+                struct usbredirfilter_rule a = rules[start], b = rules[end];
+                set_field(&a, f, 0);
+                set_field(&b, f, 0);
+                if (get_field(&rules[end], f) == -1 || !!a.allow != !!b.allow ||
+                        !covers(&a, &b) || !covers(&b, &a)) {
+                    break;
+                }
+                values.insert(get_field(&rules[end], f));
+            }
+            if ((int)values.size() != field_max[f] + 1) {
+                continue;
+            }
+            if (out) {
+                fprintf(out, "rules %d-%d merged into a %s wildcard\n", index[start],
+                        index[end - 1], field_name[f]);
+            }
+            set_field(&rules[start], f, -1);
+            rules.erase(rules.begin() + start + 1, rules.begin() + end);
+            index.erase(index.begin() + start + 1, index.begin() + end);
+            merged += (int)(end - start - 1);
+        }
+    }
+    return merged;
+}
+
+int filteropt_optimize(const struct usbredirfilter_rule *rules, int rules_count,
+                       int default_allow, struct usbredirfilter_rule **rules_ret,
+                       int *rules_count_ret, FilterOptReport *report, FILE *out)
+{
+    Rules opt(rules, rules + rules_count);
+    std::vector<int> index;
+    FilterOptReport r;
+    int shadowed, merged;
+
+    if (usbredirfilter_verify(rules, rules_count)) {
+        return -EINVAL;
+    }
+    memset(&r, 0, sizeof(r));
+    r.original_count = rules_count;
+    r.verified = -1;
+    for (int i = 0; i < rules_count; i++) {
+        index.push_back(i);
+    }
+    do {
+        shadowed = remove_shadowed(opt, index, out);
+        r.shadowed += shadowed;
+        r.redundant += remove_redundant(opt, index, default_allow, out);
+        merged = merge_adjacent(opt, index, out);
+        r.merged += merged;
+    } while (shadowed || merged);
+
+    *rules_ret = (struct usbredirfilter_rule *)malloc(sizeof(**rules_ret) *
+                                                     (opt.size() ? opt.size() : 1));
+    if (!*rules_ret) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < opt.size(); i++) {
+        (*rules_ret)[i] = opt[i];
+    }
+    *rules_count_ret = r.optimized_count = (int)opt.size();
+    if (report) {
+        *report = r;
+    }
+    return 0;
+}
+
+int filteropt_match(const struct usbredirfilter_rule *rules, int rules_count,
+                    int device_class, int vendor_id, int product_id, int version_bcd,
+                    int default_allow)
+{
+    for (int i = 0; i < rules_count; i++) {
+        if ((rules[i].device_class == -1 || rules[i].device_class == device_class) &&
+            (rules[i].vendor_id == -1 || rules[i].vendor_id == vendor_id) &&
+            (rules[i].product_id == -1 || rules[i].product_id == product_id) &&
+            (rules[i].device_version_bcd == -1 ||
+                rules[i].device_version_bcd == version_bcd)) {
+            return !!rules[i].allow;
+        }
+    }
+    return !!default_allow;
+}
+
+/* values used by the rules for a field, plus the smallest value used by none */
+static std::vector<int> field_values(const struct usbredirfilter_rule *a, int a_count,
+                                     const struct usbredirfilter_rule *b, int b_count,
+                                     int field)
+{
+    std::set<int> used;
+    std::vector<int> values;
+
+    for (int i = 0; i < a_count; i++) {
+        used.insert(get_field(&a[i], field));
+    }
+    for (int i = 0; i < b_count; i++) {
+        used.insert(get_field(&b[i], field));
+    }
+    used.erase(-1);
+    values.assign(used.begin(), used.end());
+    for (int v = 0; v <= field_max[field]; v++) {
+        if (!used.count(v)) {
+            values.push_back(v);
+            break;
+        }
+    }
+    return values;
+}
+
+int filteropt_verify(const struct usbredirfilter_rule *a, int a_count,
+                     const struct usbredirfilter_rule *b, int b_count, int default_allow,
+                     uint64_t max_points, uint64_t *points,
+                     struct usbredirfilter_rule *counterexample)
+{
+    std::vector<int> values[FILTEROPT_FIELDS];
+    uint64_t total = 1, checked = 0;
+
+    for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+        values[f] = field_values(a, a_count, b, b_count, f);
+        total *= values[f].size();
+        if (total > max_points) {
+            return -E2BIG;
+        }
+    }
+    for (size_t c = 0; c < values[0].size(); c++) {
+        for (size_t v = 0; v < values[1].size(); v++) {
+            for (size_t p = 0; p < values[2].size(); p++) {
+                for (size_t d = 0; d < values[3].size(); d++) {
+                    int point[FILTEROPT_FIELDS] = {values[0][c], values[1][v],
+                                                   values[2][p], values[3][d]};
+                    int allow = filteropt_match(a, a_count, point[0], point[1], point[2],
+                                                point[3], default_allow);
+                    checked++;
+                    if (allow == filteropt_match(b, b_count, point[0], point[1],
+                                                 point[2], point[3], default_allow)) {
+                        continue;
+                    }
+                    if (counterexample) {
+                        for (int f = 0; f < FILTEROPT_FIELDS; f++) {
+                            set_field(counterexample, f, point[f]);
+                        }
+                        counterexample->allow = allow;
+                    }
+                    if (points) {
+                        *points = checked;
+                    }
+                    return 0;
+                }
+            }
+        }
+    }
+    if (points) {
+        *points = checked;
+    }
+    return 1;
+}
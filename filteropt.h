@@ -0,0 +1,51 @@
+#ifndef _H_FILTEROPT
+#define _H_FILTEROPT
+
+#include <stdio.h>
+#include <stdint.h>
+#include "usbredirfilter.h"
+
+/* Offline optimizer for usbredirfilter rule sets. Rules are matched first-match, so
+   a rule fully covered by an earlier rule never matches (shadowed), and a rule whose
+   matches would get the same verdict from the rules after it (or the default) can be
+   dropped (redundant). Adjacent rules differing in a single field whose values cover
+   that whole field are merged into one wildcard rule. */
+
+typedef struct FilterOptReport {
+    int original_count;
+    int optimized_count;
+    int shadowed;
+    int redundant;
+    int merged;
+    int verified;               /* 1 equivalent, 0 not equivalent, -1 not checked */
+    uint64_t checked_points;
+} FilterOptReport;
+
+/* The optimized rules are returned in rules_ret, to be free()-d by the caller.
+   default_allow is the verdict when no rule matches, as per
+   usbredirfilter_fl_default_allow. Each change is described on out, if not NULL.
+
+   Return value: 0 on success, -ENOMEM or -EINVAL for invalid rules. */
+int filteropt_optimize(const struct usbredirfilter_rule *rules, int rules_count,
+                       int default_allow, struct usbredirfilter_rule **rules_ret,
+                       int *rules_count_ret, FilterOptReport *report, FILE *out);
+
+/* Proves both rule sets give the same first-match verdict for every
+   class/vendor/product/version. Each field is reduced to the values used by either
+   set plus one value used by none, which covers every distinct behaviour. Since
+   usbredirfilter_check runs the same first-match pass for the device and for each
+   interface, equal verdicts here mean equal usbredirfilter_check results.
+
+   Return value: 1 equivalent, 0 not equivalent (the differing point goes to
+   counterexample if not NULL), -E2BIG when more than max_points would be checked. */
+int filteropt_verify(const struct usbredirfilter_rule *a, int a_count,
+                     const struct usbredirfilter_rule *b, int b_count, int default_allow,
+                     uint64_t max_points, uint64_t *points,
+                     struct usbredirfilter_rule *counterexample);
+
+/* first-match verdict, 1 allow or 0 deny */
+int filteropt_match(const struct usbredirfilter_rule *rules, int rules_count,
+                    int device_class, int vendor_id, int product_id, int version_bcd,
+                    int default_allow);
+
+#endif
@@ -0,0 +1,318 @@
+#include "journal.h"
+#include "vdlog.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define JOURNAL_MAGIC    0x4c4e524a /* "JRNL" */
+#define JOURNAL_VERSION  1
+#define JOURNAL_SIZE     (64 * 1024)
+#define JOURNAL_CAPACITY (JOURNAL_SIZE / sizeof(JournalRecord))
+
+/* stored in record 0 */
+typedef struct JournalHeader {
+    UINT32 magic;
+    UINT32 version;
+} JournalHeader;
+
+static UINT16 journal_check(UINT16 type, UINT16 vid, UINT16 pid)
+{
+    return (UINT16)~(type ^ vid ^ (UINT16)((pid << 3) | (pid >> 13)));
+}
+
+static DWORD journal_key(UINT16 vid, UINT16 pid)
+{
+    return ((DWORD)vid << 16) | pid;
+}
+
+Journal::Journal()
+    : _file (INVALID_HANDLE_VALUE)
+    , _mapping (NULL)
+    , _records (NULL)
+    , _count (0)
+    , _closed (false)
+    , _compact_event (NULL)
+    , _compact_thread (NULL)
+    , _stop (false)
+    , _appended (0)
+    , _compactions (0)
+{
+    _path[0] = '\0';
+    InitializeCriticalSection(&_lock);
+}
+
+Journal::~Journal()
+{
+    close();
+    DeleteCriticalSection(&_lock);
+}
+
+/* maps the journal, creating it if needed, and returns the devices installed for a
+   session that were not removed since */
+bool Journal::open(const char* path, JournalDevs* live)
+{
+    DWORD start_time = GetTickCount();
+    JournalHeader* hdr;
+    bool torn = false;
+
+    EnterCriticalSection(&_lock);
+    strncpy(_path, path, MAX_PATH);
+    _path[MAX_PATH - 1] = '\0';
+    if (!map()) {
+        /* nothing will take the early records */
+        _early.clear();
+        _closed = true;
+        LeaveCriticalSection(&_lock);
+        return false;
+    }
+    hdr = (JournalHeader*)_records;
+    if (hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION) {
+        if (hdr->magic) {
+            vd_printf("Journal %s has unknown format, discarded", _path);
+        }
+        ZeroMemory(_records, JOURNAL_SIZE);
+        hdr->magic = JOURNAL_MAGIC;
+        hdr->version = JOURNAL_VERSION;
+    }
+    _live.clear();
+    for (_count = 1; _count < JOURNAL_CAPACITY && _records[_count].type; _count++) {
+        JournalRecord* r = &_records[_count];
+        if (r->check != journal_check(r->type, r->vid, r->pid)) {
+            torn = true;
+            break;
+        }
+        if (r->type == JOURNAL_INSTALL) {
+            _live.insert(journal_key(r->vid, r->pid));
+        } else {
+            _live.erase(journal_key(r->vid, r->pid));
+        }
+    }
+    if (torn) {
+        /* new records go right after the last valid one */
+        vd_printf("Journal record %lu torn, ignoring the rest", _count);
+        ZeroMemory(&_records[_count], (JOURNAL_CAPACITY - _count) * sizeof(JournalRecord));
+    }
+    /* a device removed meanwhile is not live anymore */
+    for (std::list<JournalRecord>::iterator r = _early.begin(); r != _early.end(); r++) {
+        append_locked(r->type, r->vid, r->pid);
+    }
+    _early.clear();
+    for (std::set<DWORD>::iterator key = _live.begin(); key != _live.end(); key++) {
+        JournalDev dev = {(UINT16)(*key >> 16), (UINT16)(*key & 0xffff)};
+        live->push_back(dev);
+    }
+    vd_printf("Journal replay of %lu records took %lums, %u devices live",
+              _count - 1, GetTickCount() - start_time, (unsigned)_live.size());
+    _stop = false;
+    _compact_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (_compact_event) {
+        _compact_thread = CreateThread(NULL, 0, compact_thread, this, 0, NULL);
+        if (_appended) {
+            /* flushes the early records */
+            SetEvent(_compact_event);
+        }
+    }
+    LeaveCriticalSection(&_lock);
+    return true;
+}
+
+void Journal::close()
+{
+    if (_compact_thread) {
+        _stop = true;
+        SetEvent(_compact_event);
+        WaitForSingleObject(_compact_thread, INFINITE);
+        CloseHandle(_compact_thread);
+        _compact_thread = NULL;
+    }
+    if (_compact_event) {
+        CloseHandle(_compact_event);
+        _compact_event = NULL;
+    }
+    EnterCriticalSection(&_lock);
+    if (_records) {
+        flush();
+        vd_printf("Journal: %lu records appended, %lu compactions", _appended, _compactions);
+    }
+    unmap();
+    _early.clear();
+    _closed = true;
+    LeaveCriticalSection(&_lock);
+}
+
+/* records a session install, or a driver removal of a session installed device */
+bool Journal::append(UINT16 type, UINT16 vid, UINT16 pid)
+{
+    bool ret = true;
+
+    EnterCriticalSection(&_lock);
+    if (_records) {
+        ret = append_locked(type, vid, pid);
+    } else if (!_closed) {
+        JournalRecord r = {type, vid, pid, 0};
+        _early.push_back(r);
+    } else {
+        ret = false;
+    }
+    LeaveCriticalSection(&_lock);
+    return ret;
+}
+
+/* records that do not change the live devices are skipped. Called with _lock held */
+bool Journal::append_locked(UINT16 type, UINT16 vid, UINT16 pid)
+{
+    DWORD key = journal_key(vid, pid);
+    bool ret = true;
+
+    if ((type == JOURNAL_INSTALL) == (_live.find(key) != _live.end())) {
+        /* already in that state */
+    } else if (_count == JOURNAL_CAPACITY && !compact()) {
+        ret = false;
+    } else {
+        JournalRecord r = {type, vid, pid, journal_check(type, vid, pid)};
+        _records[_count++] = r;
+        if (type == JOURNAL_INSTALL) {
+            _live.insert(key);
+        } else {
+            _live.erase(key);
+        }
+        _appended++;
+        if (_compact_event) {
+            SetEvent(_compact_event);
+        }
+    }
+    return ret;
+}
+
+/* FlushViewOfFile only writes the dirty pages to the file, the file buffers must be
+   flushed for the records to reach the disk. Called with _lock held */
+void Journal::flush()
+{
+    FlushViewOfFile(_records, 0);
+    FlushFileBuffers(_file);
+}
+
+/* called with _lock held */
+bool Journal::map()
+{
+    _file = CreateFileA(_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE) {
+        vd_printf("Failed opening journal %s: %ld", _path, GetLastError());
+        return false;
+    }
+    /* the file grows to JOURNAL_SIZE, zero filled */
+    _mapping = CreateFileMapping(_file, NULL, PAGE_READWRITE, 0, JOURNAL_SIZE, NULL);
+    if (!_mapping) {
+        vd_printf("CreateFileMapping() failed: %ld", GetLastError());
+        unmap();
+        return false;
+    }
+    _records = (JournalRecord*)MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, JOURNAL_SIZE);
+    if (!_records) {
+        vd_printf("MapViewOfFile() failed: %ld", GetLastError());
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+void Journal::unmap()
+{
+    if (_records) {
+        UnmapViewOfFile(_records);
+        _records = NULL;
+    }
+    if (_mapping) {
+        CloseHandle(_mapping);
+        _mapping = NULL;
+    }
+    if (_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(_file);
+        _file = INVALID_HANDLE_VALUE;
+    }
+}
+
+/* maps the journal again once compact() unmapped it. On failure the journal is closed,
+   so appends fail instead of queueing as before open(), which nothing would apply.
+   Called with _lock held */
+bool Journal::remap()
+{
+    if (map()) {
+        return true;
+    }
+    vd_printf("Journal closed, session installs are no longer journaled");
+    _closed = true;
+    return false;
+}
+
+/* writes the live records to path.tmp and replaces the journal with it, so a crash
+   leaves either the old or the new journal. Called with _lock held */
+bool Journal::compact()
+{
+    char tmp_path[MAX_PATH];
+    std::vector<JournalRecord> records(1);
+    JournalHeader hdr = {JOURNAL_MAGIC, JOURNAL_VERSION};
+    DWORD start_time = GetTickCount();
+    DWORD bytes;
+    HANDLE file;
+    bool ret;
+
+    memcpy(&records[0], &hdr, sizeof(hdr));
+    for (std::set<DWORD>::iterator key = _live.begin(); key != _live.end(); key++) {
+        UINT16 vid = (UINT16)(*key >> 16), pid = (UINT16)(*key & 0xffff);
+        JournalRecord r = {JOURNAL_INSTALL, vid, pid, journal_check(JOURNAL_INSTALL, vid, pid)};
+        records.push_back(r);
+    }
+    _snprintf(tmp_path, MAX_PATH, "%s.tmp", _path);
+    file = CreateFileA(tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        vd_printf("Failed creating %s: %ld", tmp_path, GetLastError());
+        return false;
+    }
+    ret = WriteFile(file, &records[0], records.size() * sizeof(JournalRecord), &bytes, NULL) &&
+          FlushFileBuffers(file);
+    CloseHandle(file);
+    if (!ret) {
+        vd_printf("Failed writing %s: %ld", tmp_path, GetLastError());
+        DeleteFileA(tmp_path);
+        return false;
+    }
+    unmap();
+    if (!MoveFileExA(tmp_path, _path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        vd_printf("Failed replacing journal: %ld", GetLastError());
+        DeleteFileA(tmp_path);
+        return remap();
+    }
+    if (!remap()) {
+        return false;
+    }
+    vd_printf("Journal compacted from %lu to %u records in %lums", _count - 1,
+              (unsigned)records.size() - 1, GetTickCount() - start_time);
+    _count = records.size();
+    _compactions++;
+    return true;
+}
+
+/* flushes the view after appends, so records survive a power loss too, and compacts
+   the journal once half full */
+DWORD WINAPI Journal::compact_thread(LPVOID param)
+{
+    Journal* j = (Journal*)param;
+
+    while (!j->_stop) {
+        WaitForSingleObject(j->_compact_event, INFINITE);
+        if (j->_stop) {
+            break;
+        }
+        EnterCriticalSection(&j->_lock);
+        if (j->_records && j->_count >= JOURNAL_CAPACITY / 2) {
+            j->compact();
+        } else if (j->_records) {
+            j->flush();
+        }
+        LeaveCriticalSection(&j->_lock);
+    }
+    return 0;
+}
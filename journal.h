@@ -0,0 +1,66 @@
+#ifndef _H_JOURNAL
+#define _H_JOURNAL
+
+#include <windows.h>
+#include <list>
+#include <set>
+
+#define JOURNAL_INSTALL 1
+#define JOURNAL_REMOVE  2
+
+/* a zero type ends the journal, a bad check marks a record torn by a crash */
+typedef struct JournalRecord {
+    UINT16 type;
+    UINT16 vid;
+    UINT16 pid;
+    UINT16 check;
+} JournalRecord;
+
+typedef struct JournalDev {
+    UINT16 vid;
+    UINT16 pid;
+} JournalDev;
+
+typedef std::list<JournalDev> JournalDevs;
+
+/* Append-only, memory-mapped journal of session installs & driver removals, replayed
+   on startup to find the devices a crashed service left with WinUSB bound. Appending
+   is a store to the mapped view; the background thread flushes the view and the file
+   and, once it is half full, rewrites the journal with only the live records. Records
+   appended before the journal is opened, e.g. removals that do not wait for startup,
+   are kept and appended once it is. */
+class Journal {
+public:
+    Journal();
+    ~Journal();
+    bool open(const char* path, JournalDevs* live);
+    void close();
+    bool append(UINT16 type, UINT16 vid, UINT16 pid);
+
+private:
+    bool append_locked(UINT16 type, UINT16 vid, UINT16 pid);
+    void flush();
+    bool map();
+    void unmap();
+    bool remap();
+    bool compact();
+    static DWORD WINAPI compact_thread(LPVOID param);
+
+private:
+    CRITICAL_SECTION _lock;
+    char _path[MAX_PATH];
+    HANDLE _file;
+    HANDLE _mapping;
+    JournalRecord* _records;
+    DWORD _count;
+    std::set<DWORD> _live;
+    std::list<JournalRecord> _early;
+    bool _closed;
+    HANDLE _compact_event;
+    HANDLE _compact_thread;
+    bool _stop;
+    DWORD _appended;
+    DWORD _compactions;
+};
+
+#endif
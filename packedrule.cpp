@@ -0,0 +1,250 @@
+#include "packedrule.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#define PACKED_RULE_WILDCARD_SHIFT 56
+#define PACKED_RULE_KEY_MASK       ((1ULL << 56) - 1)
+
+/* bits compared for each wildcard mask value */
+static const uint64_t compare_mask[16] = {
+#define M(mask) (PACKED_RULE_KEY_MASK & \
+                 ~(((mask) & 1 ? 0xffffULL : 0) | ((mask) & 2 ? 0xffffULL << 16 : 0) | \
+                   ((mask) & 4 ? 0xffffULL << 32 : 0) | ((mask) & 8 ? 0xffULL << 48 : 0)))
+    M(0), M(1), M(2), M(3), M(4), M(5), M(6), M(7),
+    M(8), M(9), M(10), M(11), M(12), M(13), M(14), M(15)
+#undef M
+};
+
+static inline uint64_t packed_key(uint8_t device_class, uint16_t vendor_id,
+                                  uint16_t product_id, uint16_t device_version_bcd)
+{
+    return ((uint64_t)device_class << 48) | ((uint64_t)vendor_id << 32) |
+           ((uint64_t)product_id << 16) | device_version_bcd;
+}
+
+int packedrule_from_rules(const struct usbredirfilter_rule *rules, int rules_count,
+                          PackedRule **packed_ret)
+{
+    PackedRule *packed;
+
+    if (usbredirfilter_verify(rules, rules_count)) {
+        return -EINVAL;
+    }
+    packed = (PackedRule *)malloc(sizeof(PackedRule) * (rules_count ? rules_count : 1));
+    if (!packed) {
+        return -ENOMEM;
+    }
+    for (int i = 0; i < rules_count; i++) {
+        const struct usbredirfilter_rule *rule = &rules[i];
+        PackedRule p = 0;
+
+        if (rule->device_class == -1) {
+            p |= PACKED_RULE_ANY_CLASS;
+        } else {
+            p |= (uint64_t)rule->device_class << 48;
+        }
+        if (rule->vendor_id == -1) {
+            p |= PACKED_RULE_ANY_VENDOR;
+        } else {
+            p |= (uint64_t)rule->vendor_id << 32;
+        }
+        if (rule->product_id == -1) {
+            p |= PACKED_RULE_ANY_PRODUCT;
+        } else {
+            p |= (uint64_t)rule->product_id << 16;
+        }
+        if (rule->device_version_bcd == -1) {
+            p |= PACKED_RULE_ANY_VERSION;
+        } else {
+            p |= (uint64_t)rule->device_version_bcd;
+        }
+        if (rule->allow) {
+            p |= PACKED_RULE_ALLOW;
+        }
+        packed[i] = p;
+    }
+    *packed_ret = packed;
+    return 0;
+}
+
+int packedrule_to_rules(const PackedRule *packed, int rules_count,
+                        struct usbredirfilter_rule **rules_ret)
+{
+    struct usbredirfilter_rule *rules;
+
+    rules = (struct usbredirfilter_rule *)malloc(sizeof(*rules) *
+                                                 (rules_count ? rules_count : 1));
+    if (!rules) {
+        return -ENOMEM;
+    }
+    for (int i = 0; i < rules_count; i++) {
+        PackedRule p = packed[i];
+
+        rules[i].device_class = p & PACKED_RULE_ANY_CLASS ? -1 : (int)((p >> 48) & 0xff);
+        rules[i].vendor_id = p & PACKED_RULE_ANY_VENDOR ? -1 : (int)((p >> 32) & 0xffff);
+        rules[i].product_id = p & PACKED_RULE_ANY_PRODUCT ? -1 : (int)((p >> 16) & 0xffff);
+        rules[i].device_version_bcd = p & PACKED_RULE_ANY_VERSION ? -1 : (int)(p & 0xffff);
+        rules[i].allow = !!(p & PACKED_RULE_ALLOW);
+    }
+    *rules_ret = rules;
+    return 0;
+}
+
+/* first-match pass over the rules, as usbredirfilter_check1 */
+static int packedrule_check1(const PackedRule *packed, int rules_count, uint64_t key,
+                             int default_allow, uint32_t *hits)
+{
+    for (int i = 0; i < rules_count; i++) {
+        PackedRule p = packed[i];
+
+        if (((p ^ key) & compare_mask[(p >> PACKED_RULE_WILDCARD_SHIFT) & 0xf]) == 0) {
+            if (hits) {
+                hits[i]++;
+            }
+            return p & PACKED_RULE_ALLOW ? 0 : -EPERM;
+        }
+    }
+    if (hits) {
+        hits[rules_count]++;
+    }
+    return default_allow ? 0 : -EPERM;
+}
+
+int packedrule_check(const PackedRule *packed, int rules_count,
+                     uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
+                     uint8_t *interface_class, uint8_t *interface_subclass,
+                     uint8_t *interface_protocol, int interface_count,
+                     uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+                     int flags)
+{
+    return packedrule_check_hits(packed, rules_count, device_class, device_subclass,
+                                 device_protocol, interface_class, interface_subclass,
+                                 interface_protocol, interface_count, vendor_id, product_id,
+                                 device_version_bcd, flags, NULL);
+}
+
+/* the device subclass & protocol take no part, as in usbredirfilter_check */
+int packedrule_check_hits(const PackedRule *packed, int rules_count,
+                          uint8_t device_class, uint8_t /* device_subclass */,
+                          uint8_t /* device_protocol */, uint8_t *interface_class,
+                          uint8_t *interface_subclass, uint8_t *interface_protocol,
+                          int interface_count, uint16_t vendor_id, uint16_t product_id,
+                          uint16_t device_version_bcd, int flags, uint32_t *hits)
+{
+    uint64_t key = packed_key(0, vendor_id, product_id, device_version_bcd);
+    int default_allow = flags & usbredirfilter_fl_default_allow;
+    int rc;
+
+    /* same class & boot hid skipping as usbredirfilter_check */
+    if (device_class != 0x00 && device_class != 0xef) {
+        rc = packedrule_check1(packed, rules_count, key | ((uint64_t)device_class << 48),
+                               default_allow, hits);
+        if (rc) {
+            return rc;
+        }
+    }
+    for (int i = 0; i < interface_count; i++) {
+        if (!(flags & usbredirfilter_fl_dont_skip_non_boot_hid) &&
+            interface_count > 1 && interface_class[i] == 0x03 &&
+            interface_subclass[i] == 0x00 && interface_protocol[i] == 0x00) {
+            continue;
+        }
+        rc = packedrule_check1(packed, rules_count,
+                               key | ((uint64_t)interface_class[i] << 48), default_allow,
+                               hits);
+        if (rc) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+int packedrule_overlaps(PackedRule a, PackedRule b)
+{
+    return ((a ^ b) & compare_mask[(a >> PACKED_RULE_WILDCARD_SHIFT) & 0xf] &
+            compare_mask[(b >> PACKED_RULE_WILDCARD_SHIFT) & 0xf]) == 0;
+}
+
+/* rules which must keep their relative order: some device matches both, with
+   different verdicts */
+static bool packedrule_conflict(PackedRule a, PackedRule b)
+{
+    return ((a ^ b) & PACKED_RULE_ALLOW) && packedrule_overlaps(a, b);
+}
+
+/* Greedy: of the rules with no conflicting rule before them left to place, the one
+   leading to the most hits goes next, counting the hits of the rules it holds back,
+   the earliest on ties, so rules without hits keep their order. The result is kept
+   only if it scans fewer rules. Keeping every conflicting pair in order keeps verdicts:
+   were the new first match of a device another rule than the old one, both would match
+   it, so with different verdicts they would conflict & the old one would still come
+   first. */
+int packedrule_reorder(const PackedRule *packed, int rules_count, const uint32_t *hits,
+                       int *order)
+{
+    int *blockers;
+    uint32_t *lead;
+    bool *placed;
+    int best;
+
+    blockers = (int *)calloc(rules_count ? rules_count : 1, sizeof(int));
+    lead = (uint32_t *)calloc(rules_count ? rules_count : 1, sizeof(uint32_t));
+    placed = (bool *)calloc(rules_count ? rules_count : 1, sizeof(bool));
+    if (!blockers || !lead || !placed) {
+        free(blockers);
+        free(lead);
+        free(placed);
+        return -ENOMEM;
+    }
+    for (int i = rules_count - 1; i >= 0; i--) {
+        lead[i] = hits[i];
+        for (int j = i + 1; j < rules_count; j++) {
+            if (packedrule_conflict(packed[i], packed[j])) {
+                blockers[j]++;
+                if (lead[j] > lead[i]) {
+                    lead[i] = lead[j];
+                }
+            }
+        }
+    }
+    for (int n = 0; n < rules_count; n++) {
+        best = -1;
+        for (int i = 0; i < rules_count; i++) {
+            if (placed[i] || blockers[i]) {
+                continue;
+            }
+            if (best == -1 || lead[i] > lead[best] ||
+                    (lead[i] == lead[best] && hits[i] > hits[best])) {
+                best = i;
+            }
+        }
+        /* the earliest unplaced rule has no blockers, so there is always one */
+        placed[best] = true;
+        order[n] = best;
+        for (int j = best + 1; j < rules_count; j++) {
+            if (packedrule_conflict(packed[best], packed[j])) {
+                blockers[j]--;
+            }
+        }
+    }
+    if (packedrule_scan_cost(rules_count, hits, order) >=
+            packedrule_scan_cost(rules_count, hits, NULL)) {
+        for (int i = 0; i < rules_count; i++) {
+            order[i] = i;
+        }
+    }
+    free(blockers);
+    free(lead);
+    free(placed);
+    return 0;
+}
+
+uint64_t packedrule_scan_cost(int rules_count, const uint32_t *hits, const int *order)
+{
+    uint64_t cost = (uint64_t)hits[rules_count] * rules_count;
+
+    for (int i = 0; i < rules_count; i++) {
+        cost += (uint64_t)hits[order ? order[i] : i] * (i + 1);
+    }
+    return cost;
+}
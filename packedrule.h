@@ -0,0 +1,63 @@
+#ifndef _H_PACKEDRULE
+#define _H_PACKEDRULE
+
+#include <stdint.h>
+#include "usbredirfilter.h"
+
+/* A usbredirfilter_rule packed into 8 bytes instead of 20:
+   bits  0-15 device_version_bcd, 16-31 product_id, 32-47 vendor_id, 48-55 device_class,
+   56-59 wildcard mask (one bit per field, same order), 60 allow.
+   A device is matched by xor-ing its key against the rule and masking out the
+   wildcard fields, so there is no per-field -1 comparison. */
+typedef uint64_t PackedRule;
+
+#define PACKED_RULE_ANY_VERSION (1ULL << 56)
+#define PACKED_RULE_ANY_PRODUCT (1ULL << 57)
+#define PACKED_RULE_ANY_VENDOR  (1ULL << 58)
+#define PACKED_RULE_ANY_CLASS   (1ULL << 59)
+#define PACKED_RULE_ALLOW       (1ULL << 60)
+
+/* packs rules into a newly malloc()-ed array returned in packed_ret.
+   Return value: 0 on success, -EINVAL for invalid rules, -ENOMEM */
+int packedrule_from_rules(const struct usbredirfilter_rule *rules, int rules_count,
+                          PackedRule **packed_ret);
+
+/* unpacks into a newly malloc()-ed array returned in rules_ret.
+   Return value: 0 on success, -ENOMEM */
+int packedrule_to_rules(const PackedRule *packed, int rules_count,
+                        struct usbredirfilter_rule **rules_ret);
+
+/* same as usbredirfilter_check, on packed rules */
+int packedrule_check(const PackedRule *packed, int rules_count,
+                     uint8_t device_class, uint8_t device_subclass, uint8_t device_protocol,
+                     uint8_t *interface_class, uint8_t *interface_subclass,
+                     uint8_t *interface_protocol, int interface_count,
+                     uint16_t vendor_id, uint16_t product_id, uint16_t device_version_bcd,
+                     int flags);
+
+/* as packedrule_check, also counting in hits the rule each first-match pass stopped at,
+   hits[rules_count] for passes matching no rule. Not locked: concurrent checks may lose
+   counts, which only blurs the profile */
+int packedrule_check_hits(const PackedRule *packed, int rules_count,
+                          uint8_t device_class, uint8_t device_subclass,
+                          uint8_t device_protocol, uint8_t *interface_class,
+                          uint8_t *interface_subclass, uint8_t *interface_protocol,
+                          int interface_count, uint16_t vendor_id, uint16_t product_id,
+                          uint16_t device_version_bcd, int flags, uint32_t *hits);
+
+/* some device is matched by both rules */
+int packedrule_overlaps(PackedRule a, PackedRule b);
+
+/* Orders the rules by decreasing hits, as counted by packedrule_check_hits, as far as
+   first-match allows: a rule only moves ahead of rules it shares no device with or
+   which have the same verdict, so each device still gets the verdict of the first rule
+   matching it before. order gets the original index of each rule in the new order.
+   Return value: 0 on success, -ENOMEM */
+int packedrule_reorder(const PackedRule *packed, int rules_count, const uint32_t *hits,
+                       int *order);
+
+/* rules the profiled passes would have scanned with the rules in order, NULL for the
+   current order. Passes matching no rule scan all of them */
+uint64_t packedrule_scan_cost(int rules_count, const uint32_t *hits, const int *order);
+
+#endif
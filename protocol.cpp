@@ -0,0 +1,41 @@
+#include "protocol.h"
+
+int usb_clerk_check_message(const void* buffer, UINT32 bytes)
+{
+    const USBClerkHeader *hdr = (const USBClerkHeader *)buffer;
+    bool valid_size;
+
+    if (bytes < sizeof(USBClerkHeader) || hdr->magic != USB_CLERK_MAGIC) {
+        return USB_CLERK_MSG_BAD_MAGIC;
+    }
+    switch (hdr->type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+    case USB_CLERK_DRIVER_INSTALL:
+    case USB_CLERK_DRIVER_REMOVE:
+        valid_size = (hdr->size == sizeof(USBClerkDriverOp) ||
+                      hdr->size == sizeof(USBClerkDriverOpEx));
+        break;
+    case USB_CLERK_DRIVER_CANCEL:
+        valid_size = (hdr->size == sizeof(USBClerkDriverCancel));
+        break;
+    case USB_CLERK_RING_SETUP:
+        valid_size = (hdr->size == sizeof(USBClerkRingSetup));
+        break;
+    case USB_CLERK_DRIVER_BATCH:
+        valid_size = (hdr->size == sizeof(USBClerkDriverBatch) ||
+                      hdr->size == sizeof(USBClerkDriverBatchEx));
+        break;
+    case USB_CLERK_KEEPALIVE:
+        valid_size = (hdr->size == sizeof(USBClerkHeader));
+        break;
+    default:
+        return USB_CLERK_MSG_UNKNOWN_TYPE;
+    }
+    if (!valid_size) {
+        return USB_CLERK_MSG_BAD_SIZE;
+    }
+    if (hdr->size > bytes) {
+        return USB_CLERK_MSG_TRUNCATED;
+    }
+    return USB_CLERK_MSG_VALID;
+}
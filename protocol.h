@@ -0,0 +1,17 @@
+#ifndef _H_PROTOCOL
+#define _H_PROTOCOL
+
+#include "usbclerk.h"
+
+enum {
+    USB_CLERK_MSG_VALID,
+    USB_CLERK_MSG_BAD_MAGIC,    /* or shorter than a header */
+    USB_CLERK_MSG_UNKNOWN_TYPE,
+    USB_CLERK_MSG_BAD_SIZE,     /* header size does not fit the type */
+    USB_CLERK_MSG_TRUNCATED,    /* fewer bytes read than the header size */
+};
+
+/* validates a message of bytes read from the pipe, before it is dispatched */
+int usb_clerk_check_message(const void* buffer, UINT32 bytes);
+
+#endif
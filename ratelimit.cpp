@@ -0,0 +1,61 @@
+#include "ratelimit.h"
+
+TokenBucket::TokenBucket()
+    : _tokens (0)
+    , _capacity (0)
+    , _rate (0)
+    , _last (0)
+{
+}
+
+/* starts full, so a new client can do a burst right away. A rate of 0 does not
+   limit, a burst of 0 is taken as 1 */
+void TokenBucket::init(uint32_t rate, uint32_t burst, uint32_t now)
+{
+    _rate = rate;
+    _capacity = (uint64_t)(burst ? burst : 1) * 1000;
+    _tokens = _capacity;
+    _last = now;
+}
+
+/* now is in ms and may wrap around */
+void TokenBucket::refill(uint32_t now)
+{
+    uint32_t elapsed = now - _last;
+    /* a rate of 1 per minute refills a thousandth every 60ms */
+    uint64_t added = (uint64_t)elapsed * _rate / 60;
+
+    if (_tokens + added >= _capacity) {
+        _tokens = _capacity;
+        _last = now;
+    } else if (added) {
+        /* only the time that made whole thousandths is used up, frequent calls
+           must not lose the rest */
+        _tokens += added;
+        _last += (uint32_t)(added * 60 / _rate);
+    }
+}
+
+/* whole tokens available */
+uint32_t TokenBucket::available(uint32_t now)
+{
+    if (!_rate) {
+        return (uint32_t)-1;
+    }
+    refill(now);
+    return (uint32_t)(_tokens / 1000);
+}
+
+/* takes count tokens if all are available, otherwise none */
+bool TokenBucket::take(uint32_t now, uint32_t count)
+{
+    if (!_rate) {
+        return true;
+    }
+    refill(now);
+    if (_tokens < (uint64_t)count * 1000) {
+        return false;
+    }
+    _tokens -= (uint64_t)count * 1000;
+    return true;
+}
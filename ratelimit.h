@@ -0,0 +1,33 @@
+#ifndef _H_RATELIMIT
+#define _H_RATELIMIT
+
+#include <stdint.h>
+
+/* Token bucket allowing rate operations per minute on average, in bursts of up to
+   burst. Tokens are counted in thousandths so slow rates still refill smoothly.
+   Not locked, callers serialize access. */
+class TokenBucket {
+public:
+    TokenBucket();
+    void init(uint32_t rate, uint32_t burst, uint32_t now);
+    uint32_t available(uint32_t now);
+    bool take(uint32_t now, uint32_t count = 1);
+
+private:
+    void refill(uint32_t now);
+
+private:
+    uint64_t _tokens;
+    uint64_t _capacity;
+    uint32_t _rate;
+    uint32_t _last;
+};
+
+/* the bucket of a client & what it let through */
+typedef struct ClientLimit {
+    TokenBucket bucket;
+    uint32_t allowed;
+    uint32_t throttled;
+} ClientLimit;
+
+#endif
@@ -0,0 +1,74 @@
+#include "retry.h"
+
+Backoff::Backoff(uint32_t initial, uint32_t max, uint32_t seed)
+    : _initial (initial)
+    , _max (max)
+    , _current (initial)
+    , _seed (seed)
+{
+}
+
+uint32_t Backoff::next()
+{
+    uint32_t delay = _current;
+    uint32_t jitter;
+
+    if (_current < _max) {
+        _current = (_current * 2 < _max) ? _current * 2 : _max;
+    }
+    _seed = _seed * 1103515245 + 12345;
+    jitter = delay / 2 ? (_seed >> 16) % (delay / 2) : 0;
+    return delay - delay / 4 + jitter;
+}
+
+RetryScheduler::RetryScheduler(InstallWaiter* waiter, uint32_t budget, uint32_t initial_delay,
+                               uint32_t max_delay, uint32_t idle_slice, uint32_t seed)
+    : _waiter (waiter)
+    , _backoff (initial_delay, max_delay, seed)
+    , _budget (budget)
+    , _idle_slice (idle_slice)
+    , _waited (0)
+    , _waits (0)
+    , _idle_supported (true)
+{
+}
+
+/* returns true when the installation should be retried, false when the budget is
+   used up or the operation was aborted */
+bool RetryScheduler::wait()
+{
+    uint32_t start = _waiter->now();
+    uint32_t left, delay;
+    bool busy = false;
+    bool ret = false;
+
+    _waits++;
+    /* idle wait is done in slices, so an abort is noticed in time */
+    while (_idle_supported && _waited + (_waiter->now() - start) < _budget) {
+        left = _budget - _waited - (_waiter->now() - start);
+        int r = _waiter->wait_idle(left < _idle_slice ? left : _idle_slice);
+        if (r == INSTALL_WAIT_IDLE) {
+            if (busy) {
+                _backoff.reset();
+            }
+            break;
+        } else if (r == INSTALL_WAIT_UNSUPPORTED) {
+            _idle_supported = false;
+        } else {
+            busy = true;
+            if (!_waiter->sleep(0)) {
+                goto done;
+            }
+        }
+    }
+    if (_waited + (_waiter->now() - start) >= _budget) {
+        goto done;
+    }
+    left = _budget - _waited - (_waiter->now() - start);
+    delay = _backoff.next();
+    ret = _waiter->sleep(delay < left ? delay : left);
+
+done:
+    _waited += _waiter->now() - start;
+    return ret;
+}
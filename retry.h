@@ -0,0 +1,61 @@
+#ifndef _H_RETRY
+#define _H_RETRY
+
+#include <stdint.h>
+
+enum {
+    INSTALL_WAIT_IDLE,          /* no installations are pending */
+    INSTALL_WAIT_TIMEOUT,
+    INSTALL_WAIT_UNSUPPORTED,   /* the system cannot tell, fall back to backoff only */
+};
+
+/* What RetryScheduler waits on. The service implements it with the system pending
+   install events, benchmarks can implement it with a simulated clock & backend. */
+class InstallWaiter {
+public:
+    virtual ~InstallWaiter() {}
+    virtual uint32_t now() = 0;
+    virtual int wait_idle(uint32_t timeout) = 0;
+    /* returns false if the waiting operation was aborted meanwhile, sleep(0) only
+       checks for that */
+    virtual bool sleep(uint32_t ms) = 0;
+};
+
+/* Exponential backoff delays with +-25% jitter, reset() starts over from initial */
+class Backoff {
+public:
+    Backoff(uint32_t initial, uint32_t max, uint32_t seed);
+    uint32_t next();
+    void reset() { _current = _initial; }
+
+private:
+    uint32_t _initial;
+    uint32_t _max;
+    uint32_t _current;
+    uint32_t _seed;
+};
+
+/* Decides when to retry an installation which failed since another one is pending.
+   Each wait() blocks until the system reports no pending installations, then backs
+   off briefly, as the pending state may linger, all within a total time budget. The
+   backoff starts over once another installation was seen completing, as the delays
+   grown waiting on the previous one say nothing about the next. */
+class RetryScheduler {
+public:
+    RetryScheduler(InstallWaiter* waiter, uint32_t budget, uint32_t initial_delay,
+                   uint32_t max_delay, uint32_t idle_slice, uint32_t seed);
+    bool wait();
+    uint32_t waited() { return _waited; }
+    int waits() { return _waits; }
+
+private:
+    InstallWaiter* _waiter;
+    Backoff _backoff;
+    uint32_t _budget;
+    uint32_t _idle_slice;
+    uint32_t _waited;
+    int _waits;
+    bool _idle_supported;
+};
+
+#endif
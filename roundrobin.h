@@ -0,0 +1,27 @@
+#ifndef _H_ROUNDROBIN
+#define _H_ROUNDROBIN
+
+#include <stdint.h>
+
+/* Round-robin over the owners of queued items, FIFO for each owner: the oldest item of
+   the lowest owner above last, or once past the highest owner, the oldest item of the
+   lowest one. Items are in queue order, owner_of gives the owner of one. Returns end
+   for no items. */
+template <class Iter, class OwnerOf>
+Iter next_owner(Iter begin, Iter end, uint32_t last, OwnerOf owner_of)
+{
+    Iter next = end, first = begin;
+
+    for (Iter i = begin; i != end; i++) {
+        uint32_t owner = owner_of(*i);
+        if (owner > last && (next == end || owner < owner_of(*next))) {
+            next = i;
+        }
+        if (owner < owner_of(*first)) {
+            first = i;
+        }
+    }
+    return next != end ? next : first;
+}
+
+#endif
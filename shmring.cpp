@@ -0,0 +1,247 @@
+#include "shmring.h"
+#include <string.h>
+#ifdef _WIN32
+#include <tchar.h>
+#define shm_ring_barrier() MemoryBarrier()
+#else
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define shm_ring_barrier() __sync_synchronize()
+#endif
+
+uint32_t ShmRing::size(uint32_t slots)
+{
+    return sizeof(ShmRingShared) + slots * sizeof(ShmRingSlot);
+}
+
+ShmRing::ShmRing()
+    : _shared (NULL)
+    , _slot (NULL)
+    , _slots (0)
+    , _signals (0)
+{
+}
+
+/* slots must be a power of 2, up to SHM_RING_MAX_SLOTS. Only one side inits */
+bool ShmRing::attach(void* mem, uint32_t slots, bool init, ShmRingEvent event)
+{
+    if (!slots || slots > SHM_RING_MAX_SLOTS || (slots & (slots - 1))) {
+        return false;
+    }
+    _shared = (ShmRingShared*)mem;
+    _slot = (ShmRingSlot*)(_shared + 1);
+    _slots = slots;
+    _event = event;
+    if (init) {
+        memset(mem, 0, size(slots));
+    }
+    return true;
+}
+
+/* returns false if the ring is full or the message does not fit a slot */
+bool ShmRing::push(const void* msg, uint32_t size)
+{
+    uint32_t head = _shared->head;
+    ShmRingSlot* slot;
+
+    if (size > SHM_RING_SLOT_DATA || head - _shared->tail >= _slots) {
+        return false;
+    }
+    /* the consumer is done with the slot once tail moved past it */
+    shm_ring_barrier();
+    slot = &_slot[head & (_slots - 1)];
+    memcpy(slot->data, msg, size);
+    slot->size = size;
+    shm_ring_barrier();
+    _shared->head = head + 1;
+    /* pairs with the consumer setting waiting before checking head again */
+    shm_ring_barrier();
+    if (_shared->waiting) {
+        signal();
+    }
+    return true;
+}
+
+/* returns the message size, 0 on timeout (in ms) or wake(), -1 if the ring is
+   corrupted or the message is larger than size */
+int ShmRing::pop(void* msg, uint32_t size, uint32_t timeout)
+{
+    uint32_t tail = _shared->tail;
+    uint32_t head = _shared->head;
+    ShmRingSlot* slot;
+    uint32_t msg_size;
+
+    if (head == tail && timeout) {
+        _shared->waiting = 1;
+        shm_ring_barrier();
+        head = _shared->head;
+        if (head == tail) {
+#ifdef _WIN32
+            WaitForSingleObject(_event, timeout);
+#else
+            struct timespec ts = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+            syscall(SYS_futex, &_shared->head, FUTEX_WAIT, head, &ts, NULL, 0);
+#endif
+            head = _shared->head;
+        }
+        _shared->waiting = 0;
+    }
+    if (head == tail) {
+        return 0;
+    }
+    if (head - tail > _slots) {
+        return -1;
+    }
+    shm_ring_barrier();
+    slot = &_slot[tail & (_slots - 1)];
+    msg_size = slot->size;
+    if (msg_size > SHM_RING_SLOT_DATA || msg_size > size) {
+        return -1;
+    }
+    memcpy(msg, slot->data, msg_size);
+    shm_ring_barrier();
+    _shared->tail = tail + 1;
+    return msg_size;
+}
+
+/* wakes a waiting consumer, e.g. to stop it */
+void ShmRing::wake()
+{
+    signal();
+}
+
+void ShmRing::signal()
+{
+    _signals++;
+#ifdef _WIN32
+    SetEvent(_event);
+#else
+    syscall(SYS_futex, &_shared->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+#ifdef _WIN32
+ShmChannel::ShmChannel()
+    : _mapping (NULL)
+    , _view (NULL)
+    , _request_event (NULL)
+    , _reply_event (NULL)
+{
+}
+
+ShmChannel::~ShmChannel()
+{
+    close();
+}
+
+bool ShmChannel::create(const TCHAR* name, uint32_t slots, PSID client)
+{
+    return map(true, name, slots, client);
+}
+
+bool ShmChannel::open(const TCHAR* name, uint32_t slots)
+{
+    return map(false, name, slots, NULL);
+}
+
+/* a created event must be new, not one planted by another process */
+static HANDLE channel_event(bool create, const TCHAR* name, SECURITY_ATTRIBUTES* sec_attr)
+{
+    HANDLE event;
+
+    if (!create) {
+        return OpenEvent(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, name);
+    }
+    event = CreateEvent(sec_attr, FALSE, FALSE, name);
+    if (event && GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(event);
+        return NULL;
+    }
+    return event;
+}
+
+/* the service creates the objects in the global namespace, so clients of any session
+   can open them, with a DACL granting access to the client user only. It fails if the
+   names are already taken */
+bool ShmChannel::map(bool create, const TCHAR* name, uint32_t slots, PSID client)
+{
+    SECURITY_ATTRIBUTES sec_attr;
+    SECURITY_DESCRIPTOR sec_desc;
+    TCHAR event_name[MAX_PATH];
+    DWORD ring_size = ShmRing::size(slots);
+    DWORD acl_size;
+    PACL acl = NULL;
+    bool ret;
+
+    if (!slots || slots > SHM_RING_MAX_SLOTS || (create && !client)) {
+        return false;
+    }
+    InitializeSecurityDescriptor(&sec_desc, SECURITY_DESCRIPTOR_REVISION);
+    if (create) {
+        acl_size = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD) +
+                   GetLengthSid(client);
+        acl = (PACL)LocalAlloc(LPTR, acl_size);
+        if (!acl || !InitializeAcl(acl, acl_size, ACL_REVISION) ||
+            !AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_READ | GENERIC_WRITE | SYNCHRONIZE,
+                                 client) ||
+            !SetSecurityDescriptorDacl(&sec_desc, TRUE, acl, FALSE)) {
+            LocalFree(acl);
+            return false;
+        }
+    }
+    sec_attr.nLength = sizeof(sec_attr);
+    sec_attr.bInheritHandle = FALSE;
+    sec_attr.lpSecurityDescriptor = &sec_desc;
+    if (create) {
+        _mapping = CreateFileMapping(INVALID_HANDLE_VALUE, &sec_attr, PAGE_READWRITE, 0,
+                                     2 * ring_size, name);
+        if (_mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            close();
+            LocalFree(acl);
+            return false;
+        }
+    } else {
+        _mapping = OpenFileMapping(FILE_MAP_WRITE, FALSE, name);
+    }
+    if (!_mapping) {
+        LocalFree(acl);
+        return false;
+    }
+    _view = MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 2 * ring_size);
+    _sntprintf(event_name, MAX_PATH, TEXT("%s-req"), name);
+    _request_event = channel_event(create, event_name, &sec_attr);
+    _sntprintf(event_name, MAX_PATH, TEXT("%s-rep"), name);
+    _reply_event = channel_event(create, event_name, &sec_attr);
+    ret = _view && _request_event && _reply_event &&
+          _requests.attach(_view, slots, create, _request_event) &&
+          _replies.attach((char*)_view + ring_size, slots, create, _reply_event);
+    LocalFree(acl);
+    if (!ret) {
+        close();
+    }
+    return ret;
+}
+
+void ShmChannel::close()
+{
+    if (_view) {
+        UnmapViewOfFile(_view);
+        _view = NULL;
+    }
+    if (_mapping) {
+        CloseHandle(_mapping);
+        _mapping = NULL;
+    }
+    if (_request_event) {
+        CloseHandle(_request_event);
+        _request_event = NULL;
+    }
+    if (_reply_event) {
+        CloseHandle(_reply_event);
+        _reply_event = NULL;
+    }
+}
+#endif
@@ -0,0 +1,85 @@
+#ifndef _H_SHMRING
+#define _H_SHMRING
+
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE ShmRingEvent;
+#else
+typedef int ShmRingEvent;   /* unused, the consumer waits on a futex of the ring head */
+#endif
+
+#define SHM_RING_SLOT_DATA  56
+#define SHM_RING_CACHE_LINE 64
+#define SHM_RING_MAX_SLOTS  1024
+
+typedef struct ShmRingSlot {
+    uint32_t size;
+    uint32_t reserved;
+    uint8_t data[SHM_RING_SLOT_DATA];
+} ShmRingSlot;
+
+/* start of the ring in shared memory, followed by the slots. head & tail are on their
+   own cache lines, as each is written by one side only */
+typedef struct ShmRingShared {
+    volatile uint32_t head;         /* next slot to write, by the producer */
+    uint8_t pad0[SHM_RING_CACHE_LINE - 4];
+    volatile uint32_t tail;         /* next slot to read, by the consumer */
+    uint8_t pad1[SHM_RING_CACHE_LINE - 4];
+    volatile uint32_t waiting;      /* the consumer is about to sleep or sleeping */
+    uint8_t pad2[SHM_RING_CACHE_LINE - 4];
+} ShmRingShared;
+
+/* Single-producer/single-consumer ring of small messages in memory shared by two
+   processes. The producer only signals when the consumer went idle, so a busy
+   consumer is fed without kernel transitions. Each side attaches its own ShmRing to
+   the same memory; the other side is not trusted, so pop() checks what it reads. */
+class ShmRing {
+public:
+    static uint32_t size(uint32_t slots);
+    ShmRing();
+    bool attach(void* mem, uint32_t slots, bool init, ShmRingEvent event);
+    bool push(const void* msg, uint32_t size);
+    int pop(void* msg, uint32_t size, uint32_t timeout);
+    void wake();
+    uint32_t signals() { return _signals; }
+
+private:
+    void signal();
+
+private:
+    ShmRingShared* _shared;
+    ShmRingSlot* _slot;
+    uint32_t _slots;
+    ShmRingEvent _event;
+    uint32_t _signals;
+};
+
+#ifdef _WIN32
+/* The request & reply rings of a pipe connection, in a named mapping created by the
+   service and opened by the client. Events are name-req & name-rep. Only the client
+   the service creates them for can open them. */
+class ShmChannel {
+public:
+    ShmChannel();
+    ~ShmChannel();
+    bool create(const TCHAR* name, uint32_t slots, PSID client);
+    bool open(const TCHAR* name, uint32_t slots);
+    void close();
+    ShmRing* requests() { return &_requests; }
+    ShmRing* replies() { return &_replies; }
+
+private:
+    bool map(bool create, const TCHAR* name, uint32_t slots, PSID client);
+
+private:
+    HANDLE _mapping;
+    void* _view;
+    HANDLE _request_event;
+    HANDLE _reply_event;
+    ShmRing _requests;
+    ShmRing _replies;
+};
+#endif
+
+#endif
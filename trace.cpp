@@ -0,0 +1,279 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#define TRACE_BUFFER_EVENTS 8192
+
+#ifdef _MSC_VER
+#define TRACE_TLS __declspec(thread)
+#else
+#define TRACE_TLS __thread
+#endif
+
+#ifdef _WIN32
+#define TRACE_U64 "%I64u"
+#else
+#define TRACE_U64 "%llu"
+#endif
+
+typedef struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+    int vid;
+    int pid;
+} TraceEvent;
+
+/* events of a single thread, kept as a ring, the oldest events are overwritten. Only
+   the owner thread writes, publishing each event by its count */
+typedef struct TraceBuffer {
+    struct TraceBuffer* next;
+    uint32_t tid;
+    volatile uint32_t count;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    volatile int owned;
+#endif
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+volatile int trace_enabled = 0;
+
+static TRACE_TLS TraceBuffer* trace_buffer = NULL;
+static TraceBuffer* trace_buffers = NULL;
+
+#ifdef _WIN32
+static CRITICAL_SECTION trace_lock;
+static LONG trace_lock_init = 0;
+
+static void lock()
+{
+    /* first caller initializes, others wait for it */
+    if (InterlockedCompareExchange(&trace_lock_init, 1, 0) == 0) {
+        InitializeCriticalSection(&trace_lock);
+        InterlockedExchange(&trace_lock_init, 2);
+    }
+    while (trace_lock_init != 2) {
+        Sleep(0);
+    }
+    EnterCriticalSection(&trace_lock);
+}
+
+static void unlock()
+{
+    LeaveCriticalSection(&trace_lock);
+}
+
+static uint32_t thread_id()
+{
+    return GetCurrentThreadId();
+}
+
+static void barrier()
+{
+    MemoryBarrier();
+}
+
+/* the buffer keeps a handle of its thread, which also keeps its id from being reused */
+static void claim(TraceBuffer* buffer)
+{
+    if (buffer->thread) {
+        CloseHandle(buffer->thread);
+    }
+    if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(),
+                         &buffer->thread, SYNCHRONIZE, FALSE, 0)) {
+        buffer->thread = NULL;
+    }
+}
+
+static bool released(TraceBuffer* buffer)
+{
+    return buffer->thread && WaitForSingleObject(buffer->thread, 0) == WAIT_OBJECT_0;
+}
+
+static uint32_t process_id()
+{
+    return GetCurrentProcessId();
+}
+
+uint64_t trace_now()
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+#else
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock()
+{
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void unlock()
+{
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static uint32_t thread_id()
+{
+    return (uint32_t)syscall(SYS_gettid);
+}
+
+static void barrier()
+{
+    __sync_synchronize();
+}
+
+static void release(void* buffer)
+{
+    ((TraceBuffer*)buffer)->owned = 0;
+}
+
+static void create_key()
+{
+    pthread_key_create(&trace_key, release);
+}
+
+/* the key destructor releases the buffer when the thread exits */
+static void claim(TraceBuffer* buffer)
+{
+    pthread_once(&trace_key_once, create_key);
+    buffer->owned = 1;
+    pthread_setspecific(trace_key, buffer);
+}
+
+static bool released(TraceBuffer* buffer)
+{
+    return !buffer->owned;
+}
+
+static uint32_t process_id()
+{
+    return (uint32_t)getpid();
+}
+
+uint64_t trace_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+#endif
+
+void trace_enable(bool enable)
+{
+    trace_enabled = enable;
+}
+
+/* A thread takes over the buffer of an exited thread before allocating one, so there
+   are only as many buffers as threads ever traced at once. The spans of an exited
+   thread stay dumpable until its buffer is taken over */
+static TraceBuffer* get_buffer()
+{
+    TraceBuffer* buffer;
+
+    lock();
+    for (buffer = trace_buffers; buffer && !released(buffer); buffer = buffer->next);
+    if (!buffer) {
+        buffer = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+        if (!buffer) {
+            unlock();
+            return NULL;
+        }
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+    }
+    buffer->tid = thread_id();
+    buffer->count = 0;
+    claim(buffer);
+    unlock();
+    return buffer;
+}
+
+/* the lock is only taken the first time a thread records */
+void trace_record(const char* name, uint64_t start, uint64_t end, int vid, int pid)
+{
+    TraceBuffer* buffer = trace_buffer;
+    TraceEvent* event;
+
+    if (!buffer) {
+        buffer = get_buffer();
+        if (!buffer) {
+            return;
+        }
+        trace_buffer = buffer;
+    }
+    event = &buffer->events[buffer->count % TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->vid = vid;
+    event->pid = pid;
+    barrier();
+    buffer->count++;
+}
+
+/* Buffers are read while their threads go on recording. An event is copied, then
+   kept only if its slot was not overwritten meanwhile, i.e. the count did not move a
+   whole ring past it. The lock keeps buffers from being taken over */
+bool trace_dump(const char* path)
+{
+    FILE* file;
+    TraceBuffer* buffer;
+    TraceEvent event;
+    uint32_t count, first, i;
+    bool comma = false;
+
+    file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    lock();
+    for (buffer = trace_buffers; buffer; buffer = buffer->next) {
+        count = buffer->count;
+        barrier();
+        first = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+        for (i = first; i < count; i++) {
+            event = buffer->events[i % TRACE_BUFFER_EVENTS];
+            barrier();
+            if (buffer->count - i >= TRACE_BUFFER_EVENTS) {
+                continue;
+            }
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":" TRACE_U64 ",\"dur\":" TRACE_U64 ","
+                    "\"pid\":%u,\"tid\":%u", comma ? ",\n" : "", event.name,
+                    (unsigned long long)event.start,
+                    (unsigned long long)(event.end - event.start), process_id(),
+                    buffer->tid);
+            if (event.vid >= 0) {
+                fprintf(file, ",\"args\":{\"device\":\"%04x:%04x\"}", event.vid, event.pid);
+            }
+            fprintf(file, "}");
+            comma = true;
+        }
+    }
+    unlock();
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
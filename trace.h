@@ -0,0 +1,54 @@
+#ifndef _H_TRACE
+#define _H_TRACE
+
+#include <stdint.h>
+
+/* Optional request tracing, written out as Chrome trace-event JSON (load it in
+   chrome://tracing). Spans are kept in per-thread buffers; with tracing disabled a
+   span costs a single flag test. */
+
+extern volatile int trace_enabled;
+
+void trace_enable(bool enable);
+uint64_t trace_now();
+void trace_record(const char* name, uint64_t start, uint64_t end, int vid, int pid);
+bool trace_dump(const char* path);
+
+class TraceSpan {
+public:
+    TraceSpan(const char* name, int vid = -1, int pid = -1)
+        : _name (trace_enabled ? name : 0)
+    {
+        if (_name) {
+            _vid = vid;
+            _pid = pid;
+            _start = trace_now();
+        }
+    }
+
+    ~TraceSpan()
+    {
+        end();
+    }
+
+    /* ends the span before its scope does */
+    void end()
+    {
+        if (_name) {
+            trace_record(_name, _start, trace_now(), _vid, _pid);
+            _name = 0;
+        }
+    }
+
+private:
+    const char* _name;
+    uint64_t _start;
+    int _vid;
+    int _pid;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SPAN(name, vid, pid) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, vid, pid)
+
+#endif
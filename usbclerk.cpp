@@ -5,10 +5,22 @@
 #include <string.h>
 #include <tchar.h>
 #include <list>
+#include <map>
+#include <set>
 #include "usbclerk.h"
+#include "protocol.h"
 #include "usbredirfilter.h"
 #include "libwdi.h"
 #include "vdlog.h"
+#include "workqueue.h"
+#include "retry.h"
+#include "trace.h"
+#include "packedrule.h"
+#include "journal.h"
+#include "capture.h"
+#include "shmring.h"
+#include "ratelimit.h"
+#include "devicemap.h"
 
 //#define DEBUG_USB_CLERK
 
@@ -17,25 +29,165 @@
 #define USB_CLERK_DESCRIPTION       TEXT("Enables automatic winusb driver signing & install")
 #define USB_CLERK_LOAD_ORDER_GROUP  TEXT("")
 #define USB_CLERK_LOG_PATH          TEXT("%susbclerk.log")
+#define USB_CLERK_JOURNAL_PATH      "%susbclerk-journal.dat"
+#define USB_CLERK_TRACE_PATH        "%susbclerk-trace.json"
+#define USB_CLERK_CAPTURE_PATH      "%susbclerk-capture.dat"
+#define USB_CLERK_CAPTURE_MAX       4095    /* MB */
 #define USB_CLERK_PIPE_TIMEOUT      10000
 #define USB_CLERK_PIPE_BUF_SIZE     1024
 #define USB_CLERK_PIPE_MAX_CLIENTS  32
+#define USB_CLERK_RING_POLL         1000
+#define USB_CLERK_IDLE_TIMEOUT      300000
+#define USB_CLERK_CLIENT_RATE       30      /* driver operations per minute */
+#define USB_CLERK_CLIENT_BURST      10
+#define USB_CLERK_SESSION_RATE      60
+#define USB_CLERK_SESSION_BURST     20
+#define USB_CLERK_THROTTLE_LOG      100
+#define USB_CLERK_NO_SESSION        ((DWORD)-1)
+#define USB_CLERK_GHOST_GC_MIN      60000
+#define USB_CLERK_DRAIN_TIMEOUT     5000
+#define USB_CLERK_RELEASE_TIMEOUT   10000
+#define USB_CLERK_SHUTDOWN_POLL     250
 #define USB_DRIVER_PATH             "%S\\wdi_usb_driver"
 #define USB_DRIVER_INFNAME_LEN      64
-#define USB_DRIVER_INSTALL_RETRIES  10
-#define USB_DRIVER_INSTALL_INTERVAL 2000
+#define USB_DRIVER_PENDING_TIMEOUT  20000
+#define USB_DRIVER_PENDING_SLICE    250
+#define USB_DRIVER_BACKOFF_INITIAL  20
+#define USB_DRIVER_BACKOFF_MAX      2000
 #define MAX_DEVICE_PROP_LEN         256
 #define MAX_DEVICE_HCID_LEN         1024
 #define MAX_DEVICE_FILTER_LEN       1024
+#define USB_CLERK_START_WAIT_HINT   5000
+#define USB_CLERK_INIT_TIMEOUT      30000
+#define USB_CLERK_QUEUE_LIMIT       64
+#define USB_CLERK_QUEUE_AGING       5000
+#define USB_CLERK_REG_KEY           L"Software\\USBClerk"
+#define USB_CLERK_DEVICES_KEY       USB_CLERK_REG_KEY L"\\Devices"
+
+/* user defined service control codes, e.g. "sc control usbclerk 128" */
+#define USB_CLERK_CONTROL_TRACE_DUMP 128
+#define USB_CLERK_CONTROL_CONN_DUMP  129
+#define USB_CLERK_CONTROL_FILTER_DUMP    130
+#define USB_CLERK_CONTROL_FILTER_REORDER 131
 
 typedef struct USBDev {
     UINT16 vid;
     UINT16 pid;
     bool auto_remove;
+    DWORD session;          /* Windows session of the client, or USB_CLERK_NO_SESSION */
 } USBDev;
 
 typedef std::list<USBDev> USBDevs;
 
+/* a client connection, its pipe and optionally its shared memory rings */
+typedef struct Connection {
+    UINT32 id;
+    HANDLE pipe;
+    DWORD session;                  /* of the client, or USB_CLERK_NO_SESSION */
+    PSID sid;                       /* user of the client, NULL if unknown. Freed by the
+                                       pipe thread */
+    ClientLimit limit;
+    struct Connection* parent;      /* the pipe connection of a ring, which it shares */
+    USBDevs devs;
+    ShmChannel* ring;
+    HANDLE ring_thread;
+    DWORD ring_bytes;
+    volatile bool ring_stop;
+    bool via_ring;
+    volatile DWORD last_active;     /* tick count of the last request, pipe or ring */
+    volatile UINT16 version;        /* of the last request, 0 until one came */
+    DWORD memory;                   /* bytes attributed to the connection */
+    bool reaped;
+} Connection;
+
+typedef std::list<Connection*> Connections;
+
+typedef struct SessionEvent {
+    DWORD session;
+    DWORD time;
+} SessionEvent;
+
+/* hubs of removed devices to rescan, 0 for the root devnode */
+typedef std::set<DEVINST> DevParents;
+typedef std::map<DWORD, ClientLimit> SessionLimits;
+
+/* filter rules & their hits, published as a whole so a check never mixes two sets.
+   Replaced sets are only freed at stop, as checks may still be using them */
+typedef struct FilterSet {
+    PackedRule *rules;
+    int count;
+    uint32_t *hits;         /* count + 1, the last for checks matching no rule */
+} FilterSet;
+typedef std::list<FilterSet*> FilterSets;
+
+class USBClerk;
+
+/* whether the waiter of an op is still there, see USBDriverOp::abandon() */
+enum {
+    OP_WAITED,
+    OP_ABANDONED,
+    OP_FINISHED,
+};
+
+class USBDriverOp : public WorkItem {
+public:
+    USBDriverOp(USBClerk* usbclerk, UINT16 type, UINT16 vid, UINT16 pid,
+                UINT32 id = 0, DWORD timeout = 0);
+    virtual ~USBDriverOp();
+    virtual void run();
+    virtual void finished();
+    bool abandon();
+    bool abandoned() { return _waiter == OP_ABANDONED; }
+    void cancel(UINT32 reason);
+    bool aborted();
+    bool sleep(DWORD ms);
+    bool acquire(HANDLE object);
+    DWORD remaining();
+    UINT32 result();
+    void fail(UINT16 reason, UINT32 native);
+    void time_stage(int stage, DWORD start_time);
+    void report(USBClerkReplyEx* reply, bool with_error);
+    void set_client(Connection* conn);
+    bool same_client(Connection* conn);
+
+public:
+    UINT16 type;
+    UINT16 vid;
+    UINT16 pid;
+    UINT32 id;
+    UINT32 status;
+    DevParents* parents;    /* if set, a removal leaves the rescan to the caller. Owned */
+    bool ghost;             /* a removal of a device no longer plugged, see collect_ghosts */
+    UINT16 error;           /* USB_CLERK_ERROR_*, of the first failure */
+    UINT32 native_error;
+    UINT16 attempts;
+    DWORD stage_ms[USB_CLERK_STAGES];
+
+private:
+    DWORD _session;         /* of the client that submitted the op, see set_client */
+    PSID _sid;              /* a copy, NULL for ops of the service itself */
+    USBClerk* _usbclerk;
+    HANDLE _cancel_event;
+    DWORD _deadline;
+    bool _has_deadline;
+    volatile LONG _abort_status;
+    volatile LONG _waiter;
+};
+
+typedef std::list<USBDriverOp*> USBDriverOps;
+
+/* waits for the system pending installations to complete, aborted with the op */
+class PendingInstallWaiter : public InstallWaiter {
+public:
+    PendingInstallWaiter(USBDriverOp* op) : _op (op) {}
+    virtual uint32_t now() { return GetTickCount(); }
+    virtual int wait_idle(uint32_t timeout);
+    virtual bool sleep(uint32_t ms) { return _op->sleep(ms); }
+
+private:
+    USBDriverOp* _op;
+};
+
 class USBClerk {
 public:
     static USBClerk* get();
@@ -47,34 +199,389 @@ public:
 private:
     USBClerk();
     bool execute();
-    bool dispatch_message(CHAR *buffer, DWORD bytes, USBClerkReply *reply, USBDevs *devs);
-    bool install_winusb_driver(int vid, int pid);
-    bool remove_winusb_driver(int vid, int pid);
+    void set_status(DWORD state, DWORD wait_hint = 0);
+    bool wait_ready();
+    void load_filter_rules();
+    void publish_filter(PackedRule *rules, int count, uint32_t *hits);
+    void free_filters();
+    void log_filter_hits();
+    void reorder_filter_rules();
+    DWORD get_config(const WCHAR* name, DWORD default_value);
+    UINT32 run_driver_op(USBDriverOp* op);
+    bool submit_driver_op(USBDriverOp* op);
+    UINT32 wait_driver_op(USBDriverOp* op);
+    UINT32 run_driver_batch(USBClerkDriverBatchEx* batch, Connection* conn,
+                            USBClerkReplyEx* reply);
+    void track_dev(Connection* conn, UINT16 type, UINT16 vid, UINT16 pid, UINT32 status);
+    bool owns_dev(Connection* conn, UINT16 vid, UINT16 pid);
+    void log_pipeline_stats();
+    bool cancel_ops(UINT32 id, Connection* conn);
+    bool cancel_driver_op(UINT32 id, Connection* conn);
+    void cancel_driver_ops();
+    void shutdown();
+    int end_release(USBDriverOp* op, DevParents* parents);
+    bool dispatch_message(CHAR *buffer, DWORD bytes, USBClerkReplyEx *reply, Connection *conn);
+    bool start_ring(Connection *conn, UINT32 key, UINT32 slots);
+    void stop_ring(Connection *conn);
+    void release_devs(USBDevs *devs);
+    void release_session_devs(DWORD session, DWORD event_time);
+    void add_thread(std::list<HANDLE>* threads, HANDLE thread);
+    void join_threads(std::list<HANDLE>* threads);
+    void update_conn_memory(Connection *conn);
+    bool read_message(Connection *conn, OVERLAPPED *overlapped, CHAR *buffer, DWORD *bytes);
+    bool write_reply(Connection *conn, OVERLAPPED *overlapped, USBClerkReplyEx *reply);
+    void add_conn(Connection *conn);
+    void remove_conn(Connection *conn);
+    void log_conns();
+    void init_limit(ClientLimit *limit, DWORD rate, DWORD burst);
+    bool admit(Connection *conn, UINT32 count);
+    static DWORD conn_memory(Connection *conn);
+    bool install_winusb_driver(int vid, int pid, USBDriverOp* op);
+    bool remove_winusb_driver(int vid, int pid, USBDriverOp* op, DevParents* parents = NULL);
+    void recover_session_devs();
     bool uninstall_inf(HDEVINFO devs, PSP_DEVINFO_DATA dev_info);
+    bool uninstall_oem_inf(const TCHAR* inf_name);
+    void map_dev(int vid, int pid, const char* device_id);
+    bool get_mapped_inf(int vid, int pid, DeviceMapEntry* mapped, PSP_DEVINFO_DATA dev_info,
+                        TCHAR* inf_name);
+    void collect_ghosts();
+    bool open_ghost(UINT16 vid, UINT16 pid, DeviceMapEntry* entry, HDEVINFO* devs,
+                    SP_DEVINFO_DATA* dev_info);
+    bool remove_ghost(UINT16 vid, UINT16 pid, USBDriverOp* op);
+    bool count_usb_devs(DWORD* total, DWORD* present);
+    void log_removal_stats();
     bool remove_dev(HDEVINFO devs, PSP_DEVINFO_DATA dev_info);
-    bool rescan();
+    bool rescan(DEVINST parent = 0);
+    bool rescan_parents(DevParents* parents);
     bool get_dev_info(HDEVINFO devs, int vid, int pid, SP_DEVINFO_DATA *dev_info, bool *has_winusb);
+    bool open_dev_info(const TCHAR* instance_id, int vid, int pid, HDEVINFO *devs,
+                       SP_DEVINFO_DATA *dev_info, bool *has_winusb);
+    bool has_winusb_service(HDEVINFO devs, SP_DEVINFO_DATA *dev_info);
     bool get_dev_props(HDEVINFO devs, SP_DEVINFO_DATA *dev_info,
                        uint8_t *cls, uint8_t *subcls, uint8_t *proto);
     bool get_dev_ifaces(HDEVINFO devs, int vid, int pid, int *iface_count,
                         uint8_t **cls, uint8_t **subcls, uint8_t **proto);
-    bool dev_filter_check(int vid, int pid, bool *has_winusb);
+    bool dev_filter_check(int vid, int pid, bool *has_winusb, USBDriverOp* op);
     static DWORD WINAPI control_handler(DWORD control, DWORD event_type,
                                         LPVOID event_data, LPVOID context);
     static DWORD WINAPI pipe_thread(LPVOID param);
+    static DWORD WINAPI ring_thread(LPVOID param);
+    static DWORD WINAPI init_thread(LPVOID param);
+    static DWORD WINAPI ghost_thread(LPVOID param);
+    static DWORD WINAPI session_thread(LPVOID param);
     static VOID WINAPI main(DWORD argc, TCHAR * argv[]);
 
 private:
+    friend class USBDriverOp;
     static USBClerk* _singleton;
     SERVICE_STATUS _status;
     SERVICE_STATUS_HANDLE _status_handle;
-    struct usbredirfilter_rule *_filter_rules;
-    int _filter_count;
+    FilterSet* volatile _filter;
+    FilterSets _old_filters;
+    CRITICAL_SECTION _filter_lock;          /* publishing _filter & _old_filters */
     char _wdi_path[MAX_PATH];
+    char _trace_path[MAX_PATH];
+    char _journal_path[MAX_PATH];
+    char _capture_path[MAX_PATH];
+    HANDLE _ready_event;
+    HANDLE _init_thread;
     bool _running;
+    HANDLE _stop_event;
+    DWORD _stop_time;
+    DWORD _drain_timeout;
+    DWORD _release_timeout;
+    WorkQueue _queue;
+    USBDriverOps _ops;
+    CRITICAL_SECTION _ops_lock;
+    Journal _journal;
+    CaptureWriter _capture;
+    HANDLE _install_stage;
+    DWORD _pipeline_start;
+    volatile LONG _prepare_busy;
+    volatile LONG _install_busy;
+    volatile LONG _install_wait;
+    volatile LONG _installs;
+    volatile LONG _installs_failed;
+    Connections _conns;
+    CRITICAL_SECTION _conns_lock;
+    std::list<HANDLE> _pipe_threads;        /* under _conns_lock */
+    std::list<HANDLE> _session_threads;     /* under _conns_lock */
+    UINT32 _conn_ids;
+    DWORD _conns_reaped;
+    DWORD _idle_timeout;
+    SessionLimits _session_limits;
+    CRITICAL_SECTION _limits_lock;
+    DWORD _client_rate;
+    DWORD _client_burst;
+    DWORD _session_rate;
+    DWORD _session_burst;
+    DeviceMap _devices;
+    volatile LONG _inf_map_hits;
+    volatile LONG _inf_map_misses;
+    volatile LONG _inf_map_time;
+    volatile LONG _inf_walk_time;
+    volatile LONG _devs_opened;
+    volatile LONG _devs_enumerated;
+    HANDLE _ghost_thread;
+    HANDLE _ghost_stop;
+    DWORD _ghost_interval;
+    DWORD _ghosts_removed;
+    volatile LONG _rescans_scoped;
+    volatile LONG _rescans_root;
+    volatile LONG _rescan_scoped_time;
+    volatile LONG _rescan_root_time;
     VDLog* _log;
 };
 
+USBDriverOp::USBDriverOp(USBClerk* usbclerk, UINT16 type, UINT16 vid, UINT16 pid,
+                         UINT32 id, DWORD timeout)
+    : WorkItem (type == USB_CLERK_DRIVER_SESSION_INSTALL ? WORK_PRIORITY_INTERACTIVE :
+                                                           WORK_PRIORITY_NORMAL)
+    , type (type)
+    , vid (vid)
+    , pid (pid)
+    , id (id)
+    , status (USB_CLERK_STATUS_FAILED)
+    , parents (NULL)
+    , ghost (false)
+    , error (USB_CLERK_ERROR_NONE)
+    , native_error (0)
+    , attempts (0)
+    , _session (USB_CLERK_NO_SESSION)
+    , _sid (NULL)
+    , _usbclerk (usbclerk)
+    , _deadline (GetTickCount() + timeout)
+    , _has_deadline (timeout != 0)
+    , _abort_status (0)
+    , _waiter (OP_WAITED)
+{
+    _cancel_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    memset(stage_ms, 0, sizeof(stage_ms));
+}
+
+USBDriverOp::~USBDriverOp()
+{
+    if (_cancel_event) {
+        CloseHandle(_cancel_event);
+    }
+    if (_sid) {
+        LocalFree(_sid);
+    }
+    delete parents;
+}
+
+/* the connection submitting the op, which takes its turn in the queue & may cancel it */
+void USBDriverOp::set_client(Connection* conn)
+{
+    DWORD size;
+
+    set_owner(conn->id);
+    _session = conn->session;
+    if (conn->sid) {
+        size = GetLengthSid(conn->sid);
+        _sid = (PSID)LocalAlloc(LPTR, size);
+        if (_sid && !CopySid(size, _sid, conn->sid)) {
+            LocalFree(_sid);
+            _sid = NULL;
+        }
+    }
+}
+
+/* the connection which submitted the op, or one of the same user & Windows session */
+bool USBDriverOp::same_client(Connection* conn)
+{
+    if (owner() == conn->id) {
+        return true;
+    }
+    return _sid && conn->sid && _session == conn->session && EqualSid(_sid, conn->sid);
+}
+
+void USBDriverOp::run()
+{
+    bool ret;
+
+    if (aborted()) {
+        vd_printf("Skipping %04x:%04x, aborted while queued", vid, pid);
+        status = _abort_status;
+        return;
+    }
+    switch (type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+    case USB_CLERK_DRIVER_INSTALL:
+        ret = _usbclerk->install_winusb_driver(vid, pid, this);
+        break;
+    case USB_CLERK_DRIVER_REMOVE:
+        ret = ghost ? _usbclerk->remove_ghost(vid, pid, this) :
+                      _usbclerk->remove_winusb_driver(vid, pid, this, parents);
+        break;
+    default:
+        ret = false;
+    }
+    if (ret) {
+        status = USB_CLERK_STATUS_SUCCESS;
+        /* journaled so a session install can be undone after a crash */
+        if (type == USB_CLERK_DRIVER_SESSION_INSTALL) {
+            _usbclerk->_journal.append(JOURNAL_INSTALL, vid, pid);
+        } else if (type == USB_CLERK_DRIVER_REMOVE) {
+            _usbclerk->_journal.append(JOURNAL_REMOVE, vid, pid);
+        }
+    } else {
+        status = _abort_status ? _abort_status : USB_CLERK_STATUS_FAILED;
+    }
+}
+
+/* unlists the op, and undoes an install completing after its waiter gave up, as its
+   client was told it timed out */
+void USBDriverOp::finished()
+{
+    USBDriverOp* undo;
+
+    EnterCriticalSection(&_usbclerk->_ops_lock);
+    _usbclerk->_ops.remove(this);
+    LeaveCriticalSection(&_usbclerk->_ops_lock);
+    if (InterlockedCompareExchange(&_waiter, OP_FINISHED, OP_WAITED) == OP_WAITED) {
+        return;
+    }
+    if (!ran() || status != USB_CLERK_STATUS_SUCCESS || type == USB_CLERK_DRIVER_REMOVE) {
+        return;
+    }
+    vd_printf("Undoing %04x:%04x, installed after its client gave up", vid, pid);
+    undo = new USBDriverOp(_usbclerk, USB_CLERK_DRIVER_REMOVE, vid, pid);
+    undo->set_priority(WORK_PRIORITY_BACKGROUND);
+    if (!_usbclerk->submit_driver_op(undo)) {
+        undo->run();
+    }
+    undo->release();
+}
+
+/* called by a waiter giving up on a running op, which is then left to its worker.
+   Returns false if the op finished meanwhile, so its results can still be read */
+bool USBDriverOp::abandon()
+{
+    return InterlockedCompareExchange(&_waiter, OP_ABANDONED, OP_WAITED) == OP_WAITED;
+}
+
+/* reason is USB_CLERK_STATUS_TIMEOUT or USB_CLERK_STATUS_CANCELLED, first one wins */
+void USBDriverOp::cancel(UINT32 reason)
+{
+    InterlockedCompareExchange(&_abort_status, reason, 0);
+    SetEvent(_cancel_event);
+}
+
+/* checked between stages & retries, true if the operation should not go on */
+bool USBDriverOp::aborted()
+{
+    if (_abort_status) {
+        return true;
+    }
+    if (_has_deadline && remaining() == 0) {
+        vd_printf("Deadline passed for %04x:%04x", vid, pid);
+        cancel(USB_CLERK_STATUS_TIMEOUT);
+        return true;
+    }
+    return false;
+}
+
+/* sleeps up to ms, returns false if aborted meanwhile */
+bool USBDriverOp::sleep(DWORD ms)
+{
+    if (aborted()) {
+        return false;
+    }
+    DWORD left = remaining();
+    WaitForSingleObject(_cancel_event, ms < left ? ms : left);
+    return !aborted();
+}
+
+/* waits for object, e.g. a semaphore, returns false if aborted meanwhile */
+bool USBDriverOp::acquire(HANDLE object)
+{
+    HANDLE handles[2] = {object, _cancel_event};
+
+    if (aborted()) {
+        return false;
+    }
+    switch (WaitForMultipleObjects(2, handles, FALSE, remaining())) {
+    case WAIT_OBJECT_0:
+        if (aborted()) {
+            ReleaseSemaphore(object, 1, NULL);
+            return false;
+        }
+        return true;
+    case WAIT_TIMEOUT:
+        aborted();
+        return false;
+    default:
+        return false;
+    }
+}
+
+DWORD USBDriverOp::remaining()
+{
+    LONG left;
+
+    if (!_has_deadline) {
+        return INFINITE;
+    }
+    left = (LONG)(_deadline - GetTickCount());
+    return left > 0 ? left : 0;
+}
+
+UINT32 USBDriverOp::result()
+{
+    if (ran()) {
+        return status;
+    }
+    return _abort_status ? _abort_status : USB_CLERK_STATUS_FAILED;
+}
+
+/* the first failure is the cause, later ones follow from it */
+void USBDriverOp::fail(UINT16 reason, UINT32 native)
+{
+    if (error == USB_CLERK_ERROR_NONE) {
+        error = reason;
+        native_error = native;
+    }
+}
+
+void USBDriverOp::time_stage(int stage, DWORD start_time)
+{
+    stage_ms[stage] += GetTickCount() - start_time;
+}
+
+/* adds the stages & attempts to reply, so a batch reply sums its devices. Nothing is
+   added for an abandoned op, its worker may still be updating them */
+void USBDriverOp::report(USBClerkReplyEx* reply, bool with_error)
+{
+    if (abandoned()) {
+        return;
+    }
+    if (with_error) {
+        reply->error = error;
+        reply->native_error = native_error;
+    }
+    reply->install_attempts += attempts;
+    reply->stage_ms[USB_CLERK_STAGE_QUEUE] += queue_time();
+    for (int i = 0; i < USB_CLERK_STAGES; i++) {
+        reply->stage_ms[i] += stage_ms[i];
+    }
+}
+
+int PendingInstallWaiter::wait_idle(uint32_t timeout)
+{
+    DWORD left = _op->remaining();
+
+    switch (CMP_WaitNoPendingInstallEvents(timeout < left ? timeout : left)) {
+    case WAIT_OBJECT_0:
+        return INSTALL_WAIT_IDLE;
+    case WAIT_TIMEOUT:
+        return INSTALL_WAIT_TIMEOUT;
+    default:
+        vd_printf("CMP_WaitNoPendingInstallEvents failed: %ld", GetLastError());
+        return INSTALL_WAIT_UNSUPPORTED;
+    }
+}
+
 USBClerk* USBClerk::_singleton = NULL;
 
 USBClerk* USBClerk::get()
@@ -87,16 +594,73 @@ USBClerk* USBClerk::get()
 
 USBClerk::USBClerk()
     : _status_handle (0)
-    , _filter_rules (NULL)
-    , _filter_count (0)
+    , _filter (NULL)
+    , _ready_event (NULL)
+    , _init_thread (NULL)
     , _running (false)
+    , _stop_event (NULL)
+    , _stop_time (0)
+    , _drain_timeout (USB_CLERK_DRAIN_TIMEOUT)
+    , _release_timeout (USB_CLERK_RELEASE_TIMEOUT)
+    , _install_stage (NULL)
+    , _pipeline_start (GetTickCount())
+    , _prepare_busy (0)
+    , _install_busy (0)
+    , _install_wait (0)
+    , _installs (0)
+    , _installs_failed (0)
+    , _conn_ids (0)
+    , _conns_reaped (0)
+    , _idle_timeout (USB_CLERK_IDLE_TIMEOUT)
+    , _client_rate (USB_CLERK_CLIENT_RATE)
+    , _client_burst (USB_CLERK_CLIENT_BURST)
+    , _session_rate (USB_CLERK_SESSION_RATE)
+    , _session_burst (USB_CLERK_SESSION_BURST)
+    , _devices (USB_CLERK_DEVICES_KEY)
+    , _inf_map_hits (0)
+    , _inf_map_misses (0)
+    , _inf_map_time (0)
+    , _inf_walk_time (0)
+    , _devs_opened (0)
+    , _devs_enumerated (0)
+    , _ghost_thread (NULL)
+    , _ghost_stop (NULL)
+    , _ghost_interval (0)
+    , _ghosts_removed (0)
+    , _rescans_scoped (0)
+    , _rescans_root (0)
+    , _rescan_scoped_time (0)
+    , _rescan_root_time (0)
     , _log (NULL)
 {
+    _journal_path[0] = '\0';
+    _capture_path[0] = '\0';
+    InitializeCriticalSection(&_ops_lock);
+    InitializeCriticalSection(&_conns_lock);
+    InitializeCriticalSection(&_limits_lock);
+    InitializeCriticalSection(&_filter_lock);
+    /* the install stage of the pipeline, see install_winusb_driver */
+    _install_stage = CreateSemaphore(NULL, 1, 1, NULL);
+    /* wakes the pipe listener & idle pipe threads on stop */
+    _stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
     _singleton = this;
 }
 
 USBClerk::~USBClerk()
 {
+    if (_ready_event) {
+        CloseHandle(_ready_event);
+    }
+    if (_install_stage) {
+        CloseHandle(_install_stage);
+    }
+    if (_stop_event) {
+        CloseHandle(_stop_event);
+    }
+    DeleteCriticalSection(&_filter_lock);
+    DeleteCriticalSection(&_limits_lock);
+    DeleteCriticalSection(&_conns_lock);
+    DeleteCriticalSection(&_ops_lock);
     delete _log;
 }
 
@@ -201,20 +765,56 @@ DWORD WINAPI USBClerk::control_handler(DWORD control, DWORD event_type, LPVOID e
 
     switch (control) {
     case SERVICE_CONTROL_STOP:
-    case SERVICE_CONTROL_SHUTDOWN: {
-        HANDLE pipe;
-        s->_status.dwCurrentState = SERVICE_STOP_PENDING;
-        SetServiceStatus(s->_status_handle, &s->_status);
+    case SERVICE_CONTROL_SHUTDOWN:
+        /* the rest is done by shutdown(), once execute() stops listening */
+        s->_stop_time = GetTickCount();
+        s->set_status(SERVICE_STOP_PENDING, s->_drain_timeout + s->_release_timeout);
         s->_running = false;
-        pipe = CreateFile(USB_CLERK_PIPE_NAME, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
-        if (pipe != INVALID_HANDLE_VALUE) {
-            CloseHandle(pipe);
-        }
+        SetEvent(s->_stop_event);
         break;
-    }
     case SERVICE_CONTROL_INTERROGATE:
         SetServiceStatus(s->_status_handle, &s->_status);
         break;
+    case USB_CLERK_CONTROL_TRACE_DUMP:
+        if (trace_dump(s->_trace_path)) {
+            vd_printf("Trace written to %s", s->_trace_path);
+        } else {
+            vd_printf("Failed writing trace to %s", s->_trace_path);
+        }
+        break;
+    case SERVICE_CONTROL_SESSIONCHANGE: {
+        SessionEvent* event;
+        HANDLE thread;
+        if (!s->_running || (event_type != WTS_SESSION_LOGOFF &&
+                event_type != WTS_CONSOLE_DISCONNECT && event_type != WTS_REMOTE_DISCONNECT)) {
+            /* once stopping, shutdown() removes the session installs */
+            break;
+        }
+        /* the handler must return quickly, devices are released on their own thread */
+        event = new SessionEvent;
+        event->session = ((WTSSESSION_NOTIFICATION*)event_data)->dwSessionId;
+        event->time = GetTickCount();
+        vd_printf("Session %lu %s", event->session,
+                  event_type == WTS_SESSION_LOGOFF ? "logoff" : "disconnect");
+        thread = CreateThread(NULL, 0, session_thread, event, 0, NULL);
+        if (!thread) {
+            vd_printf("CreateThread() failed: %ld", GetLastError());
+            delete event;
+            break;
+        }
+        s->add_thread(&s->_session_threads, thread);
+        break;
+    }
+    case USB_CLERK_CONTROL_CONN_DUMP:
+        s->log_conns();
+        s->_queue.log_stats();
+        break;
+    case USB_CLERK_CONTROL_FILTER_DUMP:
+        s->log_filter_hits();
+        break;
+    case USB_CLERK_CONTROL_FILTER_REORDER:
+        s->reorder_filter_rules();
+        break;
     default:
         ret = ERROR_CALL_NOT_IMPLEMENTED;
     }
@@ -224,6 +824,18 @@ DWORD WINAPI USBClerk::control_handler(DWORD control, DWORD event_type, LPVOID e
 #define USBCLERK_ACCEPTED_CONTROLS \
     (SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_SESSIONCHANGE)
 
+void USBClerk::set_status(DWORD state, DWORD wait_hint)
+{
+    _status.dwCurrentState = state;
+    _status.dwWaitHint = wait_hint;
+    if (state == SERVICE_START_PENDING || state == SERVICE_STOP_PENDING) {
+        _status.dwCheckPoint++;
+    } else {
+        _status.dwCheckPoint = 0;
+    }
+    SetServiceStatus(_status_handle, &_status);
+}
+
 VOID WINAPI USBClerk::main(DWORD argc, TCHAR* argv[])
 {
     USBClerk* s = _singleton;
@@ -231,15 +843,17 @@ VOID WINAPI USBClerk::main(DWORD argc, TCHAR* argv[])
     SERVICE_STATUS* status;
     TCHAR log_path[MAX_PATH];
     TCHAR path[MAX_PATH];
+    CHAR temp_path[MAX_PATH];
+    DWORD start_time = GetTickCount();
+    DWORD phase_time;
+    DWORD capture, workers;
 
     if (GetTempPath(MAX_PATH, path)) {
         _sntprintf(log_path, MAX_PATH, USB_CLERK_LOG_PATH, path);
         s->_log = VDLog::get(log_path);
     }
-    if (GetSystemDirectory(path, MAX_PATH)) {
-        _snprintf(s->_wdi_path, MAX_PATH, USB_DRIVER_PATH, path);
-    }
     vd_printf("***Service started***");
+    vd_printf("Startup phase log took %lums", GetTickCount() - start_time);
     SetPriorityClass(GetCurrentProcess(), ABOVE_NORMAL_PRIORITY_CLASS);
     status = &s->_status;
     status->dwServiceType = SERVICE_WIN32;
@@ -259,196 +873,1469 @@ VOID WINAPI USBClerk::main(DWORD argc, TCHAR* argv[])
     }
 
     // service is starting
-    status->dwCurrentState = SERVICE_START_PENDING;
-    SetServiceStatus(s->_status_handle, status);
+    s->set_status(SERVICE_START_PENDING, USB_CLERK_START_WAIT_HINT);
+
+    if (s->_log) {
+        s->_log->set_roll(s->get_config(L"log_roll_size", LOG_ROLL_SIZE),
+                          s->get_config(L"log_roll_age", LOG_ROLL_AGE),
+                          s->get_config(L"log_generations", LOG_ROLL_GENERATIONS));
+    }
+    VDLog::set_limit(s->get_config(L"log_limit_window", LOG_LIMIT_WINDOW),
+                     s->get_config(L"log_limit_burst", LOG_LIMIT_BURST));
+
+    phase_time = GetTickCount();
+    if (GetSystemDirectory(path, MAX_PATH)) {
+        _snprintf(s->_wdi_path, MAX_PATH, USB_DRIVER_PATH, path);
+    }
+    if (GetTempPathA(MAX_PATH, temp_path)) {
+        _snprintf(s->_trace_path, MAX_PATH, USB_CLERK_TRACE_PATH, temp_path);
+        _snprintf(s->_journal_path, MAX_PATH, USB_CLERK_JOURNAL_PATH, temp_path);
+        _snprintf(s->_capture_path, MAX_PATH, USB_CLERK_CAPTURE_PATH, temp_path);
+    }
+    if (s->get_config(L"trace", 0)) {
+        vd_printf("Tracing enabled");
+        trace_enable(true);
+    }
+    /* capture is off unless configured, with its size limit in MB */
+    capture = s->get_config(L"capture", 0);
+    if (capture > USB_CLERK_CAPTURE_MAX) {
+        capture = USB_CLERK_CAPTURE_MAX;
+    }
+    if (capture && s->_capture_path[0]) {
+        if (s->_capture.open(s->_capture_path, capture << 20)) {
+            vd_printf("Capturing up to %luMB of traffic to %s", capture, s->_capture_path);
+        } else {
+            vd_printf("Failed opening capture %s", s->_capture_path);
+        }
+    }
+    /* 0 or INFINITE never reaps idle connections */
+    s->_idle_timeout = s->get_config(L"idle_timeout", USB_CLERK_IDLE_TIMEOUT);
+    if (!s->_idle_timeout) {
+        s->_idle_timeout = INFINITE;
+    }
+    /* a rate of 0 does not limit */
+    s->_client_rate = s->get_config(L"client_rate", USB_CLERK_CLIENT_RATE);
+    s->_client_burst = s->get_config(L"client_burst", USB_CLERK_CLIENT_BURST);
+    s->_session_rate = s->get_config(L"session_rate", USB_CLERK_SESSION_RATE);
+    s->_session_burst = s->get_config(L"session_burst", USB_CLERK_SESSION_BURST);
+    s->_drain_timeout = s->get_config(L"drain_timeout", USB_CLERK_DRAIN_TIMEOUT);
+    s->_release_timeout = s->get_config(L"release_timeout", USB_CLERK_RELEASE_TIMEOUT);
+    vd_printf("Startup phase paths took %lums", GetTickCount() - phase_time);
+    s->set_status(SERVICE_START_PENDING, USB_CLERK_START_WAIT_HINT);
+
+    /* filter rules & anything else needed only by driver operations are initialized
+       in the background, so the pipe can accept connections right away */
+    s->_ready_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!s->_ready_event) {
+        vd_printf("CreateEvent() failed: %ld", GetLastError());
+        s->set_status(SERVICE_STOPPED);
+        return;
+    }
+    s->_init_thread = CreateThread(NULL, 0, init_thread, s, 0, NULL);
+    if (!s->_init_thread) {
+        vd_printf("CreateThread() failed: %ld, initializing synchronously", GetLastError());
+        init_thread(s);
+    }
+
+    phase_time = GetTickCount();
+    SYSTEM_INFO sys_info;
+    GetSystemInfo(&sys_info);
+    workers = s->get_config(L"workers", 0);
+    if (!workers) {
+        workers = sys_info.dwNumberOfProcessors;
+    }
+    /* a queue limit of 0 does not limit, aging of 0 disables it */
+    if (!s->_queue.start(workers, s->get_config(L"queue_limit", USB_CLERK_QUEUE_LIMIT),
+                         s->get_config(L"queue_aging", USB_CLERK_QUEUE_AGING))) {
+        s->set_status(SERVICE_STOPPED);
+        return;
+    }
+    vd_printf("Startup phase workers took %lums", GetTickCount() - phase_time);
+
+    /* ghost collection is off unless configured, with its interval in ms */
+    s->_ghost_interval = s->get_config(L"ghost_gc", 0);
+    if (s->_ghost_interval) {
+        if (s->_ghost_interval < USB_CLERK_GHOST_GC_MIN) {
+            s->_ghost_interval = USB_CLERK_GHOST_GC_MIN;
+        }
+        s->_ghost_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (s->_ghost_stop) {
+            s->_ghost_thread = CreateThread(NULL, 0, ghost_thread, s, 0, NULL);
+        }
+        if (!s->_ghost_thread) {
+            vd_printf("Ghost collection not started: %ld", GetLastError());
+        }
+    }
 
     // service running
     status->dwControlsAccepted |= USBCLERK_ACCEPTED_CONTROLS;
-    status->dwCurrentState = SERVICE_RUNNING;
-    SetServiceStatus(s->_status_handle, status);
+    s->set_status(SERVICE_RUNNING);
+    vd_printf("Service running after %lums", GetTickCount() - start_time);
 
     s->_running = true;
     s->execute();
 
     // service was stopped
-    status->dwCurrentState = SERVICE_STOP_PENDING;
-    SetServiceStatus(s->_status_handle, status);
+    s->set_status(SERVICE_STOP_PENDING);
 
     // service is stopped
     status->dwControlsAccepted &= ~USBCLERK_ACCEPTED_CONTROLS;
-    status->dwCurrentState = SERVICE_STOPPED;
 #ifndef DEBUG_USB_CLERK
-    SetServiceStatus(s->_status_handle, status);
+    s->set_status(SERVICE_STOPPED);
 #endif //DEBUG_USB_CLERK
 }
 
-bool USBClerk::execute()
+DWORD WINAPI USBClerk::init_thread(LPVOID param)
 {
-    SECURITY_ATTRIBUTES sec_attr;
-    SECURITY_DESCRIPTOR* sec_desr;
-    CHAR filter_str[MAX_DEVICE_FILTER_LEN];
-    HANDLE pipe, thread;
-    DWORD tid;
-    HKEY hkey;
-    LONG ret;
+    USBClerk* s = (USBClerk*)param;
+    DWORD start_time = GetTickCount();
+    DWORD phase_time;
+
+    phase_time = GetTickCount();
+    s->load_filter_rules();
+    vd_printf("Startup phase filter took %lums", GetTickCount() - phase_time);
+
+    phase_time = GetTickCount();
+    s->recover_session_devs();
+    vd_printf("Startup phase journal took %lums", GetTickCount() - phase_time);
 
 #if 0
     /* Hack for wdi logging */
+    phase_time = GetTickCount();
     if (wdi_register_logger((HWND)1, 1, 1000) != 0) {
         vd_printf("wdi_register_logger failed");
     }
+    vd_printf("Startup phase wdi took %lums", GetTickCount() - phase_time);
 #endif
-    sec_desr = (SECURITY_DESCRIPTOR*)LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
-    InitializeSecurityDescriptor(sec_desr, SECURITY_DESCRIPTOR_REVISION);
-    SetSecurityDescriptorDacl(sec_desr, TRUE, (PACL)NULL, FALSE);
-    sec_attr.nLength = sizeof(sec_attr);
-    sec_attr.bInheritHandle = TRUE;
-    sec_attr.lpSecurityDescriptor = sec_desr;
+
+    vd_printf("Background initialization took %lums", GetTickCount() - start_time);
+    SetEvent(s->_ready_event);
+    return 0;
+}
+
+/* waits for the background initialization, required by driver operations */
+bool USBClerk::wait_ready()
+{
+    DWORD start_time;
+
+    if (WaitForSingleObject(_ready_event, 0) == WAIT_OBJECT_0) {
+        return true;
+    }
+    start_time = GetTickCount();
+    if (WaitForSingleObject(_ready_event, USB_CLERK_INIT_TIMEOUT) != WAIT_OBJECT_0) {
+        vd_printf("Service initialization not ready after %dms", USB_CLERK_INIT_TIMEOUT);
+        return false;
+    }
+    vd_printf("Waited %lums for service initialization", GetTickCount() - start_time);
+    return true;
+}
+
+void USBClerk::load_filter_rules()
+{
+    CHAR filter_str[MAX_DEVICE_FILTER_LEN];
+    struct usbredirfilter_rule *rules;
+    PackedRule *packed;
+    int count;
+    HKEY hkey;
+    LONG ret;
 
     /* Read filter rules from registry */
-    ret = RegOpenKeyEx(HKEY_LOCAL_MACHINE, L"Software\\USBClerk", 0, KEY_READ, &hkey);
-    if (ret == ERROR_SUCCESS) {
-        DWORD size = sizeof(filter_str);
-        ret = RegQueryValueExA(hkey, "filter_rules", NULL, NULL, (LPBYTE)filter_str, &size);
-        if (ret == ERROR_SUCCESS) {
-            vd_printf("Filter rules: %s", filter_str);
-            ret = usbredirfilter_string_to_rules(filter_str, ",", "|",
-                                                 &_filter_rules, &_filter_count);
-            if (ret == 0) {
-                vd_printf("Filter count: %d", _filter_count);
-            } else {
-                vd_printf("Failed parsing filter rules: %ld", ret);
-            }
-        }
-        RegCloseKey(hkey);
+    ret = RegOpenKeyEx(HKEY_LOCAL_MACHINE, USB_CLERK_REG_KEY, 0, KEY_READ, &hkey);
+    if (ret != ERROR_SUCCESS) {
+        return;
     }
-    while (_running) {
-        pipe = CreateNamedPipe(USB_CLERK_PIPE_NAME, PIPE_ACCESS_DUPLEX,
-                               PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
-                               USB_CLERK_PIPE_MAX_CLIENTS, USB_CLERK_PIPE_BUF_SIZE,
-                               USB_CLERK_PIPE_BUF_SIZE, 0, &sec_attr);
-        if (pipe == INVALID_HANDLE_VALUE) {
-            vd_printf("CreatePipe() failed: %ld", GetLastError());
-            break;
+    DWORD size = sizeof(filter_str);
+    ret = RegQueryValueExA(hkey, "filter_rules", NULL, NULL, (LPBYTE)filter_str, &size);
+    if (ret == ERROR_SUCCESS) {
+        vd_printf("Filter rules: %s", filter_str);
+        ret = usbredirfilter_string_to_rules(filter_str, ",", "|", &rules, &count);
+        if (ret == 0) {
+            /* checked in the packed 8 byte form, see packedrule.h */
+            ret = packedrule_from_rules(rules, count, &packed);
+            free(rules);
         }
-        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
-            vd_printf("ConnectNamedPipe() failed: %ld", GetLastError());
-            CloseHandle(pipe);
-            break;
+        if (ret == 0) {
+            vd_printf("Filter count: %d", count);
+            publish_filter(packed, count, NULL);
+        } else {
+            vd_printf("Failed parsing filter rules: %ld", ret);
         }
-        thread = CreateThread(NULL, 0, pipe_thread, (LPVOID)pipe, 0, &tid);
-        if (thread == NULL) {
-            vd_printf("CreateThread() failed: %ld", GetLastError());
+    }
+    RegCloseKey(hkey);
+}
+
+/* takes ownership of rules & hits, NULL hits to start counting from zero. Called from
+   the init thread & the control handler, checks read _filter without the lock */
+void USBClerk::publish_filter(PackedRule *rules, int count, uint32_t *hits)
+{
+    FilterSet* filter = new FilterSet;
+    FilterSet* old;
+
+    filter->rules = rules;
+    filter->count = count;
+    filter->hits = hits ? hits : (uint32_t*)calloc(count + 1, sizeof(uint32_t));
+    if (!filter->hits) {
+        /* still checked, without counting */
+        vd_printf("Failed allocating filter hit counters");
+    }
+    EnterCriticalSection(&_filter_lock);
+    old = (FilterSet*)InterlockedExchangePointer((void* volatile*)&_filter, filter);
+    if (old) {
+        _old_filters.push_back(old);
+    }
+    LeaveCriticalSection(&_filter_lock);
+}
+
+void USBClerk::free_filters()
+{
+    FilterSet* filter;
+
+    EnterCriticalSection(&_filter_lock);
+    filter = _filter;
+    if (filter) {
+        _old_filters.push_back(filter);
+        _filter = NULL;
+    }
+    for (FilterSets::iterator f = _old_filters.begin(); f != _old_filters.end(); f++) {
+        free((*f)->rules);
+        free((*f)->hits);
+        delete *f;
+    }
+    _old_filters.clear();
+    LeaveCriticalSection(&_filter_lock);
+}
+
+/* rules a check scanned on average, in hundredths */
+static DWORD scan_length(int count, const uint32_t *hits, const int *order)
+{
+    uint64_t passes = 0;
+
+    for (int i = 0; i <= count; i++) {
+        passes += hits[i];
+    }
+    return passes ? (DWORD)(packedrule_scan_cost(count, hits, order) * 100 / passes) : 0;
+}
+
+/* hits of each filter rule since it was published, on USB_CLERK_CONTROL_FILTER_DUMP */
+void USBClerk::log_filter_hits()
+{
+    FilterSet* filter = _filter;
+    struct usbredirfilter_rule *rules;
+    char *rule_str;
+    DWORD scan;
+
+    if (!filter || !filter->hits) {
+        vd_printf("No filter rules or hit counters");
+        return;
+    }
+    if (packedrule_to_rules(filter->rules, filter->count, &rules) != 0) {
+        return;
+    }
+    for (int i = 0; i < filter->count; i++) {
+        rule_str = usbredirfilter_rules_to_string(&rules[i], 1, ",", "|");
+        vd_printf("Filter rule %d: %u hits, %s", i, filter->hits[i], rule_str ? rule_str : "");
+        free(rule_str);
+    }
+    scan = scan_length(filter->count, filter->hits, NULL);
+    vd_printf("%u checks matched no rule, %lu.%02lu rules scanned per check",
+              filter->hits[filter->count], scan / 100, scan % 100);
+    free(rules);
+}
+
+/* Moves the most hit filter rules ahead, as far as verdicts stay the same, see
+   packedrule_reorder(), on USB_CLERK_CONTROL_FILTER_REORDER. The registry keeps the
+   configured order, the new one is logged to be saved there. Under _filter_lock, so
+   rules loaded meanwhile are not replaced by a reorder of the set they replaced */
+void USBClerk::reorder_filter_rules()
+{
+    FilterSet* filter;
+    struct usbredirfilter_rule *rules;
+    PackedRule *packed;
+    uint32_t *hits;
+    int *order;
+    char *rules_str;
+    DWORD before, after;
+    int count;
+
+    EnterCriticalSection(&_filter_lock);
+    filter = _filter;
+    if (!filter || !filter->hits) {
+        vd_printf("No filter rules or hit counters");
+        LeaveCriticalSection(&_filter_lock);
+        return;
+    }
+    count = filter->count;
+    packed = (PackedRule*)malloc(sizeof(PackedRule) * (count ? count : 1));
+    hits = (uint32_t*)malloc(sizeof(uint32_t) * (count + 1));
+    order = (int*)malloc(sizeof(int) * (count ? count : 1));
+    if (!packed || !hits || !order) {
+        vd_printf("Failed allocating filter reorder");
+        goto cleanup;
+    }
+    /* the counters go on while the profile is read, a snapshot keeps it consistent */
+    memcpy(hits, filter->hits, sizeof(uint32_t) * (count + 1));
+    if (packedrule_reorder(filter->rules, count, hits, order) != 0) {
+        vd_printf("Failed reordering filter rules");
+        goto cleanup;
+    }
+    before = scan_length(count, hits, NULL);
+    after = scan_length(count, hits, order);
+    if (after >= before) {
+        vd_printf("Filter rules kept, %lu.%02lu rules scanned per check", before / 100,
+                  before % 100);
+        goto cleanup;
+    }
+    /* the hits move with their rules, so the profile carries over */
+    for (int i = 0; i < count; i++) {
+        packed[i] = filter->rules[order[i]];
+        hits[i] = filter->hits[order[i]];
+    }
+    if (packedrule_to_rules(packed, count, &rules) == 0) {
+        rules_str = usbredirfilter_rules_to_string(rules, count, ",", "|");
+        vd_printf("Filter rules reordered: %s", rules_str ? rules_str : "");
+        free(rules_str);
+        free(rules);
+    }
+    vd_printf("Expected rules scanned per check %lu.%02lu, was %lu.%02lu", after / 100,
+              after % 100, before / 100, before % 100);
+    publish_filter(packed, count, hits);
+    packed = NULL;
+    hits = NULL;
+cleanup:
+    LeaveCriticalSection(&_filter_lock);
+    free(packed);
+    free(hits);
+    free(order);
+}
+
+/* removes the drivers of session installs a crashed service left behind, rescanning
+   their hubs once after all */
+void USBClerk::recover_session_devs()
+{
+    JournalDevs devs;
+    DevParents parents;
+    int removed = 0;
+
+    if (!_journal_path[0] || !_journal.open(_journal_path, &devs)) {
+        vd_printf("Journal unavailable, session installs are not recoverable");
+        return;
+    }
+    for (JournalDevs::iterator dev = devs.begin(); dev != devs.end(); dev++) {
+        USBDriverOp op(this, USB_CLERK_DRIVER_REMOVE, dev->vid, dev->pid);
+        vd_printf("Removing orphaned session device %04x:%04x", dev->vid, dev->pid);
+        if (remove_winusb_driver(dev->vid, dev->pid, &op, &parents)) {
+            removed++;
+        }
+        /* not retried on next start, the device may be gone for good */
+        _journal.append(JOURNAL_REMOVE, dev->vid, dev->pid);
+    }
+    if (removed) {
+        TRACE_SPAN("rescan", -1, -1);
+        rescan_parents(&parents);
+    }
+    if (!devs.empty()) {
+        vd_printf("Removed %d of %u orphaned session devices", removed, (unsigned)devs.size());
+    }
+}
+
+/* returns a DWORD value from the service registry key, or default_value if not set */
+DWORD USBClerk::get_config(const WCHAR* name, DWORD default_value)
+{
+    DWORD value, size = sizeof(value), type;
+    HKEY hkey;
+    LONG ret;
+
+    ret = RegOpenKeyEx(HKEY_LOCAL_MACHINE, USB_CLERK_REG_KEY, 0, KEY_READ, &hkey);
+    if (ret != ERROR_SUCCESS) {
+        return default_value;
+    }
+    ret = RegQueryValueEx(hkey, name, NULL, &type, (LPBYTE)&value, &size);
+    RegCloseKey(hkey);
+    if (ret != ERROR_SUCCESS || type != REG_DWORD) {
+        return default_value;
+    }
+    vd_printf("Config %S: %lu", name, value);
+    return value;
+}
+
+bool USBClerk::execute()
+{
+    SECURITY_ATTRIBUTES sec_attr;
+    SECURITY_DESCRIPTOR* sec_desr;
+    OVERLAPPED overlapped;
+    HANDLE pipe, thread;
+    HANDLE events[2];
+    DWORD tid, bytes;
+    BOOL connected;
+
+    sec_desr = (SECURITY_DESCRIPTOR*)LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH);
+    InitializeSecurityDescriptor(sec_desr, SECURITY_DESCRIPTOR_REVISION);
+    SetSecurityDescriptorDacl(sec_desr, TRUE, (PACL)NULL, FALSE);
+    sec_attr.nLength = sizeof(sec_attr);
+    sec_attr.bInheritHandle = TRUE;
+    sec_attr.lpSecurityDescriptor = sec_desr;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!overlapped.hEvent || !_stop_event) {
+        vd_printf("CreateEvent() failed: %ld", GetLastError());
+        _running = false;
+    }
+    events[0] = overlapped.hEvent;
+    events[1] = _stop_event;
+
+    while (_running) {
+        /* overlapped, so pipe threads can time out idle clients, see read_message */
+        pipe = CreateNamedPipe(USB_CLERK_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                               PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                               USB_CLERK_PIPE_MAX_CLIENTS, USB_CLERK_PIPE_BUF_SIZE,
+                               USB_CLERK_PIPE_BUF_SIZE, 0, &sec_attr);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            vd_printf("CreatePipe() failed: %ld", GetLastError());
+            break;
+        }
+        connected = ConnectNamedPipe(pipe, &overlapped);
+        if (!connected && GetLastError() == ERROR_IO_PENDING) {
+            if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                /* stopping */
+                CancelIo(pipe);
+                GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+                CloseHandle(pipe);
+                break;
+            }
+            connected = GetOverlappedResult(pipe, &overlapped, &bytes, FALSE);
+        } else if (!connected && GetLastError() == ERROR_PIPE_CONNECTED) {
+            connected = TRUE;
+        }
+        if (!connected) {
+            vd_printf("ConnectNamedPipe() failed: %ld", GetLastError());
+            CloseHandle(pipe);
+            break;
+        }
+        thread = CreateThread(NULL, 0, pipe_thread, (LPVOID)pipe, 0, &tid);
+        if (thread == NULL) {
+            vd_printf("CreateThread() failed: %ld", GetLastError());
+            break;
+        }
+        add_thread(&_pipe_threads, thread);
+    }
+    if (overlapped.hEvent) {
+        CloseHandle(overlapped.hEvent);
+    }
+    /* before shutdown() cancels the queued ops, so session removals in flight
+       complete like other driver operations */
+    join_threads(&_session_threads);
+    shutdown();
+    /* pipe threads woken by _stop_event remove the devices of connections they closed
+       before shutdown() collected those */
+    join_threads(&_pipe_threads);
+    if (_ghost_thread) {
+        SetEvent(_ghost_stop);
+        WaitForSingleObject(_ghost_thread, INFINITE);
+        CloseHandle(_ghost_thread);
+        _ghost_thread = NULL;
+    }
+    if (_ghost_stop) {
+        CloseHandle(_ghost_stop);
+        _ghost_stop = NULL;
+    }
+    _queue.stop();
+    log_pipeline_stats();
+    log_removal_stats();
+    if (_log) {
+        _log->report_repeated(true);
+    }
+    if (VDLog::suppressed()) {
+        vd_printf("%ld repeated log lines suppressed", VDLog::suppressed());
+    }
+    if (_init_thread) {
+        WaitForSingleObject(_init_thread, INFINITE);
+        CloseHandle(_init_thread);
+        _init_thread = NULL;
+    }
+    _journal.close();
+    _capture.close();
+    free_filters();
+    vd_printf("Shutdown took %lums", GetTickCount() - _stop_time);
+    return true;
+}
+
+typedef BOOL (WINAPI *GetNamedPipeClientSessionIdFunc)(HANDLE, PULONG);
+
+/* looked up, as XP lacks it */
+static DWORD pipe_client_session(HANDLE pipe)
+{
+    static GetNamedPipeClientSessionIdFunc get_session = (GetNamedPipeClientSessionIdFunc)
+        GetProcAddress(GetModuleHandle(TEXT("kernel32.dll")), "GetNamedPipeClientSessionId");
+    ULONG session;
+
+    if (!get_session || !get_session(pipe, &session)) {
+        return USB_CLERK_NO_SESSION;
+    }
+    return session;
+}
+
+/* the user of the pipe client, read from its token while impersonating it. Freed with
+   LocalFree */
+static PSID pipe_client_sid(HANDLE pipe)
+{
+    BYTE buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+    TOKEN_USER* user = (TOKEN_USER*)buffer;
+    HANDLE token = NULL;
+    PSID sid = NULL;
+    DWORD size;
+
+    if (!ImpersonateNamedPipeClient(pipe)) {
+        return NULL;
+    }
+    if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY, TRUE, &token)) {
+        token = NULL;
+    }
+    RevertToSelf();
+    if (token && GetTokenInformation(token, TokenUser, buffer, sizeof(buffer), &size)) {
+        size = GetLengthSid(user->User.Sid);
+        sid = (PSID)LocalAlloc(LPTR, size);
+        if (sid && !CopySid(size, sid, user->User.Sid)) {
+            LocalFree(sid);
+            sid = NULL;
+        }
+    }
+    if (token) {
+        CloseHandle(token);
+    }
+    return sid;
+}
+
+DWORD WINAPI USBClerk::pipe_thread(LPVOID param)
+{
+    USBClerkReplyEx reply = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+        USB_CLERK_REPLY, sizeof(USBClerkReplyEx)}};
+    CHAR buffer[USB_CLERK_PIPE_BUF_SIZE];
+    USBClerk* usbclerk = get();
+    OVERLAPPED overlapped;
+    Connection conn;
+    DWORD bytes;
+
+    conn.pipe = (HANDLE)param;
+    conn.session = pipe_client_session(conn.pipe);
+    conn.sid = NULL;
+    conn.parent = NULL;
+    conn.ring = NULL;
+    conn.ring_thread = NULL;
+    conn.ring_bytes = 0;
+    conn.via_ring = false;
+    conn.version = 0;
+    conn.reaped = false;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!overlapped.hEvent) {
+        vd_printf("CreateEvent() failed: %ld", GetLastError());
+        CloseHandle(conn.pipe);
+        return 0;
+    }
+    conn.sid = pipe_client_sid(conn.pipe);
+    usbclerk->add_conn(&conn);
+    usbclerk->_capture.record(conn.id, CAPTURE_CONNECT, NULL, 0);
+    while (usbclerk->_running) {
+        {
+            TRACE_SPAN("pipe read", -1, -1);
+            if (!usbclerk->read_message(&conn, &overlapped, buffer, &bytes)) {
+                break;
+            }
+        }
+        conn.last_active = GetTickCount();
+        if (!usbclerk->dispatch_message(buffer, bytes, &reply, &conn) ||
+            !usbclerk->write_reply(&conn, &overlapped, &reply)) {
+            break;
+        }
+        usbclerk->update_conn_memory(&conn);
+    }
+    usbclerk->stop_ring(&conn);
+    usbclerk->_capture.record(conn.id, CAPTURE_DISCONNECT, NULL, 0);
+    usbclerk->remove_conn(&conn);
+    DisconnectNamedPipe(conn.pipe);
+    CloseHandle(conn.pipe);
+    CloseHandle(overlapped.hEvent);
+    usbclerk->release_devs(&conn.devs);
+    if (conn.sid) {
+        LocalFree(conn.sid);
+    }
+    return 0;
+}
+
+/* reads the next request, giving up once neither the pipe nor the ring of the
+   connection had one for _idle_timeout, e.g. a hung client or one that leaked its
+   pipe handle. Clients too old to send keepalives are waited for indefinitely, as
+   reaping them would remove the drivers of devices they still use */
+bool USBClerk::read_message(Connection *conn, OVERLAPPED *overlapped, CHAR *buffer,
+                            DWORD *bytes)
+{
+    HANDLE events[2] = {overlapped->hEvent, _stop_event};
+    DWORD idle, timeout, wait = WAIT_TIMEOUT;
+
+    if (!ReadFile(conn->pipe, buffer, USB_CLERK_PIPE_BUF_SIZE, NULL, overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        return false;
+    }
+    for (;;) {
+        idle = GetTickCount() - conn->last_active;
+        timeout = INFINITE;
+        if (_idle_timeout != INFINITE &&
+            (!conn->version || conn->version >= USB_CLERK_VERSION_KEEPALIVE)) {
+            if (idle >= _idle_timeout) {
+                break;
+            }
+            timeout = _idle_timeout - idle;
+        }
+        wait = WaitForMultipleObjects(2, events, FALSE, timeout);
+        if (wait == WAIT_OBJECT_0) {
+            return !!GetOverlappedResult(conn->pipe, overlapped, bytes, FALSE);
+        }
+        if (wait != WAIT_TIMEOUT) {
+            /* stopping */
+            break;
+        }
+    }
+    CancelIo(conn->pipe);
+    /* the read owns buffer until it is done, and may have completed meanwhile */
+    if (GetOverlappedResult(conn->pipe, overlapped, bytes, TRUE)) {
+        return true;
+    }
+    if (wait == WAIT_TIMEOUT) {
+        vd_printf("Reaping connection %u, idle for %lums", conn->id, idle);
+        conn->reaped = true;
+    }
+    return false;
+}
+
+/* a client that does not read its replies is reaped as an idle one */
+bool USBClerk::write_reply(Connection *conn, OVERLAPPED *overlapped, USBClerkReplyEx *reply)
+{
+    DWORD bytes;
+
+    if (!WriteFile(conn->pipe, reply, reply->hdr.size, NULL, overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        return false;
+    }
+    if (WaitForSingleObject(overlapped->hEvent, USB_CLERK_PIPE_TIMEOUT) == WAIT_TIMEOUT) {
+        CancelIo(conn->pipe);
+        if (!GetOverlappedResult(conn->pipe, overlapped, &bytes, TRUE)) {
+            vd_printf("Reaping connection %u, reply not read", conn->id);
+            conn->reaped = true;
+            return false;
+        }
+    }
+    return GetOverlappedResult(conn->pipe, overlapped, &bytes, FALSE) &&
+           bytes == reply->hdr.size;
+}
+
+/* the pipe read buffer, the pipe in & out buffers and any rings. The pipe thread
+   stack is not counted, nor the ring thread */
+DWORD USBClerk::conn_memory(Connection *conn)
+{
+    return sizeof(Connection) + 3 * USB_CLERK_PIPE_BUF_SIZE + conn->ring_bytes +
+           (DWORD)conn->devs.size() * sizeof(USBDev);
+}
+
+/* devs may change under _conns_lock, by a session release */
+void USBClerk::update_conn_memory(Connection *conn)
+{
+    EnterCriticalSection(&_conns_lock);
+    conn->memory = conn_memory(conn);
+    LeaveCriticalSection(&_conns_lock);
+}
+
+void USBClerk::add_conn(Connection *conn)
+{
+    init_limit(&conn->limit, _client_rate, _client_burst);
+    conn->last_active = GetTickCount();
+    conn->memory = conn_memory(conn);
+    EnterCriticalSection(&_conns_lock);
+    conn->id = ++_conn_ids;
+    _conns.push_back(conn);
+    LeaveCriticalSection(&_conns_lock);
+}
+
+void USBClerk::remove_conn(Connection *conn)
+{
+    EnterCriticalSection(&_conns_lock);
+    _conns.remove(conn);
+    if (conn->reaped) {
+        _conns_reaped++;
+    }
+    LeaveCriticalSection(&_conns_lock);
+    if (conn->limit.throttled) {
+        vd_printf("Connection %u closed, throttled %u of %u driver operations", conn->id,
+                  conn->limit.throttled, conn->limit.allowed + conn->limit.throttled);
+    }
+}
+
+void USBClerk::init_limit(ClientLimit *limit, DWORD rate, DWORD burst)
+{
+    limit->bucket.init(rate, burst, GetTickCount());
+    limit->allowed = 0;
+    limit->throttled = 0;
+}
+
+/* takes count driver operations from the buckets of the connection & of its session,
+   from both or from none. Throttling is logged every USB_CLERK_THROTTLE_LOG times, as
+   a client looping on operations would flood the log */
+bool USBClerk::admit(Connection *conn, UINT32 count)
+{
+    Connection* owner = conn->parent ? conn->parent : conn;
+    ClientLimit* session = NULL;
+    DWORD tick = GetTickCount();
+    bool allowed;
+
+    EnterCriticalSection(&_limits_lock);
+    if (owner->session != USB_CLERK_NO_SESSION) {
+        SessionLimits::iterator s = _session_limits.find(owner->session);
+        if (s == _session_limits.end()) {
+            s = _session_limits.insert(std::make_pair(owner->session, ClientLimit())).first;
+            init_limit(&s->second, _session_rate, _session_burst);
+        }
+        session = &s->second;
+    }
+    allowed = owner->limit.bucket.available(tick) >= count &&
+              (!session || session->bucket.available(tick) >= count);
+    if (allowed) {
+        owner->limit.bucket.take(tick, count);
+        owner->limit.allowed += count;
+        if (session) {
+            session->bucket.take(tick, count);
+            session->allowed += count;
+        }
+    } else {
+        if (owner->limit.throttled++ % USB_CLERK_THROTTLE_LOG == 0) {
+            vd_printf("Throttled connection %u of session %ld, %u times", owner->id,
+                      (long)owner->session, owner->limit.throttled);
+        }
+        if (session) {
+            session->throttled++;
+        }
+    }
+    LeaveCriticalSection(&_limits_lock);
+    return allowed;
+}
+
+/* live connections & the memory attributed to them, on USB_CLERK_CONTROL_CONN_DUMP,
+   followed by the queue stats */
+void USBClerk::log_conns()
+{
+    DWORD tick = GetTickCount();
+    DWORD total = 0, buffered_total = 0, buffered;
+
+    EnterCriticalSection(&_conns_lock);
+    for (Connections::iterator c = _conns.begin(); c != _conns.end(); c++) {
+        /* requests the client wrote that were not read yet */
+        if (!PeekNamedPipe((*c)->pipe, NULL, 0, NULL, &buffered, NULL)) {
+            buffered = 0;
+        }
+        vd_printf("Connection %u: session %ld, idle %lums, %lu bytes buffered, %lu bytes, "
+                  "%s, %u allowed, %u throttled", (*c)->id, (long)(*c)->session,
+                  tick - (*c)->last_active, buffered, (*c)->memory,
+                  (*c)->ring ? "ring" : "pipe", (*c)->limit.allowed, (*c)->limit.throttled);
+        total += (*c)->memory;
+        buffered_total += buffered;
+    }
+    vd_printf("%u connections, %lu bytes buffered, %lu bytes; %u accepted, %lu reaped",
+              (unsigned)_conns.size(), buffered_total, total, _conn_ids, _conns_reaped);
+    LeaveCriticalSection(&_conns_lock);
+    EnterCriticalSection(&_limits_lock);
+    for (SessionLimits::iterator s = _session_limits.begin(); s != _session_limits.end(); s++) {
+        vd_printf("Session %lu: %u allowed, %u throttled", s->first, s->second.allowed,
+                  s->second.throttled);
+    }
+    LeaveCriticalSection(&_limits_lock);
+}
+
+/* removes the drivers of the session installs of a closed connection */
+void USBClerk::release_devs(USBDevs *conn_devs)
+{
+    USBDevs devs;
+
+    EnterCriticalSection(&_conns_lock);
+    devs.swap(*conn_devs);
+    LeaveCriticalSection(&_conns_lock);
+    for (USBDevs::iterator dev = devs.begin(); dev != devs.end(); dev++) {
+        if (!dev->auto_remove) {
+            continue;
+        }
+        USBDriverOp* op = new USBDriverOp(this, USB_CLERK_DRIVER_REMOVE, dev->vid, dev->pid);
+        /* nobody waits on it, must not delay session attaches */
+        op->set_priority(WORK_PRIORITY_BACKGROUND);
+        if (run_driver_op(op) == USB_CLERK_STATUS_BUSY) {
+            /* session cleanup must not be dropped, do it on this thread */
+            op->run();
+        }
+        op->release();
+    }
+}
+
+/* removes the session installs of a Windows session that logged off or disconnected,
+   as its clients may take long to close their connections, e.g. if they hang. The
+   devices are taken from their connections, then removed with a single rescan */
+void USBClerk::release_session_devs(DWORD session, DWORD event_time)
+{
+    USBDevs devs;
+    DevParents parents;
+    std::list<USBDriverOp*> ops;
+    int removed = 0;
+
+    EnterCriticalSection(&_conns_lock);
+    for (Connections::iterator c = _conns.begin(); c != _conns.end(); c++) {
+        USBDevs::iterator dev = (*c)->devs.begin();
+        while (dev != (*c)->devs.end()) {
+            if (dev->auto_remove && dev->session == session) {
+                devs.push_back(*dev);
+                dev = (*c)->devs.erase(dev);
+            } else {
+                dev++;
+            }
+        }
+    }
+    LeaveCriticalSection(&_conns_lock);
+    if (devs.empty()) {
+        return;
+    }
+    /* in the background as for closed connections, journaled by the ops */
+    for (USBDevs::iterator dev = devs.begin(); dev != devs.end(); dev++) {
+        USBDriverOp* op = new USBDriverOp(this, USB_CLERK_DRIVER_REMOVE, dev->vid, dev->pid);
+        op->set_priority(WORK_PRIORITY_BACKGROUND);
+        op->parents = new DevParents();
+        vd_printf("Removing session %lu device %04x:%04x", session, dev->vid, dev->pid);
+        if (submit_driver_op(op)) {
+            ops.push_back(op);
+            continue;
+        }
+        /* the queue is full, removed on this thread */
+        op->run();
+        removed += end_release(op, &parents);
+    }
+    for (std::list<USBDriverOp*>::iterator op = ops.begin(); op != ops.end(); op++) {
+        wait_driver_op(*op);
+        removed += end_release(*op, &parents);
+    }
+    if (removed) {
+        TRACE_SPAN("rescan", -1, -1);
+        rescan_parents(&parents);
+    }
+    vd_printf("Session %lu cleanup removed %d of %u devices, %lums after the event",
+              session, removed, (unsigned)devs.size(), GetTickCount() - event_time);
+}
+
+DWORD WINAPI USBClerk::session_thread(LPVOID param)
+{
+    SessionEvent* event = (SessionEvent*)param;
+
+    get()->release_session_devs(event->session, event->time);
+    delete event;
+    return 0;
+}
+
+/* threads submitting driver ops are kept until joined by execute(), before the queue
+   stops. Those already finished are closed as new ones are added */
+void USBClerk::add_thread(std::list<HANDLE>* threads, HANDLE thread)
+{
+    EnterCriticalSection(&_conns_lock);
+    std::list<HANDLE>::iterator t = threads->begin();
+    while (t != threads->end()) {
+        if (WaitForSingleObject(*t, 0) == WAIT_OBJECT_0) {
+            CloseHandle(*t);
+            t = threads->erase(t);
+        } else {
+            t++;
+        }
+    }
+    threads->push_back(thread);
+    LeaveCriticalSection(&_conns_lock);
+}
+
+void USBClerk::join_threads(std::list<HANDLE>* threads)
+{
+    std::list<HANDLE> joined;
+
+    EnterCriticalSection(&_conns_lock);
+    joined.swap(*threads);
+    LeaveCriticalSection(&_conns_lock);
+    for (std::list<HANDLE>::iterator t = joined.begin(); t != joined.end(); t++) {
+        while (WaitForSingleObject(*t, USB_CLERK_SHUTDOWN_POLL) == WAIT_TIMEOUT) {
+            set_status(SERVICE_STOP_PENDING, _release_timeout);
+        }
+        CloseHandle(*t);
+    }
+}
+
+/* serves the requests of a connection posted to its shared memory ring. The ring
+   devices are tracked with those of the pipe */
+DWORD WINAPI USBClerk::ring_thread(LPVOID param)
+{
+    USBClerkReplyEx reply = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+        USB_CLERK_REPLY, sizeof(USBClerkReplyEx)}};
+    CHAR buffer[SHM_RING_SLOT_DATA];
+    Connection* pipe_conn = (Connection*)param;
+    ShmChannel* ring = pipe_conn->ring;
+    USBClerk* usbclerk = get();
+    Connection conn;
+    int bytes;
+
+    /* same client, so same limits & turn in the queue */
+    conn.id = pipe_conn->id;
+    conn.session = pipe_conn->session;
+    conn.sid = pipe_conn->sid;
+    conn.parent = pipe_conn;
+    conn.ring = NULL;
+    conn.ring_thread = NULL;
+    conn.ring_bytes = 0;
+    conn.via_ring = true;
+    conn.version = 0;
+    while (usbclerk->_running && !pipe_conn->ring_stop) {
+        bytes = ring->requests()->pop(buffer, sizeof(buffer), USB_CLERK_RING_POLL);
+        if (bytes == 0) {
+            continue;
+        }
+        if (bytes < 0) {
+            vd_printf_limited("Bad ring request, closing the ring");
+            break;
+        }
+        /* keeps the pipe of the connection from being reaped */
+        pipe_conn->last_active = GetTickCount();
+        if (!usbclerk->dispatch_message(buffer, bytes, &reply, &conn)) {
+            break;
+        }
+        if (!ring->replies()->push(&reply, reply.hdr.size)) {
+            vd_printf("Ring reply dropped, client is not reading");
+            break;
+        }
+    }
+    vd_printf("Ring closed after %u request & %u reply signals",
+              ring->requests()->signals(), ring->replies()->signals());
+    return 0;
+}
+
+bool USBClerk::start_ring(Connection *conn, UINT32 key, UINT32 slots)
+{
+    TCHAR name[MAX_PATH];
+
+    if (conn->via_ring || conn->ring) {
+        vd_printf("Ring already set up");
+        return false;
+    }
+    if (!conn->sid) {
+        vd_printf("Cannot get the ring client user");
+        return false;
+    }
+    _sntprintf(name, MAX_PATH, USB_CLERK_RING_NAME, key);
+    conn->ring = new ShmChannel();
+    if (!conn->ring->create(name, slots, conn->sid)) {
+        vd_printf("Failed creating ring %08x of %u slots: %ld", key, slots, GetLastError());
+        delete conn->ring;
+        conn->ring = NULL;
+        return false;
+    }
+    conn->ring_stop = false;
+    conn->ring_thread = CreateThread(NULL, 0, ring_thread, conn, 0, NULL);
+    if (!conn->ring_thread) {
+        vd_printf("CreateThread() failed: %ld", GetLastError());
+        delete conn->ring;
+        conn->ring = NULL;
+        return false;
+    }
+    conn->ring_bytes = 2 * ShmRing::size(slots);
+    return true;
+}
+
+void USBClerk::stop_ring(Connection *conn)
+{
+    if (!conn->ring) {
+        return;
+    }
+    conn->ring_stop = true;
+    conn->ring->requests()->wake();
+    WaitForSingleObject(conn->ring_thread, INFINITE);
+    CloseHandle(conn->ring_thread);
+    delete conn->ring;
+    conn->ring = NULL;
+    conn->ring_bytes = 0;
+}
+
+/* queues a driver operation to the workers and waits for its completion or deadline */
+UINT32 USBClerk::run_driver_op(USBDriverOp* op)
+{
+    if (!submit_driver_op(op)) {
+        return USB_CLERK_STATUS_BUSY;
+    }
+    return wait_driver_op(op);
+}
+
+/* all ops are listed until finished, to cancel them by id or on shutdown. The caller
+   keeps its reference, to release() once done with the op */
+bool USBClerk::submit_driver_op(USBDriverOp* op)
+{
+    EnterCriticalSection(&_ops_lock);
+    _ops.push_back(op);
+    LeaveCriticalSection(&_ops_lock);
+    if (!_queue.submit(op)) {
+        EnterCriticalSection(&_ops_lock);
+        _ops.remove(op);
+        LeaveCriticalSection(&_ops_lock);
+        return false;
+    }
+    return true;
+}
+
+/* past the deadline, an op still queued is dropped and a running one is left to its
+   worker, which stops at its next check; the client is not kept waiting for that */
+UINT32 USBClerk::wait_driver_op(USBDriverOp* op)
+{
+    if (!op->wait(op->remaining())) {
+        op->cancel(USB_CLERK_STATUS_TIMEOUT);
+        if (!_queue.cancel(op) && op->abandon()) {
+            vd_printf("Timed out on %04x:%04x, left to its worker", op->vid, op->pid);
+            return USB_CLERK_STATUS_TIMEOUT;
+        }
+        op->wait();
+    }
+    if (op->queue_time()) {
+        vd_printf("Queued for %lums as %s, queue depth %d", op->queue_time(),
+                  WorkQueue::priority_name(op->priority()), _queue.depth());
+    }
+    return op->result();
+}
+
+/* all devices are queued at once, so workers prepare the next devices while one is
+   installed; the reply is the first failure, if any. The devices share the batch id */
+UINT32 USBClerk::run_driver_batch(USBClerkDriverBatchEx* batch, Connection* conn,
+                                  USBClerkReplyEx* reply)
+{
+    USBDriverOp* ops[USB_CLERK_BATCH_MAX];
+    UINT32 status[USB_CLERK_BATCH_MAX];
+    UINT32 ret = USB_CLERK_STATUS_SUCCESS;
+    DWORD start_time = GetTickCount();
+    DWORD install_time = 0;
+    int i;
+
+    if (batch->count < 1 || batch->count > USB_CLERK_BATCH_MAX ||
+        (batch->op_type != USB_CLERK_DRIVER_INSTALL &&
+         batch->op_type != USB_CLERK_DRIVER_SESSION_INSTALL &&
+         batch->op_type != USB_CLERK_DRIVER_REMOVE)) {
+        vd_printf_limited("Bad batch, type %u count %u", batch->op_type, batch->count);
+        return USB_CLERK_STATUS_FAILED;
+    }
+    for (i = 0; i < batch->count; i++) {
+        ops[i] = new USBDriverOp(this, batch->op_type, batch->devs[i].vid,
+                                 batch->devs[i].pid, batch->id, batch->timeout);
+        ops[i]->set_client(conn);
+        status[i] = submit_driver_op(ops[i]) ? USB_CLERK_STATUS_SUCCESS :
+                                               USB_CLERK_STATUS_BUSY;
+    }
+    for (i = 0; i < batch->count; i++) {
+        if (status[i] == USB_CLERK_STATUS_SUCCESS) {
+            status[i] = wait_driver_op(ops[i]);
+            /* an op left to its worker may still be installing */
+            if (status[i] != USB_CLERK_STATUS_TIMEOUT) {
+                install_time += ops[i]->stage_ms[USB_CLERK_STAGE_INSTALL];
+            }
+        }
+        vd_printf("Batch device %04x:%04x status %u", ops[i]->vid, ops[i]->pid, status[i]);
+        track_dev(conn, batch->op_type, ops[i]->vid, ops[i]->pid, status[i]);
+        ops[i]->report(reply, ret == USB_CLERK_STATUS_SUCCESS);
+        if (ret == USB_CLERK_STATUS_SUCCESS) {
+            ret = status[i];
+        }
+        ops[i]->release();
+    }
+    vd_printf("Batch of %u devices took %lums, %lums of it in the install stage",
+              batch->count, GetTickCount() - start_time, install_time);
+    return ret;
+}
+
+bool USBClerk::owns_dev(Connection* conn, UINT16 vid, UINT16 pid)
+{
+    Connection* owner = conn->parent ? conn->parent : conn;
+    bool found = false;
+
+    EnterCriticalSection(&_conns_lock);
+    for (USBDevs::iterator d = owner->devs.begin(); d != owner->devs.end() && !found; d++) {
+        found = (d->vid == vid && d->pid == pid);
+    }
+    LeaveCriticalSection(&_conns_lock);
+    return found;
+}
+
+/* keeps the list of the connection devices to remove once it closes, or once its
+   Windows session ends */
+void USBClerk::track_dev(Connection* conn, UINT16 type, UINT16 vid, UINT16 pid,
+                         UINT32 status)
+{
+    Connection* owner = conn->parent ? conn->parent : conn;
+
+    EnterCriticalSection(&_conns_lock);
+    switch (type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+    case USB_CLERK_DRIVER_INSTALL:
+        if (status == USB_CLERK_STATUS_SUCCESS) {
+            USBDev dev = {vid, pid, type == USB_CLERK_DRIVER_SESSION_INSTALL, owner->session};
+            owner->devs.push_back(dev);
+        }
+        break;
+    case USB_CLERK_DRIVER_REMOVE:
+        if (status != USB_CLERK_STATUS_SUCCESS && status != USB_CLERK_STATUS_FAILED) {
             break;
         }
-        CloseHandle(thread);
+        // remove device from list to prevent another driver removal in pipe disconnect
+        for (USBDevs::iterator d = owner->devs.begin(); d != owner->devs.end(); d++) {
+            if (d->vid == vid && d->pid == pid) {
+                owner->devs.erase(d);
+                break;
+            }
+        }
+        break;
     }
-    free(_filter_rules);
-    return true;
+    LeaveCriticalSection(&_conns_lock);
 }
 
-DWORD WINAPI USBClerk::pipe_thread(LPVOID param)
+/* how busy the prepare & install stages kept the workers, to tell which one limits
+   device installs */
+void USBClerk::log_pipeline_stats()
 {
-    USBClerkReply reply = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
-        USB_CLERK_REPLY, sizeof(USBClerkReply)}};
-    CHAR buffer[USB_CLERK_PIPE_BUF_SIZE];
-    HANDLE pipe = (HANDLE)param;
-    USBClerk* usbclerk = get();
+    DWORD wall = GetTickCount() - _pipeline_start;
+
+    if ((!_installs && !_installs_failed) || !wall) {
+        return;
+    }
+    vd_printf("Prepare stage busy %lums (%lu%%), install stage busy %lums (%lu%%)",
+              (DWORD)_prepare_busy, (DWORD)((ULONGLONG)_prepare_busy * 100 / wall),
+              (DWORD)_install_busy, (DWORD)((ULONGLONG)_install_busy * 100 / wall));
+    vd_printf("%lu installs, %lu failed, waited %lums for the install stage",
+              (DWORD)_installs, (DWORD)_installs_failed, (DWORD)_install_wait);
+}
+
+/* id 0 cancels all ops. Ops are dequeued outside _ops_lock, as finishing an op
+   unlists it */
+bool USBClerk::cancel_ops(UINT32 id, Connection* conn)
+{
+    USBDriverOps ops;
+
+    EnterCriticalSection(&_ops_lock);
+    for (USBDriverOps::iterator op = _ops.begin(); op != _ops.end(); op++) {
+        if (!id || ((*op)->id == id && (*op)->same_client(conn))) {
+            (*op)->cancel(USB_CLERK_STATUS_CANCELLED);
+            (*op)->add_ref();
+            ops.push_back(*op);
+        }
+    }
+    LeaveCriticalSection(&_ops_lock);
+    for (USBDriverOps::iterator op = ops.begin(); op != ops.end(); op++) {
+        _queue.cancel(*op);
+        (*op)->release();
+    }
+    return !ops.empty();
+}
+
+/* ids are chosen by clients, so a client only cancels its own ops, see
+   USBClerkDriverCancel */
+bool USBClerk::cancel_driver_op(UINT32 id, Connection* conn)
+{
+    /* ops without id cannot be cancelled by clients, 0 cancels all on shutdown */
+    if (!id) {
+        return false;
+    }
+    return cancel_ops(id, conn);
+}
+
+void USBClerk::cancel_driver_ops()
+{
+    cancel_ops(0, NULL);
+}
+
+/* returns 1 if the shutdown removal op succeeded, adding the hub to rescan to parents,
+   and releases it */
+int USBClerk::end_release(USBDriverOp* op, DevParents* parents)
+{
+    int removed = 0;
+
+    /* not result(), as op may have run on this thread */
+    if (!op->abandoned() && op->status == USB_CLERK_STATUS_SUCCESS) {
+        parents->insert(op->parents->begin(), op->parents->end());
+        removed = 1;
+    }
+    op->release();
+    return removed;
+}
+
+/* once no more connections are accepted: lets driver operations in flight complete
+   for up to _drain_timeout, then cancels them, and removes the session installs of
+   all connections in parallel, within _release_timeout, with a single rescan. Each
+   step & removal is a checkpoint for the SCM */
+void USBClerk::shutdown()
+{
+    DWORD start_time = GetTickCount(), deadline, left;
     USBDevs devs;
-    DWORD bytes;
+    DevParents parents;
+    std::list<USBDriverOp*> ops;
+    int pending, removed = 0;
 
-    while (usbclerk->_running) {
-        if (!ReadFile(pipe, &buffer, sizeof(buffer), &bytes, NULL) ||
-            !usbclerk->dispatch_message(buffer, bytes, &reply, &devs) ||
-            !WriteFile(pipe, &reply, sizeof(reply), &bytes, NULL)) {
-            break;
+    deadline = start_time + _drain_timeout;
+    /* left wraps around once the deadline passed */
+    while ((pending = _queue.pending()) && (left = deadline - GetTickCount()) <= _drain_timeout) {
+        set_status(SERVICE_STOP_PENDING, left + _release_timeout);
+        Sleep(USB_CLERK_SHUTDOWN_POLL);
+    }
+    if (pending) {
+        vd_printf("Shutdown: cancelling %d driver operations after %lums", pending,
+                  GetTickCount() - start_time);
+        cancel_driver_ops();
+    } else {
+        vd_printf("Shutdown: driver operations drained in %lums", GetTickCount() - start_time);
+    }
+
+    EnterCriticalSection(&_conns_lock);
+    for (Connections::iterator c = _conns.begin(); c != _conns.end(); c++) {
+        USBDevs::iterator dev = (*c)->devs.begin();
+        while (dev != (*c)->devs.end()) {
+            if (dev->auto_remove) {
+                devs.push_back(*dev);
+                dev = (*c)->devs.erase(dev);
+            } else {
+                dev++;
+            }
         }
-        FlushFileBuffers(pipe);
     }
-    DisconnectNamedPipe(pipe);
-    CloseHandle(pipe);
+    LeaveCriticalSection(&_conns_lock);
+    if (devs.empty()) {
+        return;
+    }
+    set_status(SERVICE_STOP_PENDING, _release_timeout);
+    start_time = GetTickCount();
     for (USBDevs::iterator dev = devs.begin(); dev != devs.end(); dev++) {
-        if (dev->auto_remove) {
-            usbclerk->remove_winusb_driver(dev->vid, dev->pid);
+        USBDriverOp* op = new USBDriverOp(this, USB_CLERK_DRIVER_REMOVE, dev->vid, dev->pid,
+                                          0, _release_timeout);
+        op->parents = new DevParents();
+        if (submit_driver_op(op)) {
+            ops.push_back(op);
+            continue;
         }
+        /* the queue is full, removed on this thread */
+        op->run();
+        removed += end_release(op, &parents);
     }
-    return 0;
+    for (std::list<USBDriverOp*>::iterator op = ops.begin(); op != ops.end(); op++) {
+        wait_driver_op(*op);
+        removed += end_release(*op, &parents);
+        left = GetTickCount() - start_time;
+        set_status(SERVICE_STOP_PENDING, left < _release_timeout ? _release_timeout - left :
+                                                                   USB_CLERK_SHUTDOWN_POLL);
+    }
+    if (removed) {
+        TRACE_SPAN("rescan", -1, -1);
+        rescan_parents(&parents);
+    }
+    vd_printf("Shutdown: removed %d of %u session devices in %lums", removed,
+              (unsigned)devs.size(), GetTickCount() - start_time);
 }
 
-bool USBClerk::dispatch_message(CHAR *buffer, DWORD bytes, USBClerkReply *reply, USBDevs *devs)
+bool USBClerk::dispatch_message(CHAR *buffer, DWORD bytes, USBClerkReplyEx *reply, Connection *conn)
 {
     USBClerkHeader *hdr = (USBClerkHeader *)buffer;
+    USBClerkDriverOpEx op_ex;
     USBClerkDriverOp *op;
+    UINT32 ops = 0;
 
-    if (hdr->magic != USB_CLERK_MAGIC) {
-        vd_printf("Bad message received, magic %d", hdr->magic);
+    _capture.record(conn->id, CAPTURE_REQUEST, buffer, bytes);
+    switch (usb_clerk_check_message(buffer, bytes)) {
+    case USB_CLERK_MSG_VALID:
+        break;
+    case USB_CLERK_MSG_BAD_MAGIC:
+        vd_printf_limited("Bad message received, magic %d", hdr->magic);
         return false;
-    }
-    if (hdr->size != sizeof(USBClerkDriverOp)) {
+    case USB_CLERK_MSG_UNKNOWN_TYPE:
+        vd_printf_limited("Unknown message received, type %u", hdr->type);
+        return false;
+    case USB_CLERK_MSG_BAD_SIZE:
         vd_printf("Wrong mesage size %u type %u", hdr->size, hdr->type);
         return false;
+    default:
+        vd_printf("Truncated message, size %u bytes %lu", hdr->size, bytes);
+        return false;
+    }
+    /* tells whether the client sends keepalives */
+    (conn->parent ? conn->parent : conn)->version = hdr->version;
+    memset(&reply->status, 0, sizeof(*reply) - sizeof(reply->hdr));
+    reply->hdr.size = hdr->version < USB_CLERK_VERSION_REPLY_EX ? sizeof(USBClerkReply) :
+                                                                  sizeof(USBClerkReplyEx);
+    /* not logged, idle clients may send many */
+    if (hdr->type == USB_CLERK_KEEPALIVE) {
+        reply->status = USB_CLERK_STATUS_SUCCESS;
+        _capture.record(conn->id, CAPTURE_REPLY, reply, reply->hdr.size);
+        return true;
     }
-    op = (USBClerkDriverOp *)buffer;
+    /* id & timeout are left zero for plain USBClerkDriverOp */
+    memset(&op_ex, 0, sizeof(op_ex));
     switch (hdr->type) {
     case USB_CLERK_DRIVER_SESSION_INSTALL:
     case USB_CLERK_DRIVER_INSTALL:
-        vd_printf("Installing winusb driver for %04x:%04x", op->vid, op->pid);
-        reply->status = install_winusb_driver(op->vid, op->pid);
-        if (reply->status) {
-            USBDev dev = {op->vid, op->pid, hdr->type == USB_CLERK_DRIVER_SESSION_INSTALL};
-            devs->push_back(dev);
-        }
+    case USB_CLERK_DRIVER_REMOVE:
+        memcpy(&op_ex, buffer, hdr->size);
+    }
+    op = (USBClerkDriverOp *)&op_ex;
+    TRACE_SPAN("dispatch_message", op->vid, op->pid);
+    /* removing what the connection installed is not throttled, a client must always
+       be able to give devices back */
+    switch (hdr->type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+    case USB_CLERK_DRIVER_INSTALL:
+        ops = 1;
         break;
     case USB_CLERK_DRIVER_REMOVE:
-        // FIXME: check device is not used by another client
-        vd_printf("Removing winusb driver for %04x:%04x", op->vid, op->pid);
-        reply->status = remove_winusb_driver(op->vid, op->pid);
-        // remove device from list to prevent another driver removal in pipe disconnect
-        for (USBDevs::iterator d = devs->begin(); d != devs->end(); d++) {
-            if (d->vid == op->vid && d->pid == op->pid) {
-                devs->erase(d);
-                break;
+        ops = owns_dev(conn, op->vid, op->pid) ? 0 : 1;
+        break;
+    case USB_CLERK_DRIVER_BATCH: {
+        USBClerkDriverBatch *batch = (USBClerkDriverBatch *)buffer;
+        ops = batch->count;
+        for (int i = 0; i < batch->count && i < USB_CLERK_BATCH_MAX; i++) {
+            if (batch->op_type == USB_CLERK_DRIVER_REMOVE &&
+                    owns_dev(conn, batch->devs[i].vid, batch->devs[i].pid)) {
+                ops--;
             }
         }
         break;
-    default:
-        vd_printf("Unknown message received, type %u", hdr->type);
-        return false;
     }
-    if (reply->status) {
+    }
+    if (ops && !admit(conn, ops)) {
+        reply->status = USB_CLERK_STATUS_THROTTLED;
+        goto done;
+    }
+    switch (hdr->type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+    case USB_CLERK_DRIVER_INSTALL: {
+        vd_printf("Installing winusb driver for %04x:%04x", op->vid, op->pid);
+        USBDriverOp* driver_op = new USBDriverOp(this, hdr->type, op->vid, op->pid, op_ex.id,
+                                                 op_ex.timeout);
+        driver_op->set_client(conn);
+        reply->status = run_driver_op(driver_op);
+        driver_op->report(reply, reply->status != USB_CLERK_STATUS_SUCCESS);
+        driver_op->release();
+        track_dev(conn, hdr->type, op->vid, op->pid, reply->status);
+        break;
+    }
+    case USB_CLERK_DRIVER_REMOVE: {
+        // FIXME: check device is not used by another client
+        vd_printf("Removing winusb driver for %04x:%04x", op->vid, op->pid);
+        USBDriverOp* driver_op = new USBDriverOp(this, hdr->type, op->vid, op->pid, op_ex.id,
+                                                 op_ex.timeout);
+        driver_op->set_client(conn);
+        reply->status = run_driver_op(driver_op);
+        driver_op->report(reply, reply->status != USB_CLERK_STATUS_SUCCESS);
+        driver_op->release();
+        track_dev(conn, hdr->type, op->vid, op->pid, reply->status);
+        break;
+    }
+    case USB_CLERK_DRIVER_CANCEL: {
+        USBClerkDriverCancel *cancel = (USBClerkDriverCancel *)buffer;
+        vd_printf("Cancelling operation %u", cancel->id);
+        reply->status = cancel_driver_op(cancel->id, conn) ? USB_CLERK_STATUS_SUCCESS :
+                                                       USB_CLERK_STATUS_FAILED;
+        break;
+    }
+    case USB_CLERK_DRIVER_BATCH: {
+        /* id is left zero for plain USBClerkDriverBatch */
+        USBClerkDriverBatchEx batch;
+        memset(&batch, 0, sizeof(batch));
+        memcpy(&batch, buffer, hdr->size);
+        vd_printf("Batch %u of %u driver operations, type %u", batch.id, batch.count,
+                  batch.op_type);
+        reply->status = run_driver_batch(&batch, conn, reply);
+        break;
+    }
+    case USB_CLERK_RING_SETUP: {
+        USBClerkRingSetup *setup = (USBClerkRingSetup *)buffer;
+        vd_printf("Setting up ring %08x of %u slots", setup->key, setup->slots);
+        reply->status = start_ring(conn, setup->key, setup->slots) ?
+                        USB_CLERK_STATUS_SUCCESS : USB_CLERK_STATUS_FAILED;
+        break;
+    }
+    }
+done:
+    switch (reply->status) {
+    case USB_CLERK_STATUS_SUCCESS:
         vd_printf("Completed successfully");
-    } else {
-        vd_printf("Failed");
+        break;
+    case USB_CLERK_STATUS_BUSY:
+        vd_printf_limited("Busy, client should retry later");
+        break;
+    case USB_CLERK_STATUS_TIMEOUT:
+        vd_printf("Timed out");
+        break;
+    case USB_CLERK_STATUS_CANCELLED:
+        vd_printf("Cancelled");
+        break;
+    case USB_CLERK_STATUS_THROTTLED:
+        /* logged by admit() */
+        break;
+    default:
+        vd_printf("Failed, error %u (%ld)", reply->error, (LONG)reply->native_error);
     }
+    if (hdr->version < USB_CLERK_VERSION_THROTTLED &&
+            reply->status == USB_CLERK_STATUS_THROTTLED) {
+        reply->status = USB_CLERK_STATUS_BUSY;
+    }
+    if (hdr->version < USB_CLERK_VERSION_STATUS && reply->status > USB_CLERK_STATUS_SUCCESS) {
+        reply->status = USB_CLERK_STATUS_FAILED;
+    }
+    _capture.record(conn->id, CAPTURE_REPLY, reply, reply->hdr.size);
     return true;
 }
 
-bool USBClerk::install_winusb_driver(int vid, int pid)
+bool USBClerk::install_winusb_driver(int vid, int pid, USBDriverOp* op)
 {
     struct wdi_device_info *wdidev, *wdilist;
     struct wdi_options_create_list wdi_list_opts;
     struct wdi_options_prepare_driver wdi_prep_opts;
     struct wdi_options_install_driver wdi_inst_opts;
     char infname[USB_DRIVER_INFNAME_LEN];
+    DWORD stage_time;
+    PendingInstallWaiter waiter(op);
+    RetryScheduler retry(&waiter, USB_DRIVER_PENDING_TIMEOUT, USB_DRIVER_BACKOFF_INITIAL,
+                         USB_DRIVER_BACKOFF_MAX, USB_DRIVER_PENDING_SLICE,
+                         GetTickCount() ^ GetCurrentThreadId());
     bool installed;
+    bool allowed;
     bool found = false;
     int r;
 
-    if (!dev_filter_check(vid, pid, &installed)) {
+    stage_time = GetTickCount();
+    if (!wait_ready()) {
+        op->fail(USB_CLERK_ERROR_NOT_READY, 0);
+        return false;
+    }
+    op->time_stage(USB_CLERK_STAGE_QUEUE, stage_time);
+    stage_time = GetTickCount();
+    allowed = dev_filter_check(vid, pid, &installed, op);
+    op->time_stage(USB_CLERK_STAGE_FILTER, stage_time);
+    if (!allowed) {
         return false;
     }
     if (installed) {
         vd_printf("WinUSB driver is already installed");
         return true;
     }
+    if (op->aborted()) {
+        return false;
+    }
 
     /* find wdi device that matches the libusb device */
     memset(&wdi_list_opts, 0, sizeof(wdi_list_opts));
     wdi_list_opts.list_all = 1;
     wdi_list_opts.list_hubs = 0;
     wdi_list_opts.trim_whitespaces = 1;
-    r = wdi_create_list(&wdilist, &wdi_list_opts);
+    stage_time = GetTickCount();
+    {
+        TRACE_SPAN("wdi_create_list", vid, pid);
+        r = wdi_create_list(&wdilist, &wdi_list_opts);
+    }
     if (r != WDI_SUCCESS) {
+        op->time_stage(USB_CLERK_STAGE_ENUMERATE, stage_time);
+        op->fail(USB_CLERK_ERROR_ENUMERATE, r);
         vd_printf("Device %04x:%04x wdi_create_list() failed -- %s (%d)",
                   vid, pid, wdi_strerror(r), r);
         return false;
@@ -457,11 +2344,16 @@ bool USBClerk::install_winusb_driver(int vid, int pid)
     vd_printf("Looking for device vid:pid %04x:%04x", vid, pid);
     for (wdidev = wdilist; wdidev != NULL && !(found = wdidev->vid == vid && wdidev->pid == pid);
          wdidev = wdidev->next);
+    op->time_stage(USB_CLERK_STAGE_ENUMERATE, stage_time);
     if (!found) {
-        vd_printf("Device %04x:%04x was not found", vid, pid);
+        op->fail(USB_CLERK_ERROR_NOT_FOUND, 0);
+        vd_printf_limited("Device %04x:%04x was not found", vid, pid);
         goto cleanup;
     }
     vd_printf("Device %04x:%04x found", vid, pid);
+    if (op->aborted()) {
+        goto cleanup;
+    }
 
     /* inf filename is built out of vid and pid */
     r = snprintf(infname, sizeof(infname), "usb_device_%04x_%04x.inf", vid, pid);
@@ -474,31 +2366,64 @@ bool USBClerk::install_winusb_driver(int vid, int pid)
               wdidev->desc, vid, pid, infname);
     memset(&wdi_prep_opts, 0, sizeof(wdi_prep_opts));
     wdi_prep_opts.driver_type = WDI_WINUSB;
-    r = wdi_prepare_driver(wdidev, _wdi_path, infname, &wdi_prep_opts);
+    stage_time = GetTickCount();
+    {
+        TRACE_SPAN("wdi_prepare_driver", vid, pid);
+        r = wdi_prepare_driver(wdidev, _wdi_path, infname, &wdi_prep_opts);
+    }
+    op->time_stage(USB_CLERK_STAGE_PREPARE, stage_time);
+    InterlockedExchangeAdd(&_prepare_busy, GetTickCount() - stage_time);
     if (r != WDI_SUCCESS) {
+        op->fail(USB_CLERK_ERROR_PREPARE, r);
         vd_printf("Device %04x:%04x driver prepare failed -- %s (%d)",
                   vid, pid, wdi_strerror(r), r);
         goto cleanup;
     }
 
+    /* prepared drivers are installed one at a time, while other workers prepare */
+    stage_time = GetTickCount();
+    if (!op->acquire(_install_stage)) {
+        goto cleanup;
+    }
+    op->time_stage(USB_CLERK_STAGE_QUEUE, stage_time);
+    InterlockedExchangeAdd(&_install_wait, GetTickCount() - stage_time);
+    stage_time = GetTickCount();
+
     memset(&wdi_inst_opts, 0, sizeof(wdi_inst_opts));
-    for (int t = 0; t < USB_DRIVER_INSTALL_RETRIES; t++) {
-        r = wdi_install_driver(wdidev, _wdi_path, infname, &wdi_inst_opts);
-        if (r == WDI_ERROR_PENDING_INSTALLATION) {
-            if (t == 0) {
-                vd_printf("Another driver is installing, will retry every %dms, up to %d times",
-                          USB_DRIVER_INSTALL_INTERVAL, USB_DRIVER_INSTALL_RETRIES);
-            }
-            Sleep(USB_DRIVER_INSTALL_INTERVAL);
-        } else {
+    for (;;) {
+        {
+            TRACE_SPAN("wdi_install_driver", vid, pid);
+            r = wdi_install_driver(wdidev, _wdi_path, infname, &wdi_inst_opts);
+            op->attempts++;
+        }
+        if (r != WDI_ERROR_PENDING_INSTALLATION) {
             /* break on success or any error other than pending installation */
             break;
         }
+        if (retry.waits() == 0) {
+            vd_printf_limited("Another driver is installing, will wait up to %dms",
+                              USB_DRIVER_PENDING_TIMEOUT);
+        }
+        if (!retry.wait()) {
+            break;
+        }
+    }
+    op->time_stage(USB_CLERK_STAGE_INSTALL, stage_time);
+    InterlockedExchangeAdd(&_install_busy, GetTickCount() - stage_time);
+    InterlockedIncrement(r == WDI_SUCCESS ? &_installs : &_installs_failed);
+    ReleaseSemaphore(_install_stage, 1, NULL);
+    if (retry.waits()) {
+        vd_printf("Waited %ums for pending installations, %d retries",
+                  retry.waited(), retry.waits());
     }
 
     if (!(installed = (r == WDI_SUCCESS))) {
+        op->fail(r == WDI_ERROR_PENDING_INSTALLATION ? USB_CLERK_ERROR_PENDING_INSTALL :
+                                                       USB_CLERK_ERROR_INSTALL, r);
         vd_printf("Device %04x:%04x driver install failed -- %s (%d)",
                   vid, pid, wdi_strerror(r), r);
+    } else {
+        map_dev(vid, pid, wdidev->device_id);
     }
 
 cleanup:
@@ -506,30 +2431,93 @@ cleanup:
     return installed;
 }
 
-bool USBClerk::remove_winusb_driver(int vid, int pid)
+/* parents is given when removing several devices, to rescan their hubs once after all */
+bool USBClerk::remove_winusb_driver(int vid, int pid, USBDriverOp* op, DevParents* parents)
 {
     HDEVINFO devs;
     SP_DEVINFO_DATA dev_info;
+    DEVINST parent = 0;
     bool installed;
+    bool found;
     bool ret = false;
+    TCHAR inf_name[DEVICE_MAP_INF_LEN];
+    DeviceMapEntry mapped;
+    bool has_mapped;
+    DWORD uninstall_time;
+    DWORD stage_time = GetTickCount();
+    TraceSpan enum_span("SetupAPI enumeration", vid, pid);
 
-    devs = SetupDiGetClassDevs(NULL, L"USB", NULL, DIGCF_ALLCLASSES);
-    if (devs == INVALID_HANDLE_VALUE) {
-        vd_printf("SetupDiGetClassDevsEx failed: %ld", GetLastError());
-        return false;
+    /* a mapped device is opened by its instance id, enumerating USB devices includes
+       every one ever plugged, a set which only grows */
+    has_mapped = _devices.get(vid, pid, &mapped);
+    if (has_mapped && open_dev_info(mapped.instance_id, vid, pid, &devs, &dev_info,
+                                    &installed)) {
+        found = true;
+        InterlockedIncrement(&_devs_opened);
+    } else {
+        devs = SetupDiGetClassDevs(NULL, L"USB", NULL, DIGCF_ALLCLASSES);
+        if (devs == INVALID_HANDLE_VALUE) {
+            op->fail(USB_CLERK_ERROR_ENUMERATE, GetLastError());
+            vd_printf("SetupDiGetClassDevsEx failed: %ld", GetLastError());
+            return false;
+        }
+        found = get_dev_info(devs, vid, pid, &dev_info, &installed);
+        InterlockedIncrement(&_devs_enumerated);
+    }
+    enum_span.end();
+    op->time_stage(USB_CLERK_STAGE_ENUMERATE, stage_time);
+    if (!found) {
+        op->fail(USB_CLERK_ERROR_NOT_FOUND, 0);
     }
-    if (get_dev_info(devs, vid, pid, &dev_info, &installed)) {
+    if (found && !op->aborted()) {
         if (installed) {
             vd_printf("Removing %04x:%04x", vid, pid);
-            if (uninstall_inf(devs, &dev_info)) {
-                ret = remove_dev(devs, &dev_info);
+            TraceSpan uninstall_span("uninstall_inf", vid, pid);
+            uninstall_time = GetTickCount();
+            if (has_mapped && get_mapped_inf(vid, pid, &mapped, &dev_info, inf_name)) {
+                ret = uninstall_oem_inf(inf_name);
+                InterlockedIncrement(&_inf_map_hits);
+                InterlockedExchangeAdd(&_inf_map_time, GetTickCount() - uninstall_time);
+            } else {
+                ret = uninstall_inf(devs, &dev_info);
+                InterlockedIncrement(&_inf_map_misses);
+                InterlockedExchangeAdd(&_inf_walk_time, GetTickCount() - uninstall_time);
+            }
+            if (!ret) {
+                op->fail(USB_CLERK_ERROR_UNINSTALL, GetLastError());
+            }
+            uninstall_span.end();
+            /* the hub to rescan, while the device is still there. Unknown for a device
+               no longer plugged, as the root is rescanned then */
+            if (CM_Get_Parent(&parent, dev_info.DevInst, 0) != CR_SUCCESS) {
+                parent = 0;
+            }
+            if (ret) {
+                TRACE_SPAN("remove_dev", vid, pid);
+                if (!(ret = remove_dev(devs, &dev_info))) {
+                    op->fail(USB_CLERK_ERROR_UNINSTALL, GetLastError());
+                }
+            }
+            op->time_stage(USB_CLERK_STAGE_INSTALL, uninstall_time);
+            if (ret) {
+                _devices.remove(vid, pid);
             }
         } else {
+            op->fail(USB_CLERK_ERROR_NOT_INSTALLED, 0);
             vd_printf("WinUSB driver is not installed");
         }
     }
     SetupDiDestroyDeviceInfoList(devs);
-    ret = ret && rescan();
+    if (ret && parents) {
+        parents->insert(parent);
+    } else if (ret) {
+        TRACE_SPAN("rescan", vid, pid);
+        stage_time = GetTickCount();
+        if (!(ret = rescan(parent))) {
+            op->fail(USB_CLERK_ERROR_RESCAN, 0);
+        }
+        op->time_stage(USB_CLERK_STAGE_RESCAN, stage_time);
+    }
     return ret;
 }
 
@@ -567,13 +2555,101 @@ bool USBClerk::uninstall_inf(HDEVINFO devs, PSP_DEVINFO_DATA dev_info)
     }
     vd_printf("Uninstalling inf: %S", drv_info_detail.InfFileName);
     inf_filename = wcsrchr(drv_info_detail.InfFileName, '\\') + 1;
-    if (!SetupUninstallOEMInf(inf_filename, SUOI_FORCEDELETE, NULL)) {
+    return uninstall_oem_inf(inf_filename);
+}
+
+bool USBClerk::uninstall_oem_inf(const TCHAR* inf_name)
+{
+    if (!SetupUninstallOEMInf(inf_name, SUOI_FORCEDELETE, NULL)) {
         vd_printf("Failed to uninstall inf: %ld", GetLastError());
         return false;
     }
     return true;
 }
 
+/* the instance id & published INF of the driver of a device, from its driver key */
+static bool get_dev_entry(DEVINST devinst, DeviceMapEntry* entry)
+{
+    DWORD size = sizeof(entry->inf_name) - sizeof(WCHAR), type;
+    HKEY hkey;
+    LONG err;
+
+    if (CM_Get_Device_ID(devinst, entry->instance_id, DEVICE_MAP_ID_LEN, 0) != CR_SUCCESS ||
+        CM_Open_DevNode_Key(devinst, KEY_READ, 0, RegDisposition_OpenExisting, &hkey,
+                            CM_REGISTRY_SOFTWARE) != CR_SUCCESS) {
+        return false;
+    }
+    memset(entry->inf_name, 0, sizeof(entry->inf_name));
+    err = RegQueryValueEx(hkey, L"InfPath", NULL, &type, (LPBYTE)entry->inf_name, &size);
+    RegCloseKey(hkey);
+    return err == ERROR_SUCCESS && type == REG_SZ;
+}
+
+/* remembers the published INF of a device WinUSB was installed for, so its removal
+   does not have to search the driver list for it */
+void USBClerk::map_dev(int vid, int pid, const char* device_id)
+{
+    WCHAR id[MAX_DEVICE_ID_LEN];
+    DeviceMapEntry entry;
+    DEVINST devinst;
+
+    _snwprintf(id, MAX_DEVICE_ID_LEN, L"%S", device_id);
+    id[MAX_DEVICE_ID_LEN - 1] = L'\0';
+    if (CM_Locate_DevNode(&devinst, id, CM_LOCATE_DEVNODE_NORMAL) != CR_SUCCESS ||
+        !get_dev_entry(devinst, &entry)) {
+        vd_printf("Cannot find the installed inf of %04x:%04x", vid, pid);
+        return;
+    }
+    if (_devices.set(vid, pid, &entry)) {
+        vd_printf("Device %04x:%04x is %S, inf %S", vid, pid, entry.instance_id,
+                  entry.inf_name);
+    }
+}
+
+/* the mapped INF of the device, if the map entry still matches the device & the
+   driver it has, e.g. not after a manual driver update */
+bool USBClerk::get_mapped_inf(int vid, int pid, DeviceMapEntry* mapped,
+                              PSP_DEVINFO_DATA dev_info, TCHAR* inf_name)
+{
+    DeviceMapEntry current;
+
+    if (!get_dev_entry(dev_info->DevInst, &current) ||
+            _wcsicmp(mapped->instance_id, current.instance_id) ||
+            _wcsicmp(mapped->inf_name, current.inf_name)) {
+        vd_printf("Stale device map entry of %04x:%04x", vid, pid);
+        _devices.remove(vid, pid);
+        return false;
+    }
+    wcscpy(inf_name, mapped->inf_name);
+    return true;
+}
+
+/* how removals found the device & the INF to uninstall, with the device map or
+   without it, and how long that & rescans took */
+void USBClerk::log_removal_stats()
+{
+    if (_devs_opened || _devs_enumerated) {
+        vd_printf("%ld removals opened the device by instance id, %ld enumerated USB devices",
+                  _devs_opened, _devs_enumerated);
+    }
+    if (_rescans_scoped) {
+        vd_printf("%ld hub rescans, %lums on average", _rescans_scoped,
+                  (DWORD)(_rescan_scoped_time / _rescans_scoped));
+    }
+    if (_rescans_root) {
+        vd_printf("%ld root rescans, queued in %lums on average", _rescans_root,
+                  (DWORD)(_rescan_root_time / _rescans_root));
+    }
+    if (_inf_map_hits) {
+        vd_printf("%ld removals found their inf in the device map, %lums on average",
+                  _inf_map_hits, (DWORD)(_inf_map_time / _inf_map_hits));
+    }
+    if (_inf_map_misses) {
+        vd_printf("%ld removals searched the driver list, %lums on average",
+                  _inf_map_misses, (DWORD)(_inf_walk_time / _inf_map_misses));
+    }
+}
+
 bool USBClerk::remove_dev(HDEVINFO devs, PSP_DEVINFO_DATA dev_info)
 {
     SP_REMOVEDEVICE_PARAMS rmd_params;
@@ -594,10 +2670,26 @@ bool USBClerk::remove_dev(HDEVINFO devs, PSP_DEVINFO_DATA dev_info)
     return true;
 }
 
-bool USBClerk::rescan()
+/* re-enumerates the hub of removed devices so they are found again with their former
+   driver, or the whole device tree if the hub is unknown or its enumeration failed.
+   A hub is enumerated synchronously, so its devices are back once it returns & its
+   timing is that of the enumeration. The whole tree would block the caller for long,
+   it is only queued & timed until it returns */
+bool USBClerk::rescan(DEVINST parent)
 {
     DEVINST dev_root;
+    DWORD start_time = GetTickCount(), took;
 
+    if (parent) {
+        if (CM_Reenumerate_DevNode(parent, CM_REENUMERATE_SYNCHRONOUS) == CR_SUCCESS) {
+            took = GetTickCount() - start_time;
+            InterlockedIncrement(&_rescans_scoped);
+            InterlockedExchangeAdd(&_rescan_scoped_time, took);
+            vd_printf("Hub rescan took %lums", took);
+            return true;
+        }
+        vd_printf("Hub enumeration failed, rescanning from the root");
+    }
     if (CM_Locate_DevNode_Ex(&dev_root, NULL, CM_LOCATE_DEVNODE_NORMAL, NULL) != CR_SUCCESS) {
         vd_printf("Device node cannot be located: %ld", GetLastError());
         return false;
@@ -606,15 +2698,32 @@ bool USBClerk::rescan()
         vd_printf("Device node enumeration failed: %ld", GetLastError());
         return false;
     }
+    took = GetTickCount() - start_time;
+    InterlockedIncrement(&_rescans_root);
+    InterlockedExchangeAdd(&_rescan_root_time, took);
+    vd_printf("Root rescan queued in %lums", took);
     return true;
 }
 
+/* each hub once, or only the root if a device had no known hub */
+bool USBClerk::rescan_parents(DevParents* parents)
+{
+    bool ret = true;
+
+    if (parents->count(0)) {
+        return rescan(0);
+    }
+    for (DevParents::iterator p = parents->begin(); p != parents->end(); p++) {
+        ret = rescan(*p) && ret;
+    }
+    return ret;
+}
+
 bool USBClerk::get_dev_info(HDEVINFO devs, int vid, int pid, SP_DEVINFO_DATA *dev_info,
                             bool *has_winusb)
 {
     TCHAR dev_prefix[MAX_DEVICE_ID_LEN];
     TCHAR dev_id[MAX_DEVICE_ID_LEN];
-    TCHAR service_name[MAX_DEVICE_PROP_LEN];
     bool dev_found = false;
 
     _sntprintf(dev_prefix, MAX_DEVICE_ID_LEN, TEXT("USB\\VID_%04X&PID_%04X\\"), vid, pid);
@@ -626,22 +2735,193 @@ bool USBClerk::get_dev_info(HDEVINFO devs, int vid, int pid, SP_DEVINFO_DATA *de
         }
     }
     if (!dev_found) {
-        vd_printf("Cannot find device info %04X:%04X", vid, pid);
+        vd_printf_limited("Cannot find device info %04X:%04X", vid, pid);
         return false;
     }
-    if (has_winusb == NULL) {
-        return true;
+    if (has_winusb != NULL) {
+        *has_winusb = has_winusb_service(devs, dev_info);
     }
+    return true;
+}
+
+/* opens a device by instance id into a new devs, which the caller destroys, if it is
+   still the device vid:pid */
+bool USBClerk::open_dev_info(const TCHAR* instance_id, int vid, int pid, HDEVINFO *devs,
+                             SP_DEVINFO_DATA *dev_info, bool *has_winusb)
+{
+    TCHAR dev_prefix[MAX_DEVICE_ID_LEN];
+
+    _sntprintf(dev_prefix, MAX_DEVICE_ID_LEN, TEXT("USB\\VID_%04X&PID_%04X\\"), vid, pid);
+    if (_wcsnicmp(instance_id, dev_prefix, wcslen(dev_prefix))) {
+        return false;
+    }
+    *devs = SetupDiCreateDeviceInfoList(NULL, NULL);
+    if (*devs == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    dev_info->cbSize = sizeof(*dev_info);
+    if (!SetupDiOpenDeviceInfo(*devs, instance_id, NULL, 0, dev_info)) {
+        vd_printf("Cannot open device %S: %ld", instance_id, GetLastError());
+        SetupDiDestroyDeviceInfoList(*devs);
+        return false;
+    }
+    *has_winusb = has_winusb_service(*devs, dev_info);
+    return true;
+}
+
+bool USBClerk::has_winusb_service(HDEVINFO devs, SP_DEVINFO_DATA *dev_info)
+{
+    TCHAR service_name[MAX_DEVICE_PROP_LEN];
+
     if (!SetupDiGetDeviceRegistryProperty(devs, dev_info, SPDRP_SERVICE, NULL,
             (PBYTE)service_name, sizeof(service_name), NULL)) {
         vd_printf("Cannot get device service name %ld", GetLastError());
-        *has_winusb = false;
-        return true;
+        return false;
+    }
+    return !wcscmp(service_name, L"WinUSB");
+}
+
+/* the USB devnodes, including those of devices no longer plugged */
+bool USBClerk::count_usb_devs(DWORD* total, DWORD* present)
+{
+    SP_DEVINFO_DATA dev_info;
+    ULONG status, problem;
+    HDEVINFO devs;
+
+    *total = *present = 0;
+    devs = SetupDiGetClassDevs(NULL, L"USB", NULL, DIGCF_ALLCLASSES);
+    if (devs == INVALID_HANDLE_VALUE) {
+        return false;
     }
-    *has_winusb = !wcscmp(service_name, L"WinUSB");
+    dev_info.cbSize = sizeof(dev_info);
+    for (DWORD i = 0; SetupDiEnumDeviceInfo(devs, i, &dev_info); i++) {
+        (*total)++;
+        if (CM_Get_DevNode_Status(&status, &problem, dev_info.DevInst, 0) == CR_SUCCESS) {
+            (*present)++;
+        }
+    }
+    SetupDiDestroyDeviceInfoList(devs);
     return true;
 }
 
+/* opens a mapped device no longer plugged that still has WinUSB, e.g. unplugged while
+   redirected. The caller destroys devs */
+bool USBClerk::open_ghost(UINT16 vid, UINT16 pid, DeviceMapEntry* entry, HDEVINFO* devs,
+                          SP_DEVINFO_DATA* dev_info)
+{
+    ULONG status, problem;
+    bool has_winusb;
+
+    if (!_devices.get(vid, pid, entry) ||
+            !open_dev_info(entry->instance_id, vid, pid, devs, dev_info, &has_winusb)) {
+        return false;
+    }
+    if (has_winusb &&
+            CM_Get_DevNode_Status(&status, &problem, dev_info->DevInst, 0) ==
+            CR_NO_SUCH_DEVINST) {
+        return true;
+    }
+    SetupDiDestroyDeviceInfoList(*devs);
+    return false;
+}
+
+/* runs as a background op, so it is journaled & cancelled like other removals. The
+   device may have come back since it was found */
+bool USBClerk::remove_ghost(UINT16 vid, UINT16 pid, USBDriverOp* op)
+{
+    DeviceMapEntry entry;
+    SP_DEVINFO_DATA dev_info;
+    TCHAR inf_name[DEVICE_MAP_INF_LEN];
+    HDEVINFO devs;
+    bool inf_valid, ret;
+    DWORD stage_time = GetTickCount();
+
+    if (!open_ghost(vid, pid, &entry, &devs, &dev_info)) {
+        op->fail(USB_CLERK_ERROR_NOT_FOUND, 0);
+        return false;
+    }
+    op->time_stage(USB_CLERK_STAGE_ENUMERATE, stage_time);
+    if (op->aborted()) {
+        SetupDiDestroyDeviceInfoList(devs);
+        return false;
+    }
+    stage_time = GetTickCount();
+    vd_printf("Removing ghost device %S", entry.instance_id);
+    /* before the devnode & its driver key are gone */
+    inf_valid = get_mapped_inf(vid, pid, &entry, &dev_info, inf_name);
+    ret = remove_dev(devs, &dev_info);
+    if (ret) {
+        if (inf_valid) {
+            uninstall_oem_inf(inf_name);
+        }
+        _devices.remove(vid, pid);
+    } else {
+        op->fail(USB_CLERK_ERROR_UNINSTALL, GetLastError());
+    }
+    op->time_stage(USB_CLERK_STAGE_INSTALL, stage_time);
+    SetupDiDestroyDeviceInfoList(devs);
+    return ret;
+}
+
+/* removes the devnodes of mapped devices no longer plugged that still have WinUSB,
+   with their INF. Nothing else removes them, and each slows down the USB enumeration
+   of later removals. Found ghosts are removed by background ops */
+void USBClerk::collect_ghosts()
+{
+    DeviceMapIds ids;
+    DeviceMapEntry entry;
+    SP_DEVINFO_DATA dev_info;
+    std::list<USBDriverOp*> ops;
+    DWORD total, present, start_time = GetTickCount();
+    HDEVINFO devs;
+    int ghosts = 0, removed = 0;
+
+    count_usb_devs(&total, &present);
+    vd_printf("Ghost collection: %lu USB devnodes, %lu present", total, present);
+    _devices.list(&ids);
+    for (DeviceMapIds::iterator id = ids.begin(); id != ids.end() && _running; id++) {
+        UINT16 vid = (UINT16)(*id >> 16), pid = (UINT16)*id;
+        if (!open_ghost(vid, pid, &entry, &devs, &dev_info)) {
+            continue;
+        }
+        SetupDiDestroyDeviceInfoList(devs);
+        ghosts++;
+        USBDriverOp* op = new USBDriverOp(this, USB_CLERK_DRIVER_REMOVE, vid, pid);
+        op->ghost = true;
+        op->set_priority(WORK_PRIORITY_BACKGROUND);
+        if (submit_driver_op(op)) {
+            ops.push_back(op);
+        } else {
+            op->release();
+        }
+    }
+    for (std::list<USBDriverOp*>::iterator op = ops.begin(); op != ops.end(); op++) {
+        /* shutdown cancels queued ops */
+        (*op)->wait();
+        if ((*op)->result() == USB_CLERK_STATUS_SUCCESS) {
+            removed++;
+        }
+        (*op)->release();
+    }
+    _ghosts_removed += removed;
+    if (ghosts) {
+        count_usb_devs(&total, &present);
+    }
+    vd_printf("Ghost collection removed %d of %d ghosts (%lu in all) in %lums, "
+              "%lu USB devnodes left", removed, ghosts, _ghosts_removed,
+              GetTickCount() - start_time, total);
+}
+
+DWORD WINAPI USBClerk::ghost_thread(LPVOID param)
+{
+    USBClerk* s = (USBClerk*)param;
+
+    while (WaitForSingleObject(s->_ghost_stop, s->_ghost_interval) == WAIT_TIMEOUT) {
+        s->collect_ghosts();
+    }
+    return 0;
+}
+
 bool USBClerk::get_dev_props(HDEVINFO devs, SP_DEVINFO_DATA *dev_info,
                              uint8_t *cls, uint8_t *subcls, uint8_t *proto)
 {
@@ -704,38 +2984,50 @@ bool USBClerk::get_dev_ifaces(HDEVINFO devs, int vid, int pid, int *iface_count,
 
 /* returns true if the device exists and passed the filter rules (or no filters at all).
    has_winusb is true if winusb driver is installed on the device. */
-bool USBClerk::dev_filter_check(int vid, int pid, bool *has_winusb)
+bool USBClerk::dev_filter_check(int vid, int pid, bool *has_winusb, USBDriverOp* op)
 {
     HDEVINFO devs;
     SP_DEVINFO_DATA dev_info;
     uint8_t dev_cls, dev_subcls, dev_proto;
     uint8_t *iface_cls, *iface_subcls, *iface_proto;
     int iface_count = 0;
+    bool found;
+    FilterSet* filter = _filter;
     bool ret = false;
+    int r;
+    TRACE_SPAN("dev_filter_check", vid, pid);
+    TraceSpan enum_span("SetupAPI enumeration", vid, pid);
 
     devs = SetupDiGetClassDevs(NULL, L"USB", NULL, DIGCF_ALLCLASSES | DIGCF_PRESENT);
     if (devs == INVALID_HANDLE_VALUE) {
+        op->fail(USB_CLERK_ERROR_ENUMERATE, GetLastError());
         vd_printf("SetupDiGetClassDevsEx failed: %ld", GetLastError());
         return false;
     }
-    if (!get_dev_info(devs, vid, pid, &dev_info, has_winusb)) {
+    found = get_dev_info(devs, vid, pid, &dev_info, has_winusb);
+    enum_span.end();
+    if (!found) {
+        op->fail(USB_CLERK_ERROR_NOT_FOUND, 0);
         goto cleanup;
     }
-    if (!_filter_rules) {
+    if (!filter) {
         ret = true;
         goto cleanup;
     }
     if (!get_dev_props(devs, &dev_info, &dev_cls, &dev_subcls, &dev_proto) ||
         !get_dev_ifaces(devs, vid, pid, &iface_count, &iface_cls, &iface_subcls, &iface_proto)) {
+        op->fail(USB_CLERK_ERROR_ENUMERATE, GetLastError());
         goto cleanup;
     }
     /* device_version_bcd is ignored, as it is unavailable via setup api.
        we can get it when device is opened with libusb, which is currently not the case. */
-    if (usbredirfilter_check(_filter_rules, _filter_count, dev_cls, dev_subcls, dev_proto,
-            iface_cls, iface_subcls, iface_proto, iface_count, vid, pid, 0, 0) == 0) {
+    r = packedrule_check_hits(filter->rules, filter->count, dev_cls, dev_subcls, dev_proto,
+            iface_cls, iface_subcls, iface_proto, iface_count, vid, pid, 0, 0, filter->hits);
+    if (r == 0) {
         ret = true;
     } else {
-        vd_printf("Device filter failed %04x:%04x", vid, pid);
+        op->fail(USB_CLERK_ERROR_FILTER_DENIED, r);
+        vd_printf_limited("Device filter failed %04x:%04x", vid, pid);
     }
 cleanup:
     if (iface_count > 0) {
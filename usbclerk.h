@@ -1,11 +1,31 @@
 #ifndef _H_USBCLERK
 #define _H_USBCLERK
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <stdint.h>
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+#endif
 
 #define USB_CLERK_PIPE_NAME     TEXT("\\\\.\\pipe\\usbclerkpipe")
 #define USB_CLERK_MAGIC         0xDADA
-#define USB_CLERK_VERSION       0x0003
+#define USB_CLERK_VERSION       0x000B
+
+/* first protocol version whose clients understand reply status values other than
+   USB_CLERK_STATUS_FAILED and USB_CLERK_STATUS_SUCCESS */
+#define USB_CLERK_VERSION_STATUS 0x0004
+
+/* first protocol version whose clients understand USB_CLERK_STATUS_THROTTLED, older
+   ones get USB_CLERK_STATUS_BUSY instead */
+#define USB_CLERK_VERSION_THROTTLED 0x0009
+
+/* first protocol version whose clients are replied with USBClerkReplyEx */
+#define USB_CLERK_VERSION_REPLY_EX 0x000A
+
+/* first protocol version whose clients send USB_CLERK_KEEPALIVE */
+#define USB_CLERK_VERSION_KEEPALIVE 0x0008
 
 typedef struct USBClerkHeader {
     UINT16 magic;
@@ -19,6 +39,10 @@ enum {
     USB_CLERK_DRIVER_REMOVE,
     USB_CLERK_REPLY,
     USB_CLERK_DRIVER_SESSION_INSTALL,
+    USB_CLERK_DRIVER_CANCEL,
+    USB_CLERK_RING_SETUP,
+    USB_CLERK_DRIVER_BATCH,
+    USB_CLERK_KEEPALIVE,
     USB_CLERK_END_MESSAGE,
 };
 
@@ -28,9 +52,130 @@ typedef struct USBClerkDriverOp {
     UINT16 pid;
 } USBClerkDriverOp;
 
+/* driver operation with an optional deadline, since version 0x0005.
+   id is chosen by the client and referenced by USB_CLERK_DRIVER_CANCEL */
+typedef struct USBClerkDriverOpEx {
+    USBClerkHeader hdr;
+    UINT16 vid;
+    UINT16 pid;
+    UINT32 id;
+    UINT32 timeout;         /* in ms, 0 for no deadline */
+} USBClerkDriverOpEx;
+
+/* cancels the pending operations of id, 0 is never one. Only operations submitted by
+   the same connection, or by a connection of the same user in the same Windows session,
+   are cancelled; others are left alone & the reply is USB_CLERK_STATUS_FAILED as for an
+   unknown id */
+typedef struct USBClerkDriverCancel {
+    USBClerkHeader hdr;
+    UINT32 id;
+} USBClerkDriverCancel;
+
+#define USB_CLERK_BATCH_MAX     8
+
+typedef struct USBClerkDevice {
+    UINT16 vid;
+    UINT16 pid;
+} USBClerkDevice;
+
+/* the same driver operation on several devices, since version 0x0007. The service
+   prepares them in parallel while installing one at a time. The reply status is
+   USB_CLERK_STATUS_SUCCESS if all succeeded, else the first failure; single
+   operations can then tell which devices are left, as they are idempotent */
+typedef struct USBClerkDriverBatch {
+    USBClerkHeader hdr;
+    UINT16 op_type;         /* USB_CLERK_DRIVER_INSTALL, _SESSION_INSTALL or _REMOVE */
+    UINT16 count;           /* 1 to USB_CLERK_BATCH_MAX */
+    UINT32 timeout;         /* in ms, 0 for no deadline */
+    USBClerkDevice devs[USB_CLERK_BATCH_MAX];
+} USBClerkDriverBatch;
+
+/* batch with an id, since version 0x000B. id is chosen by the client, as for
+   USBClerkDriverOpEx, and USB_CLERK_DRIVER_CANCEL of it cancels the devices of the
+   batch not done yet */
+typedef struct USBClerkDriverBatchEx {
+    USBClerkHeader hdr;
+    UINT16 op_type;
+    UINT16 count;
+    UINT32 timeout;
+    USBClerkDevice devs[USB_CLERK_BATCH_MAX];
+    UINT32 id;
+} USBClerkDriverBatchEx;
+
+/* asks for a shared memory transport for this connection, since version 0x0006.
+   On success the service created a mapping named USB_CLERK_RING_NAME after key, with
+   a request & a reply ring of slots each (see shmring.h), which the client opens.
+   Only the user of the client can open the mapping & its events. Requests & replies
+   then go through the rings; the pipe stays open, as the connection ends when it
+   closes, and can still be used for any message. */
+typedef struct USBClerkRingSetup {
+    USBClerkHeader hdr;
+    UINT32 key;
+    UINT32 slots;           /* power of 2, up to SHM_RING_MAX_SLOTS */
+} USBClerkRingSetup;
+
+#define USB_CLERK_RING_NAME     TEXT("Global\\usbclerk-ring-%08x")
+
+/* USB_CLERK_KEEPALIVE is a bare header, since version 0x0008. The service closes
+   connections without requests for longer than its idle timeout, 5 minutes unless
+   configured, removing their session installs. Clients holding session installs
+   while idle send keepalives, which are replied with USB_CLERK_STATUS_SUCCESS.
+   Connections whose last request is of an older version are never closed as idle,
+   as such clients do not send keepalives. */
+
+enum {
+    USB_CLERK_STATUS_FAILED = 0,
+    USB_CLERK_STATUS_SUCCESS,
+    USB_CLERK_STATUS_BUSY,      /* service queue is full, retry later */
+    USB_CLERK_STATUS_TIMEOUT,   /* deadline passed before the operation completed */
+    USB_CLERK_STATUS_CANCELLED, /* cancelled by USB_CLERK_DRIVER_CANCEL */
+    USB_CLERK_STATUS_THROTTLED, /* client or its session exceeded its driver operation
+                                   rate, retry later */
+};
+
 typedef struct USBClerkReply {
     USBClerkHeader hdr;
     UINT32 status;
 } USBClerkReply;
 
+/* why a driver operation failed, with the native error of the failed call */
+enum {
+    USB_CLERK_ERROR_NONE = 0,
+    USB_CLERK_ERROR_NOT_READY,          /* service initialization did not complete */
+    USB_CLERK_ERROR_ENUMERATE,          /* listing devices failed, SetupAPI or wdi error */
+    USB_CLERK_ERROR_NOT_FOUND,          /* no such device */
+    USB_CLERK_ERROR_FILTER_DENIED,      /* the filter rules deny the device */
+    USB_CLERK_ERROR_PREPARE,            /* creating the driver files failed, wdi error */
+    USB_CLERK_ERROR_INSTALL,            /* wdi error */
+    USB_CLERK_ERROR_PENDING_INSTALL,    /* other installations were still pending when
+                                           the retries ran out */
+    USB_CLERK_ERROR_NOT_INSTALLED,      /* removal of a device without the WinUSB driver */
+    USB_CLERK_ERROR_UNINSTALL,          /* SetupAPI error */
+    USB_CLERK_ERROR_RESCAN,             /* re-enumerating the device after removal failed */
+};
+
+/* where a driver operation spent its time */
+enum {
+    USB_CLERK_STAGE_QUEUE,      /* waiting for initialization, a worker & the install stage */
+    USB_CLERK_STAGE_FILTER,     /* finding the device & checking the filter rules */
+    USB_CLERK_STAGE_ENUMERATE,  /* listing the devices to install or remove the driver of */
+    USB_CLERK_STAGE_PREPARE,    /* creating & signing the driver files */
+    USB_CLERK_STAGE_INSTALL,    /* installing including retries, or uninstalling */
+    USB_CLERK_STAGE_RESCAN,
+    USB_CLERK_STAGES,
+};
+
+/* reply to clients of version USB_CLERK_VERSION_REPLY_EX & later, starting as
+   USBClerkReply. error & native_error are set for failed driver operations; for a
+   batch they are those of the failure in status, while stages & attempts add up all
+   its devices. native_error is a Win32 error, or a negative wdi error code */
+typedef struct USBClerkReplyEx {
+    USBClerkHeader hdr;
+    UINT32 status;
+    UINT16 error;           /* USB_CLERK_ERROR_* */
+    UINT16 install_attempts;
+    UINT32 native_error;
+    UINT32 stage_ms[USB_CLERK_STAGES];
+} USBClerkReplyEx;
+
 #endif
@@ -0,0 +1,1135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <list>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/timeb.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "usbredirfilter.h"
+#include "packedrule.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "retry.h"
+#include "roundrobin.h"
+#include "shmring.h"
+#include "usbclerkclient.h"
+
+#define BENCH_RUNS           10
+#define BENCH_WARMUP         2
+#define BENCH_RUN_TIME       20    /* ms */
+#define BENCH_SEED           1
+#define BENCH_MAX_IFACES     16
+#define BENCH_RING_SLOTS     16
+#define BENCH_RING_BURST     4
+#define BENCH_RING_POLL      100
+/* the install retry settings of the service */
+#define BENCH_RETRY_BUDGET   20000 /* ms */
+#define BENCH_RETRY_INITIAL  20
+#define BENCH_RETRY_MAX      2000
+#define BENCH_RETRY_SLICE    250
+#define BENCH_RETRY_BUSY     5000  /* ms another install is pending, at most */
+#define BENCH_RETRY_LINGER   200   /* ms the pending state outlives it, at most */
+
+/* Each case is timed over runs of a fixed number of iterations, calibrated during
+   warmup so a run takes about BENCH_RUN_TIME. Inputs are generated from the seed,
+   so runs with the same options are comparable across commits. */
+
+typedef struct BenchCase {
+    char name[64];
+    void (*fn)(struct BenchCase* c, long iterations);
+    int rules;
+    int ifaces;
+    int variant;
+    int transport;
+} BenchCase;
+
+typedef struct BenchResult {
+    long iterations;
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+    double stddev_ns;
+    double max_ns;
+} BenchResult;
+
+/* the other end of the transport cases echoes replies from its own thread */
+enum {
+    TRANSPORT_NONE,
+    TRANSPORT_RING,
+    TRANSPORT_PIPE,
+};
+
+enum {
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_JSON,
+};
+
+static volatile long sink;
+static uint32_t seed = BENCH_SEED;
+
+/* inputs of the current case, set up by prepare() */
+static struct usbredirfilter_rule* rules;
+static PackedRule* packed;
+static char* rules_str;
+static uint8_t iface_cls[BENCH_MAX_IFACES];
+static uint8_t iface_subcls[BENCH_MAX_IFACES];
+static uint8_t iface_proto[BENCH_MAX_IFACES];
+static USBClerkDriverOpEx message;
+static FILE* log_file;
+static USBClerkReplyEx echo_reply = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+                                      USB_CLERK_REPLY, sizeof(USBClerkReplyEx)}};
+static volatile bool echo_stop;
+static int echo_transport;
+static void* ring_mem;
+/* each ring is attached twice, as by the client and the service processes */
+static ShmRing requests, echo_requests, replies, echo_replies;
+#ifdef _WIN32
+static HANDLE echo_thread;
+static HANDLE ring_events[2];
+#else
+static pthread_t echo_thread;
+static int to_echo[2], from_echo[2];
+#endif
+
+/* what the retry cases simulated, reset by prepare() */
+static struct {
+    long episodes;
+    long attempts;
+    long gave_up;
+    uint64_t late;          /* ms from when installing was possible to the retry */
+} retry_stats;
+
+/* Simulated clock, with another installation pending until busy_until, and the
+   system still refusing installs until ready, as the pending state lingers */
+class SimWaiter : public InstallWaiter {
+public:
+    SimWaiter(bool idle_supported)
+        : clock (0), busy_until (0), ready (0), _idle_supported (idle_supported) {}
+    virtual uint32_t now() { return clock; }
+    virtual int wait_idle(uint32_t timeout);
+    virtual bool sleep(uint32_t ms) { clock += ms; return true; }
+
+public:
+    uint32_t clock;
+    uint32_t busy_until;
+    uint32_t ready;
+
+private:
+    bool _idle_supported;
+};
+
+int SimWaiter::wait_idle(uint32_t timeout)
+{
+    if (!_idle_supported) {
+        return INSTALL_WAIT_UNSUPPORTED;
+    }
+    if (clock >= busy_until) {
+        return INSTALL_WAIT_IDLE;
+    }
+    if (busy_until - clock <= timeout) {
+        clock = busy_until;
+        return INSTALL_WAIT_IDLE;
+    }
+    clock += timeout;
+    return INSTALL_WAIT_TIMEOUT;
+}
+
+static double now_ns()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1e9 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+static uint32_t bench_rand()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* device rules of random vendors, all denied, so checks scan the whole list */
+static void prepare(BenchCase* c)
+{
+    memset(&retry_stats, 0, sizeof(retry_stats));
+    rules = (struct usbredirfilter_rule*)malloc(sizeof(*rules) * c->rules);
+    for (int i = 0; i < c->rules; i++) {
+        rules[i].device_class = i % 4 ? -1 : 0x03;
+        rules[i].vendor_id = bench_rand() & 0xfffe;
+        rules[i].product_id = i % 2 ? -1 : bench_rand() & 0xffff;
+        rules[i].device_version_bcd = -1;
+        rules[i].allow = 0;
+    }
+    packedrule_from_rules(rules, c->rules, &packed);
+    rules_str = usbredirfilter_rules_to_string(rules, c->rules, ",", "|");
+    for (int i = 0; i < BENCH_MAX_IFACES; i++) {
+        iface_cls[i] = 0x08 + i % 4;
+        iface_subcls[i] = 0x06;
+        iface_proto[i] = 0x50;
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI echo_main(LPVOID param)
+#else
+static void* echo_main(void* param)
+#endif
+{
+    char buffer[SHM_RING_SLOT_DATA];
+    int bytes;
+
+    while (!echo_stop) {
+#ifndef _WIN32
+        if (echo_transport == TRANSPORT_PIPE) {
+            bytes = read(to_echo[0], buffer, sizeof(buffer));
+            if (bytes <= 0) {
+                break;
+            }
+            sink += usb_clerk_check_message(buffer, bytes);
+            if (write(from_echo[1], &echo_reply, sizeof(echo_reply)) < 0) {
+                break;
+            }
+            continue;
+        }
+#endif
+        bytes = echo_requests.pop(buffer, sizeof(buffer), BENCH_RING_POLL);
+        if (bytes > 0) {
+            sink += usb_clerk_check_message(buffer, bytes);
+            while (!echo_replies.push(&echo_reply, sizeof(echo_reply)) && !echo_stop);
+        }
+    }
+    return 0;
+}
+
+/* a message round trip to the echo thread, through the rings or a pipe. Round trips
+   one at a time signal the idle echo thread every time, bursts only once */
+static void bench_transport(BenchCase* c, long iterations)
+{
+    USBClerkDriverOp msg = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+                             USB_CLERK_DRIVER_INSTALL, sizeof(USBClerkDriverOp)}, 0x1234};
+    USBClerkReplyEx reply;
+    int burst = c->variant ? BENCH_RING_BURST : 1;
+
+    for (long i = 0; i < iterations; i += burst) {
+        msg.pid = i & 0xffff;
+#ifndef _WIN32
+        if (c->transport == TRANSPORT_PIPE) {
+            if (write(to_echo[1], &msg, sizeof(msg)) < 0 ||
+                read(from_echo[0], &reply, sizeof(reply)) <= 0) {
+                return;
+            }
+            sink += reply.status;
+            continue;
+        }
+#endif
+        for (int j = 0; j < burst; j++) {
+            requests.push(&msg, sizeof(msg));
+        }
+        for (int j = 0; j < burst; j++) {
+            while (replies.pop(&reply, sizeof(reply), BENCH_RING_POLL) == 0);
+            sink += reply.status;
+        }
+    }
+}
+
+/* the service end of the client cases, in process, so they time the client itself */
+class LoopbackTransport : public USBClerkTransport {
+public:
+    bool connect() { return true; }
+    void close() {}
+    bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply, UINT32 timeout)
+    {
+        if (usb_clerk_check_message(request, size) != USB_CLERK_MSG_VALID) {
+            return false;
+        }
+        *reply = echo_reply;
+        reply->status = USB_CLERK_STATUS_SUCCESS;
+        return true;
+    }
+};
+
+static void count_completion(void* opaque, UINT16 vid, UINT16 pid,
+                             const USBClerkReplyEx* reply)
+{
+    sink += reply->status;
+}
+
+/* driver operations through USBClerkClient: one at a time, in batches of
+   USB_CLERK_BATCH_MAX, or queued to its worker & completed asynchronously */
+static void bench_client(BenchCase* c, long iterations)
+{
+    LoopbackTransport loopback;
+    USBClerkClient client(&loopback);
+    USBClerkDevice devs[USB_CLERK_BATCH_MAX];
+
+    client.connect();
+    for (long i = 0; i < iterations; i++) {
+        switch (c->variant) {
+        case 0:
+            sink += client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, i & 0xffff);
+            break;
+        case 1:
+            for (int j = 0; j < USB_CLERK_BATCH_MAX; j++) {
+                devs[j].vid = 0x1234;
+                devs[j].pid = (i + j) & 0xffff;
+            }
+            sink += client.run_batch(USB_CLERK_DRIVER_INSTALL, devs, USB_CLERK_BATCH_MAX);
+            break;
+        default:
+            client.submit(USB_CLERK_DRIVER_INSTALL, 0x1234, i & 0xffff, 0, count_completion,
+                          NULL);
+        }
+    }
+    client.flush();
+}
+
+static bool start_echo(int transport)
+{
+    uint32_t ring_size = ShmRing::size(BENCH_RING_SLOTS);
+
+    echo_transport = transport;
+    echo_stop = false;
+#ifdef _WIN32
+    ring_mem = malloc(2 * ring_size);
+    ring_events[0] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ring_events[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+    requests.attach(ring_mem, BENCH_RING_SLOTS, true, ring_events[0]);
+    echo_requests.attach(ring_mem, BENCH_RING_SLOTS, false, ring_events[0]);
+    replies.attach((char*)ring_mem + ring_size, BENCH_RING_SLOTS, true, ring_events[1]);
+    echo_replies.attach((char*)ring_mem + ring_size, BENCH_RING_SLOTS, false, ring_events[1]);
+    echo_thread = CreateThread(NULL, 0, echo_main, NULL, 0, NULL);
+    return echo_thread != NULL;
+#else
+    if (transport == TRANSPORT_PIPE) {
+        if (pipe(to_echo) || pipe(from_echo)) {
+            return false;
+        }
+    } else {
+        /* shared mappings, as between processes */
+        ring_mem = mmap(NULL, 2 * ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (ring_mem == MAP_FAILED) {
+            ring_mem = NULL;
+            return false;
+        }
+        requests.attach(ring_mem, BENCH_RING_SLOTS, true, 0);
+        echo_requests.attach(ring_mem, BENCH_RING_SLOTS, false, 0);
+        replies.attach((char*)ring_mem + ring_size, BENCH_RING_SLOTS, true, 0);
+        echo_replies.attach((char*)ring_mem + ring_size, BENCH_RING_SLOTS, false, 0);
+    }
+    return pthread_create(&echo_thread, NULL, echo_main, NULL) == 0;
+#endif
+}
+
+static void stop_echo()
+{
+    echo_stop = true;
+#ifdef _WIN32
+    echo_requests.wake();
+    WaitForSingleObject(echo_thread, INFINITE);
+    CloseHandle(echo_thread);
+    CloseHandle(ring_events[0]);
+    CloseHandle(ring_events[1]);
+    free(ring_mem);
+#else
+    if (echo_transport == TRANSPORT_PIPE) {
+        close(to_echo[1]);
+        pthread_join(echo_thread, NULL);
+        close(to_echo[0]);
+        close(from_echo[0]);
+        close(from_echo[1]);
+    } else {
+        echo_requests.wake();
+        pthread_join(echo_thread, NULL);
+        munmap(ring_mem, 2 * ShmRing::size(BENCH_RING_SLOTS));
+    }
+#endif
+    ring_mem = NULL;
+}
+
+static void release()
+{
+    free(rules);
+    free(packed);
+    free(rules_str);
+    rules = NULL;
+    packed = NULL;
+    rules_str = NULL;
+}
+
+static void bench_string_to_rules(BenchCase* c, long iterations)
+{
+    struct usbredirfilter_rule* parsed;
+    int count;
+
+    for (long i = 0; i < iterations; i++) {
+        if (usbredirfilter_string_to_rules(rules_str, ",", "|", &parsed, &count) == 0) {
+            sink += count;
+            free(parsed);
+        }
+    }
+}
+
+static void bench_rules_to_string(BenchCase* c, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        char* str = usbredirfilter_rules_to_string(rules, c->rules, ",", "|");
+        sink += str[0];
+        free(str);
+    }
+}
+
+/* the rules have even vendors, so vendor 0xffff goes through all of them */
+static void bench_check(BenchCase* c, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        sink += usbredirfilter_check(rules, c->rules, 0x00, 0, 0, iface_cls, iface_subcls,
+                                     iface_proto, c->ifaces, 0xffff, i & 0xffff, 0x0100,
+                                     usbredirfilter_fl_default_allow);
+    }
+}
+
+static void bench_packed_check(BenchCase* c, long iterations)
+{
+    for (long i = 0; i < iterations; i++) {
+        sink += packedrule_check(packed, c->rules, 0x00, 0, 0, iface_cls, iface_subcls,
+                                 iface_proto, c->ifaces, 0xffff, i & 0xffff, 0x0100,
+                                 usbredirfilter_fl_default_allow);
+    }
+}
+
+/* the pipe message validation of dispatch_message */
+static void bench_message(BenchCase* c, long iterations)
+{
+    USBClerkDriverOpEx msg = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+                               USB_CLERK_DRIVER_INSTALL, sizeof(USBClerkDriverOpEx)}};
+    UINT32 bytes = sizeof(msg);
+
+    switch (c->variant) {
+    case USB_CLERK_MSG_BAD_MAGIC:
+        msg.hdr.magic = 0;
+        break;
+    case USB_CLERK_MSG_UNKNOWN_TYPE:
+        msg.hdr.type = USB_CLERK_END_MESSAGE;
+        break;
+    case USB_CLERK_MSG_TRUNCATED:
+        bytes = sizeof(USBClerkHeader);
+        break;
+    }
+    message = msg;
+    for (long i = 0; i < iterations; i++) {
+        sink += usb_clerk_check_message(&message, bytes);
+    }
+}
+
+/* an install retried by RetryScheduler until another one pending a random time is
+   over, as install_winusb_driver() does; variant 1 has no pending install events, so
+   only the backoff tells when to retry */
+static void bench_retry(BenchCase* c, long iterations)
+{
+    SimWaiter waiter(c->variant == 0);
+
+    for (long i = 0; i < iterations; i++) {
+        RetryScheduler retry(&waiter, BENCH_RETRY_BUDGET, BENCH_RETRY_INITIAL,
+                             BENCH_RETRY_MAX, BENCH_RETRY_SLICE, bench_rand());
+
+        waiter.clock = 0;
+        waiter.busy_until = bench_rand() % BENCH_RETRY_BUSY;
+        waiter.ready = waiter.busy_until + bench_rand() % BENCH_RETRY_LINGER;
+        retry_stats.episodes++;
+        for (;;) {
+            retry_stats.attempts++;
+            if (waiter.clock >= waiter.ready) {
+                retry_stats.late += waiter.clock - waiter.ready;
+                break;
+            }
+            if (!retry.wait()) {
+                retry_stats.gave_up++;
+                break;
+            }
+        }
+        sink += waiter.clock;
+    }
+}
+
+/* the steps of the LOG macro in vdlog.h: time, strftime & the line format, then the
+   locked VDLog::printf write & fflush when variant is set */
+static void bench_log(BenchCase* c, long iterations)
+{
+    const char *type_as_char[] = { "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };
+    char line[256];
+
+    for (long i = 0; i < iterations; i++) {
+        struct tm *today;
+        char datetime_str[20];
+        time_t now;
+        int ms, len;
+
+#ifdef _WIN32
+        struct _timeb now_tb;
+        _ftime(&now_tb);
+        now = now_tb.time;
+        ms = now_tb.millitm;
+#else
+        struct timespec now_ts;
+        clock_gettime(CLOCK_REALTIME, &now_ts);
+        now = now_ts.tv_sec;
+        ms = now_ts.tv_nsec / 1000000;
+#endif
+        today = localtime(&now);
+        strftime(datetime_str, 20, "%Y-%m-%d %H:%M:%S", today);
+        len = snprintf(line, sizeof(line), "%ld::%s::%s,%.3d::%s::" "Installing winusb driver "
+                       "for %04x:%04x" "\n", 1234L, type_as_char[1], datetime_str,
+                       ms, __FUNCTION__, 0x1234, (int)(i & 0xffff));
+        if (c->variant) {
+            fwrite(line, 1, len, log_file);
+            fflush(log_file);
+        }
+        sink += len;
+    }
+}
+
+static double run_once(BenchCase* c, long iterations)
+{
+    double start = now_ns();
+
+    c->fn(c, iterations);
+    return (now_ns() - start) / iterations;
+}
+
+static void run_case(BenchCase* c, int runs, int warmup, double run_time_ns,
+                     BenchResult* result)
+{
+    std::vector<double> samples;
+    long iterations = 1;
+    double sum = 0, sq = 0;
+
+    prepare(c);
+    if (c->transport && !start_echo(c->transport)) {
+        fprintf(stderr, "Failed starting the echo thread of %s\n", c->name);
+        exit(1);
+    }
+    /* calibrate, then warm up caches & branch predictors with the final count */
+    while (run_once(c, iterations) * iterations < run_time_ns && iterations < (1L << 30)) {
+        iterations *= 2;
+    }
+    for (int i = 0; i < warmup; i++) {
+        run_once(c, iterations);
+    }
+    for (int i = 0; i < runs; i++) {
+        samples.push_back(run_once(c, iterations));
+        sum += samples.back();
+    }
+    if (c->transport) {
+        stop_echo();
+    }
+    release();
+
+    std::sort(samples.begin(), samples.end());
+    result->iterations = iterations;
+    result->min_ns = samples.front();
+    result->max_ns = samples.back();
+    result->median_ns = runs % 2 ? samples[runs / 2] :
+                        (samples[runs / 2 - 1] + samples[runs / 2]) / 2;
+    result->mean_ns = sum / runs;
+    for (int i = 0; i < runs; i++) {
+        sq += (samples[i] - result->mean_ns) * (samples[i] - result->mean_ns);
+    }
+    result->stddev_ns = runs > 1 ? sqrt(sq / (runs - 1)) : 0;
+}
+
+static void add_case(std::vector<BenchCase>* cases, const char* name,
+                     void (*fn)(BenchCase*, long), int rules, int ifaces, int variant)
+{
+    BenchCase c;
+
+    snprintf(c.name, sizeof(c.name), "%s", name);
+    c.fn = fn;
+    c.rules = rules;
+    c.ifaces = ifaces;
+    c.variant = variant;
+    c.transport = TRANSPORT_NONE;
+    cases->push_back(c);
+}
+
+static void build_cases(std::vector<BenchCase>* cases)
+{
+    static const int rule_counts[] = {1, 16, 256, 4096};
+    static const int iface_counts[] = {1, 4, BENCH_MAX_IFACES};
+    char name[64];
+
+    for (unsigned r = 0; r < sizeof(rule_counts) / sizeof(rule_counts[0]); r++) {
+        snprintf(name, sizeof(name), "string_to_rules/r%d", rule_counts[r]);
+        add_case(cases, name, bench_string_to_rules, rule_counts[r], 0, 0);
+        snprintf(name, sizeof(name), "rules_to_string/r%d", rule_counts[r]);
+        add_case(cases, name, bench_rules_to_string, rule_counts[r], 0, 0);
+    }
+    for (unsigned r = 0; r < sizeof(rule_counts) / sizeof(rule_counts[0]); r++) {
+        for (unsigned i = 0; i < sizeof(iface_counts) / sizeof(iface_counts[0]); i++) {
+            snprintf(name, sizeof(name), "check/r%d/i%d", rule_counts[r], iface_counts[i]);
+            add_case(cases, name, bench_check, rule_counts[r], iface_counts[i], 0);
+            snprintf(name, sizeof(name), "packed_check/r%d/i%d", rule_counts[r],
+                     iface_counts[i]);
+            add_case(cases, name, bench_packed_check, rule_counts[r], iface_counts[i], 0);
+        }
+    }
+    add_case(cases, "message/valid", bench_message, 0, 0, USB_CLERK_MSG_VALID);
+    add_case(cases, "message/bad_magic", bench_message, 0, 0, USB_CLERK_MSG_BAD_MAGIC);
+    add_case(cases, "message/unknown_type", bench_message, 0, 0, USB_CLERK_MSG_UNKNOWN_TYPE);
+    add_case(cases, "message/truncated", bench_message, 0, 0, USB_CLERK_MSG_TRUNCATED);
+    add_case(cases, "ring/roundtrip", bench_transport, 0, 0, 0);
+    cases->back().transport = TRANSPORT_RING;
+    add_case(cases, "ring/burst", bench_transport, 0, 0, 1);
+    cases->back().transport = TRANSPORT_RING;
+#ifndef _WIN32
+    add_case(cases, "pipe/roundtrip", bench_transport, 0, 0, 0);
+    cases->back().transport = TRANSPORT_PIPE;
+#endif
+    add_case(cases, "client/run", bench_client, 0, 0, 0);
+    add_case(cases, "client/batch", bench_client, 0, 0, 1);
+    add_case(cases, "client/submit", bench_client, 0, 0, 2);
+    add_case(cases, "retry/pending_events", bench_retry, 0, 0, 0);
+    add_case(cases, "retry/backoff_only", bench_retry, 0, 0, 1);
+    add_case(cases, "log/format", bench_log, 0, 0, 0);
+    add_case(cases, "log/write", bench_log, 0, 0, 1);
+}
+
+/* Self checks, run with -c instead of the cases. Each failed check is printed */
+static int check_failures;
+
+static void check(bool ok, const char* what, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "line %d: check failed: %s\n", line, what);
+        check_failures++;
+    }
+}
+
+#define CHECK(cond) check(!!(cond), #cond, __LINE__)
+
+static void check_token_bucket()
+{
+    TokenBucket bucket;
+    uint32_t t;
+
+    /* 60 per minute is one per second, starting full */
+    bucket.init(60, 3, 1000);
+    CHECK(bucket.available(1000) == 3);
+    CHECK(bucket.take(1000, 3));
+    CHECK(!bucket.take(1000));
+    CHECK(bucket.available(1999) == 0);
+    CHECK(bucket.available(2000) == 1);
+    /* all or nothing */
+    CHECK(!bucket.take(2000, 2));
+    CHECK(bucket.take(2000));
+    /* never above the burst */
+    CHECK(bucket.available(1000000) == 3);
+
+    /* the tick count wraps around */
+    bucket.init(60, 1, 0xfffffe00);
+    CHECK(bucket.take(0xfffffe00));
+    CHECK(bucket.available(0xfffffe00 + 1000) == 1);
+
+    /* a slow rate polled often does not lose the time between whole thousandths */
+    bucket.init(1, 1, 0);
+    CHECK(bucket.take(0));
+    for (t = 0; t < 60000; t += 7) {
+        CHECK(bucket.available(t) == 0);
+    }
+    CHECK(bucket.available(60000) == 1);
+
+    /* a rate of 0 does not limit */
+    bucket.init(0, 1, 0);
+    for (int i = 0; i < 100; i++) {
+        CHECK(bucket.take(0));
+    }
+}
+
+typedef struct CheckItem {
+    uint32_t owner;
+    int seq;
+} CheckItem;
+
+struct CheckItemOwner {
+    uint32_t operator()(const CheckItem& item) const { return item.owner; }
+};
+
+/* owners take turns in owner order, each getting its items in queue order */
+static void check_owner_order()
+{
+    static const uint32_t queued[] = {3, 1, 1, 3, 2, 1, 7};
+    static const uint32_t served[] = {1, 2, 3, 7, 1, 3, 1};
+    std::list<CheckItem> items;
+    std::list<CheckItem>::iterator next;
+    int last_seq[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    uint32_t last = 0;
+
+    CHECK(next_owner(items.begin(), items.end(), last, CheckItemOwner()) == items.end());
+    for (int i = 0; i < (int)(sizeof(queued) / sizeof(queued[0])); i++) {
+        CheckItem item = {queued[i], i};
+        items.push_back(item);
+    }
+    for (unsigned i = 0; i < sizeof(served) / sizeof(served[0]); i++) {
+        next = next_owner(items.begin(), items.end(), last, CheckItemOwner());
+        CHECK(next != items.end() && next->owner == served[i]);
+        if (next == items.end()) {
+            return;
+        }
+        CHECK(next->seq > last_seq[next->owner]);
+        last_seq[next->owner] = next->seq;
+        last = next->owner;
+        items.erase(next);
+    }
+    CHECK(items.empty());
+
+    /* a new owner below the last served one waits for the wrap around */
+    for (int i = 0; i < 2; i++) {
+        CheckItem item = {(uint32_t)(i ? 2 : 5), i};
+        items.push_back(item);
+    }
+    next = next_owner(items.begin(), items.end(), 4, CheckItemOwner());
+    CHECK(next->owner == 5);
+    next = next_owner(items.begin(), items.end(), 5, CheckItemOwner());
+    CHECK(next->owner == 2);
+}
+
+#define CHECK_REORDER_SETS   2000
+#define CHECK_REORDER_RULES  20
+
+/* reordered rules give each device the verdict of the original order, and are never
+   expected to scan more. The rules are drawn from a few values, so they overlap */
+static void check_reorder()
+{
+    usbredirfilter_rule rules[CHECK_REORDER_RULES];
+    PackedRule reordered[CHECK_REORDER_RULES];
+    uint32_t hits[CHECK_REORDER_RULES + 1];
+    int order[CHECK_REORDER_RULES];
+    PackedRule* packed;
+    uint8_t iface_class, iface_subclass = 0, iface_protocol = 0;
+    int count, failures = check_failures;
+
+    for (int set = 0; set < CHECK_REORDER_SETS && failures == check_failures; set++) {
+        count = 1 + bench_rand() % CHECK_REORDER_RULES;
+        for (int i = 0; i < count; i++) {
+            rules[i].device_class = bench_rand() % 3 ? -1 : 1 + bench_rand() % 3;
+            rules[i].vendor_id = bench_rand() % 2 ? -1 : bench_rand() % 3;
+            rules[i].product_id = bench_rand() % 2 ? -1 : bench_rand() % 3;
+            rules[i].device_version_bcd = -1;
+            rules[i].allow = bench_rand() % 2;
+        }
+        for (int i = 0; i <= count; i++) {
+            hits[i] = bench_rand() % 100;
+        }
+        CHECK(packedrule_from_rules(rules, count, &packed) == 0);
+        CHECK(packedrule_reorder(packed, count, hits, order) == 0);
+        for (int i = 0; i < count; i++) {
+            reordered[i] = packed[order[i]];
+        }
+        CHECK(packedrule_scan_cost(count, hits, order) <=
+              packedrule_scan_cost(count, hits, NULL));
+        /* the values of the rules & one none has, by device & by interface class */
+        for (int device = 0; device < 4 * 4 * 4 * 2; device++) {
+            uint8_t cls = 1 + device % 4;
+            uint16_t vid = device / 4 % 4, pid = device / 16 % 4;
+            int flags = device / 64 ? usbredirfilter_fl_default_allow : 0;
+
+            iface_class = cls;
+            CHECK(packedrule_check(packed, count, cls, 0, 0, &iface_class, &iface_subclass,
+                                   &iface_protocol, 1, vid, pid, 0, flags) ==
+                  packedrule_check(reordered, count, cls, 0, 0, &iface_class,
+                                   &iface_subclass, &iface_protocol, 1, vid, pid, 0, flags));
+            CHECK(packedrule_check(packed, count, 0, 0, 0, &iface_class, &iface_subclass,
+                                   &iface_protocol, 1, vid, pid, 0, flags) ==
+                  packedrule_check(reordered, count, 0, 0, 0, &iface_class,
+                                   &iface_subclass, &iface_protocol, 1, vid, pid, 0, flags));
+        }
+        free(packed);
+    }
+}
+
+/* the service end of the client checks: logs the operations it gets & replies with
+   status, or failed_status for the device failed_pid. The next breaks transactions
+   fail, as on a broken connection */
+typedef struct ScriptMessage {
+    UINT16 type;                /* of the operation, for batches too */
+    UINT16 count;               /* devices, 0 for keepalives */
+    USBClerkDevice dev;         /* the first one */
+} ScriptMessage;
+
+class ScriptTransport : public USBClerkTransport {
+public:
+    ScriptTransport()
+        : breaks (0)
+        , status (USB_CLERK_STATUS_SUCCESS)
+        , failed_pid (0)
+        , failed_status (USB_CLERK_STATUS_FAILED)
+    {
+    }
+    bool connect() { return true; }
+    void close() {}
+    bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply, UINT32 timeout);
+
+public:
+    std::vector<ScriptMessage> log;
+    int breaks;
+    UINT32 status;
+    UINT16 failed_pid;
+    UINT32 failed_status;
+};
+
+bool ScriptTransport::transact(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                               UINT32 timeout)
+{
+    const USBClerkHeader* hdr = (const USBClerkHeader*)request;
+    ScriptMessage message = {hdr->type, 0, {0, 0}};
+
+    if (usb_clerk_check_message(request, size) != USB_CLERK_MSG_VALID) {
+        return false;
+    }
+    if (breaks) {
+        breaks--;
+        return false;
+    }
+    *reply = echo_reply;
+    reply->status = status;
+    if (hdr->type == USB_CLERK_DRIVER_BATCH) {
+        const USBClerkDriverBatch* batch = (const USBClerkDriverBatch*)request;
+
+        message.type = batch->op_type;
+        message.count = batch->count;
+        message.dev = batch->devs[0];
+        for (int i = 0; i < batch->count; i++) {
+            if (failed_pid && batch->devs[i].pid == failed_pid) {
+                reply->status = failed_status;
+            }
+        }
+    } else if (hdr->type != USB_CLERK_KEEPALIVE) {
+        const USBClerkDriverOp* op = (const USBClerkDriverOp*)request;
+
+        message.count = 1;
+        message.dev.vid = op->vid;
+        message.dev.pid = op->pid;
+        if (failed_pid && op->pid == failed_pid) {
+            reply->status = failed_status;
+        }
+    }
+    log.push_back(message);
+    return true;
+}
+
+static bool logged(ScriptTransport* transport, unsigned i, UINT16 type, UINT16 pid,
+                   UINT16 count = 1)
+{
+    return i < transport->log.size() && transport->log[i].type == type &&
+           transport->log[i].dev.pid == pid && transport->log[i].count == count;
+}
+
+static unsigned logged_devs(ScriptTransport* transport)
+{
+    unsigned devs = 0;
+
+    for (unsigned i = 0; i < transport->log.size(); i++) {
+        devs += transport->log[i].count;
+    }
+    return devs;
+}
+
+/* a new connection first installs the session devices again, dropping those the
+   service failed to install */
+static void check_client_reconnect()
+{
+    ScriptTransport transport;
+    USBClerkClient client(&transport);
+
+    CHECK(client.run(USB_CLERK_DRIVER_SESSION_INSTALL, 0x1234, 1) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(client.run(USB_CLERK_DRIVER_SESSION_INSTALL, 0x1234, 2) == USB_CLERK_STATUS_SUCCESS);
+    transport.log.clear();
+    transport.breaks = 1;
+    CHECK(client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, 3) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(client.reconnects() == 1);
+    CHECK(transport.log.size() == 3);
+    CHECK(logged(&transport, 0, USB_CLERK_DRIVER_SESSION_INSTALL, 1));
+    CHECK(logged(&transport, 1, USB_CLERK_DRIVER_SESSION_INSTALL, 2));
+    CHECK(logged(&transport, 2, USB_CLERK_DRIVER_INSTALL, 3));
+
+    transport.log.clear();
+    transport.breaks = 1;
+    transport.failed_pid = 2;
+    CHECK(client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, 4) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(transport.log.size() == 3);
+    transport.log.clear();
+    transport.breaks = 1;
+    transport.failed_pid = 0;
+    CHECK(client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, 5) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(transport.log.size() == 2);
+    CHECK(logged(&transport, 0, USB_CLERK_DRIVER_SESSION_INSTALL, 1));
+    CHECK(logged(&transport, 1, USB_CLERK_DRIVER_INSTALL, 5));
+
+    /* the session devices are not the client's once removed */
+    CHECK(client.run(USB_CLERK_DRIVER_REMOVE, 0x1234, 1) == USB_CLERK_STATUS_SUCCESS);
+    transport.log.clear();
+    transport.breaks = 1;
+    CHECK(client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, 6) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(transport.log.size() == 1);
+    client.close();
+}
+
+/* batches of up to USB_CLERK_BATCH_MAX devices, once the service is known to take them */
+static void check_client_batches()
+{
+    ScriptTransport transport;
+    USBClerkClient client(&transport);
+    USBClerkDevice devs[2 * USB_CLERK_BATCH_MAX + 1];
+    const int count = sizeof(devs) / sizeof(devs[0]);
+
+    for (int i = 0; i < count; i++) {
+        devs[i].vid = 0x1234;
+        devs[i].pid = i + 1;
+    }
+    CHECK(client.run_batch(USB_CLERK_DRIVER_INSTALL, devs, count) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(transport.log.size() == 3);
+    CHECK(logged(&transport, 0, USB_CLERK_DRIVER_INSTALL, 1));
+    CHECK(logged(&transport, 1, USB_CLERK_DRIVER_INSTALL, 2, USB_CLERK_BATCH_MAX));
+    CHECK(logged(&transport, 2, USB_CLERK_DRIVER_INSTALL, USB_CLERK_BATCH_MAX + 2,
+                 USB_CLERK_BATCH_MAX));
+
+    transport.log.clear();
+    CHECK(client.run_batch(USB_CLERK_DRIVER_INSTALL, devs, count) == USB_CLERK_STATUS_SUCCESS);
+    CHECK(transport.log.size() == 3);
+    CHECK(logged(&transport, 0, USB_CLERK_DRIVER_INSTALL, 1, USB_CLERK_BATCH_MAX));
+    CHECK(logged(&transport, 1, USB_CLERK_DRIVER_INSTALL, USB_CLERK_BATCH_MAX + 1,
+                 USB_CLERK_BATCH_MAX));
+    CHECK(logged(&transport, 2, USB_CLERK_DRIVER_INSTALL, count));
+
+    /* the first failure is the reply */
+    transport.failed_pid = USB_CLERK_BATCH_MAX + 2;
+    transport.failed_status = USB_CLERK_STATUS_TIMEOUT;
+    CHECK(client.run_batch(USB_CLERK_DRIVER_INSTALL, devs, count) == USB_CLERK_STATUS_TIMEOUT);
+}
+
+typedef struct CheckCompletions {
+    std::vector<UINT16> pids;
+    std::vector<UINT32> statuses;
+} CheckCompletions;
+
+static void record_completion(void* opaque, UINT16 vid, UINT16 pid,
+                              const USBClerkReplyEx* reply)
+{
+    CheckCompletions* done = (CheckCompletions*)opaque;
+
+    done->pids.push_back(pid);
+    done->statuses.push_back(reply->status);
+}
+
+/* submits count operations, of alternating types every 5 devices, & waits for them */
+static void submit_flush(USBClerkClient* client, CheckCompletions* done, int count)
+{
+    done->pids.clear();
+    done->statuses.clear();
+    for (int i = 0; i < count; i++) {
+        CHECK(client->submit((i / 5) % 2 ? USB_CLERK_DRIVER_REMOVE : USB_CLERK_DRIVER_INSTALL,
+                             0x1234, i + 1, 0, record_completion, done));
+    }
+    client->flush();
+}
+
+/* submitted operations complete in order once flush() returns, and are sent again
+   one by one only when their batch failed */
+static void check_client_submit()
+{
+    ScriptTransport transport;
+    USBClerkClient client(&transport);
+    CheckCompletions done;
+    const int count = 3 * USB_CLERK_BATCH_MAX;
+
+    /* tells the service version, so submits are batched */
+    client.run(USB_CLERK_DRIVER_INSTALL, 0x1234, 0);
+    transport.log.clear();
+    submit_flush(&client, &done, count);
+    CHECK(done.pids.size() == count);
+    for (unsigned i = 0; i < done.pids.size(); i++) {
+        CHECK(done.pids[i] == i + 1 && done.statuses[i] == USB_CLERK_STATUS_SUCCESS);
+    }
+    CHECK(logged_devs(&transport) == count);
+
+    transport.log.clear();
+    transport.status = USB_CLERK_STATUS_THROTTLED;
+    submit_flush(&client, &done, count);
+    CHECK(done.pids.size() == count);
+    for (unsigned i = 0; i < done.statuses.size(); i++) {
+        CHECK(done.statuses[i] == USB_CLERK_STATUS_THROTTLED);
+    }
+    CHECK(logged_devs(&transport) == count);
+
+    transport.status = USB_CLERK_STATUS_SUCCESS;
+    transport.failed_pid = 3;
+    submit_flush(&client, &done, 5);
+    CHECK(done.pids.size() == 5);
+    for (unsigned i = 0; i < done.statuses.size(); i++) {
+        CHECK(done.statuses[i] == (done.pids[i] == 3 ? USB_CLERK_STATUS_FAILED :
+                                                       USB_CLERK_STATUS_SUCCESS));
+    }
+    client.close();
+}
+
+static int run_checks()
+{
+    check_token_bucket();
+    check_owner_order();
+    check_reorder();
+    check_client_reconnect();
+    check_client_batches();
+    check_client_submit();
+    if (check_failures) {
+        fprintf(stderr, "%d checks failed\n", check_failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
+
+static void usage()
+{
+    printf("Usage: usbclerk-bench [-l] [-f filter] [-r runs] [-w warmup] [-t ms] [-s seed]\n"
+           "                      [-o text|csv|json] | -c\n"
+           "Times the filter, rule parser, message validation, transport, client, install\n"
+           "retry & log paths, in ns per call. The retry cases also report on stderr how\n"
+           "late their simulated installs were retried.\n"
+           "-c - run the self checks instead, the exit status tells if any failed\n"
+           "-l - list the cases and exit\n"
+           "-f - run only the cases whose name contains filter\n"
+           "-r - timed runs per case, default %d\n"
+           "-w - untimed warmup runs per case, default %d\n"
+           "-t - target time of a run in ms, default %d\n"
+           "-s - seed of the generated rules, default %d\n"
+           "-o - output format, default text\n",
+           BENCH_RUNS, BENCH_WARMUP, BENCH_RUN_TIME, BENCH_SEED);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<BenchCase> cases;
+    BenchResult result;
+    const char* filter = NULL;
+    int runs = BENCH_RUNS, warmup = BENCH_WARMUP, run_time = BENCH_RUN_TIME;
+    int output = OUTPUT_TEXT;
+    bool list = false, first = true;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "-c")) {
+            return run_checks();
+        } else if (!strcmp(argv[i], "-l")) {
+            list = true;
+        } else if (!strcmp(argv[i], "-f") && arg) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && arg && atoi(arg) > 0) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && arg && atoi(arg) >= 0) {
+            warmup = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && arg && atoi(arg) > 0) {
+            run_time = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && arg) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-o") && arg && !strcmp(arg, "text")) {
+            output = OUTPUT_TEXT;
+            i++;
+        } else if (!strcmp(argv[i], "-o") && arg && !strcmp(arg, "csv")) {
+            output = OUTPUT_CSV;
+            i++;
+        } else if (!strcmp(argv[i], "-o") && arg && !strcmp(arg, "json")) {
+            output = OUTPUT_JSON;
+            i++;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    build_cases(&cases);
+    if (list) {
+        for (unsigned i = 0; i < cases.size(); i++) {
+            printf("%s\n", cases[i].name);
+        }
+        return 0;
+    }
+    log_file = tmpfile();
+    if (!log_file) {
+        fprintf(stderr, "Failed creating a temporary file\n");
+        return 1;
+    }
+
+    switch (output) {
+    case OUTPUT_CSV:
+        printf("name,iterations,min_ns,median_ns,mean_ns,stddev_ns,max_ns\n");
+        break;
+    case OUTPUT_JSON:
+        printf("{\"seed\":%u,\"runs\":%d,\"warmup\":%d,\"run_time_ms\":%d,\"results\":[",
+               seed, runs, warmup, run_time);
+        break;
+    default:
+        printf("%-24s %12s %12s %12s %12s\n", "case", "min ns", "median ns", "mean ns",
+               "stddev");
+    }
+    for (unsigned i = 0; i < cases.size(); i++) {
+        uint32_t case_seed = seed;
+
+        if (filter && !strstr(cases[i].name, filter)) {
+            continue;
+        }
+        run_case(&cases[i], runs, warmup, run_time * 1e6, &result);
+        /* every case gets the same inputs, whichever cases ran before it */
+        seed = case_seed;
+        switch (output) {
+        case OUTPUT_CSV:
+            printf("%s,%ld,%.2f,%.2f,%.2f,%.2f,%.2f\n", cases[i].name, result.iterations,
+                   result.min_ns, result.median_ns, result.mean_ns, result.stddev_ns,
+                   result.max_ns);
+            break;
+        case OUTPUT_JSON:
+            printf("%s\n{\"name\":\"%s\",\"iterations\":%ld,\"min_ns\":%.2f,\"median_ns\":%.2f,"
+                   "\"mean_ns\":%.2f,\"stddev_ns\":%.2f,\"max_ns\":%.2f}", first ? "" : ",",
+                   cases[i].name, result.iterations, result.min_ns, result.median_ns,
+                   result.mean_ns, result.stddev_ns, result.max_ns);
+            break;
+        default:
+            printf("%-24s %12.1f %12.1f %12.1f %12.1f\n", cases[i].name, result.min_ns,
+                   result.median_ns, result.mean_ns, result.stddev_ns);
+        }
+        fflush(stdout);
+        if (cases[i].fn == bench_retry && retry_stats.episodes > retry_stats.gave_up) {
+            fprintf(stderr, "%s: %.2f attempts, retried %.1fms late on average, "
+                    "%ld of %ld gave up\n", cases[i].name,
+                    (double)retry_stats.attempts / retry_stats.episodes,
+                    (double)retry_stats.late / (retry_stats.episodes - retry_stats.gave_up),
+                    retry_stats.gave_up, retry_stats.episodes);
+        }
+        first = false;
+    }
+    if (output == OUTPUT_JSON) {
+        printf("\n]}\n");
+    }
+    fclose(log_file);
+    return 0;
+}
@@ -0,0 +1,706 @@
+#include <string.h>
+#include "usbclerkclient.h"
+#ifdef _WIN32
+#include <tchar.h>
+#else
+#include <errno.h>
+#include <time.h>
+#endif
+
+#define CLIENT_RING_SLOTS       4
+#define CLIENT_RING_POLL        1000    /* ms between checks of the pipe */
+#define CLIENT_CONNECT_TRIES    3
+
+/* first service versions with these messages, see usbclerk.h */
+#define CLIENT_VERSION_OP_EX        0x0005
+#define CLIENT_VERSION_BATCH        0x0007
+#define CLIENT_VERSION_KEEPALIVE    0x0008
+
+static UINT32 tick()
+{
+#ifdef _WIN32
+    return GetTickCount();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void lock_init(USBClerkLock* lock)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(lock);
+#else
+    pthread_mutex_init(lock, NULL);
+#endif
+}
+
+static void lock_destroy(USBClerkLock* lock)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(lock);
+#else
+    pthread_mutex_destroy(lock);
+#endif
+}
+
+static void lock(USBClerkLock* lock)
+{
+#ifdef _WIN32
+    EnterCriticalSection(lock);
+#else
+    pthread_mutex_lock(lock);
+#endif
+}
+
+static void unlock(USBClerkLock* lock)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(lock);
+#else
+    pthread_mutex_unlock(lock);
+#endif
+}
+
+/* events are waited for with their lock held, as condition variables */
+static void event_init(USBClerkEvent* event, bool manual_reset)
+{
+#ifdef _WIN32
+    *event = CreateEvent(NULL, manual_reset, FALSE, NULL);
+#else
+    pthread_cond_init(event, NULL);
+#endif
+}
+
+static void event_destroy(USBClerkEvent* event)
+{
+#ifdef _WIN32
+    CloseHandle(*event);
+#else
+    pthread_cond_destroy(event);
+#endif
+}
+
+static void event_signal(USBClerkEvent* event)
+{
+#ifdef _WIN32
+    SetEvent(*event);
+#else
+    pthread_cond_broadcast(event);
+#endif
+}
+
+static void event_reset(USBClerkEvent* event)
+{
+#ifdef _WIN32
+    ResetEvent(*event);
+#endif
+}
+
+/* timeout in ms, 0 for no limit. Callers check their condition again on return */
+static void event_wait(USBClerkEvent* event, USBClerkLock* event_lock, UINT32 timeout)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(event_lock);
+    WaitForSingleObject(*event, timeout ? timeout : INFINITE);
+    EnterCriticalSection(event_lock);
+#else
+    struct timespec ts;
+
+    if (!timeout) {
+        pthread_cond_wait(event, event_lock);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(event, event_lock, &ts);
+#endif
+}
+
+static bool valid_reply(USBClerkReplyEx* reply)
+{
+    return reply->hdr.magic == USB_CLERK_MAGIC && reply->hdr.type == USB_CLERK_REPLY &&
+           (reply->hdr.size == sizeof(USBClerkReply) ||
+            reply->hdr.size == sizeof(USBClerkReplyEx));
+}
+
+/* adds part of a batch to its total, which starts as a success */
+static void add_reply(USBClerkReplyEx* total, const USBClerkReplyEx* part)
+{
+    total->hdr = part->hdr;
+    if (total->status == USB_CLERK_STATUS_SUCCESS) {
+        total->status = part->status;
+        total->error = part->error;
+        total->native_error = part->native_error;
+    }
+    total->install_attempts += part->install_attempts;
+    for (int i = 0; i < USB_CLERK_STAGES; i++) {
+        total->stage_ms[i] += part->stage_ms[i];
+    }
+}
+
+#ifdef _WIN32
+/* the header tells whether the reply is a USBClerkReply or a USBClerkReplyEx */
+static bool reply_complete(USBClerkReplyEx* reply, UINT32 bytes)
+{
+    return bytes >= sizeof(USBClerkHeader) && bytes == reply->hdr.size;
+}
+
+USBClerkPipeTransport::USBClerkPipeTransport(bool use_ring, DWORD connect_timeout)
+    : _pipe (INVALID_HANDLE_VALUE)
+    , _event (CreateEvent(NULL, TRUE, FALSE, NULL))
+    , _use_ring (use_ring)
+    , _ring (false)
+    , _connect_timeout (connect_timeout)
+    , _error (0)
+{
+}
+
+USBClerkPipeTransport::~USBClerkPipeTransport()
+{
+    close();
+    CloseHandle(_event);
+}
+
+bool USBClerkPipeTransport::connect()
+{
+    close();
+    if (!open_pipe()) {
+        return false;
+    }
+    if (_use_ring) {
+        _ring = setup_ring();
+    }
+    return _pipe != INVALID_HANDLE_VALUE;
+}
+
+void USBClerkPipeTransport::close()
+{
+    _channel.close();
+    _ring = false;
+    if (_pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(_pipe);
+        _pipe = INVALID_HANDLE_VALUE;
+    }
+}
+
+/* waits up to connect_timeout for a free pipe instance while the service is busy */
+bool USBClerkPipeTransport::open_pipe()
+{
+    DWORD pipe_mode = PIPE_READMODE_MESSAGE | PIPE_WAIT;
+
+    for (int i = 0; i < CLIENT_CONNECT_TRIES; i++) {
+        _pipe = CreateFile(USB_CLERK_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (_pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        _error = GetLastError();
+        if (_error != ERROR_PIPE_BUSY ||
+                !WaitNamedPipe(USB_CLERK_PIPE_NAME, _connect_timeout)) {
+            return false;
+        }
+    }
+    if (_pipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!SetNamedPipeHandleState(_pipe, &pipe_mode, NULL, NULL)) {
+        _error = GetLastError();
+        close();
+        return false;
+    }
+    return true;
+}
+
+/* the service closes the pipe on messages it does not know, so an older one is
+   detected by the failed transaction, the pipe reopened & the ring not asked again */
+bool USBClerkPipeTransport::setup_ring()
+{
+    USBClerkRingSetup setup = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+        USB_CLERK_RING_SETUP, sizeof(USBClerkRingSetup)}};
+    USBClerkReplyEx reply;
+    TCHAR name[MAX_PATH];
+
+    setup.key = GetCurrentProcessId() ^ (GetTickCount() << 16);
+    setup.slots = CLIENT_RING_SLOTS;
+    if (!transact_pipe(&setup, sizeof(setup), &reply, 0)) {
+        _use_ring = false;
+        close();
+        open_pipe();
+        return false;
+    }
+    _sntprintf(name, MAX_PATH, USB_CLERK_RING_NAME, setup.key);
+    return valid_reply(&reply) && reply.status == USB_CLERK_STATUS_SUCCESS &&
+           _channel.open(name, setup.slots);
+}
+
+bool USBClerkPipeTransport::transact_pipe(const void* request, UINT32 size,
+                                          USBClerkReplyEx* reply, UINT32 timeout)
+{
+    OVERLAPPED overlapped;
+    DWORD bytes = 0;
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = _event;
+    if (!TransactNamedPipe(_pipe, (LPVOID)request, size, reply, sizeof(*reply), &bytes,
+                           &overlapped)) {
+        _error = GetLastError();
+        if (_error != ERROR_IO_PENDING) {
+            return false;
+        }
+        if (WaitForSingleObject(_event, timeout ? timeout : INFINITE) != WAIT_OBJECT_0) {
+            /* the buffers are in use until the cancelled i/o completed */
+            CancelIo(_pipe);
+            GetOverlappedResult(_pipe, &overlapped, &bytes, TRUE);
+            _error = ERROR_TIMEOUT;
+            return false;
+        }
+        if (!GetOverlappedResult(_pipe, &overlapped, &bytes, FALSE)) {
+            _error = GetLastError();
+            return false;
+        }
+    }
+    return reply_complete(reply, bytes);
+}
+
+/* requests larger than a ring slot still go through the pipe */
+bool USBClerkPipeTransport::transact(const void* request, UINT32 size,
+                                     USBClerkReplyEx* reply, UINT32 timeout)
+{
+    DWORD start = GetTickCount();
+    int r;
+
+    if (_pipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (!_ring || size > SHM_RING_SLOT_DATA) {
+        return transact_pipe(request, size, reply, timeout);
+    }
+    if (!_channel.requests()->push(request, size)) {
+        _error = ERROR_BUSY;
+        return false;
+    }
+    /* the pipe tells whether the service is still there */
+    while ((r = _channel.replies()->pop(reply, sizeof(*reply), CLIENT_RING_POLL)) == 0) {
+        if (!PeekNamedPipe(_pipe, NULL, 0, NULL, NULL, NULL)) {
+            _error = GetLastError();
+            return false;
+        }
+        if (timeout && GetTickCount() - start >= timeout) {
+            _error = ERROR_TIMEOUT;
+            return false;
+        }
+    }
+    if (r < 0 || !reply_complete(reply, r)) {
+        _error = ERROR_INVALID_DATA;
+        return false;
+    }
+    return true;
+}
+#endif
+
+USBClerkClient::USBClerkClient(USBClerkTransport* transport)
+    : _transport (transport)
+    , _connected (false)
+    , _was_connected (false)
+    , _service_version (0)
+    , _reconnects (0)
+    , _last_io (0)
+    , _recheck (false)
+    , _recheck_time (0)
+    , _worker (false)
+    , _stop (false)
+    , _busy (0)
+{
+    lock_init(&_io_lock);
+    lock_init(&_lock);
+    event_init(&_wake, false);
+    event_init(&_idle, true);
+}
+
+USBClerkClient::~USBClerkClient()
+{
+    close();
+    event_destroy(&_wake);
+    event_destroy(&_idle);
+    lock_destroy(&_lock);
+    lock_destroy(&_io_lock);
+}
+
+bool USBClerkClient::connect()
+{
+    bool connected;
+
+    lock(&_io_lock);
+    connected = _connected || reconnect();
+    unlock(&_io_lock);
+    return connected;
+}
+
+/* completes the queued operations, then closes the connection, which makes the
+   service remove the session installs of the client */
+void USBClerkClient::close()
+{
+    bool worker;
+
+    lock(&_lock);
+    _stop = true;
+    worker = _worker;
+    event_signal(&_wake);
+    unlock(&_lock);
+    if (worker) {
+#ifdef _WIN32
+        WaitForSingleObject(_thread, INFINITE);
+        CloseHandle(_thread);
+#else
+        pthread_join(_thread, NULL);
+#endif
+    }
+    lock(&_lock);
+    _worker = false;
+    _stop = false;
+    unlock(&_lock);
+
+    lock(&_io_lock);
+    if (_connected) {
+        _transport->close();
+        _connected = false;
+    }
+    _session_devs.clear();
+    unlock(&_io_lock);
+}
+
+/* called with _io_lock held. After a timeout, the service may still be serving the
+   old connection & remove its session devices only once it notices it closed, after
+   they were installed again here, so the worker installs them once more later */
+bool USBClerkClient::reconnect()
+{
+    if (!_transport->connect()) {
+        return false;
+    }
+    if (_was_connected) {
+        _reconnects++;
+    }
+    _was_connected = true;
+    if (!reinstall()) {
+        _transport->close();
+        return false;
+    }
+    _connected = true;
+    if (!_session_devs.empty()) {
+        _recheck = true;
+        _recheck_time = tick();
+        lock(&_lock);
+        event_signal(&_wake);
+        unlock(&_lock);
+    }
+    return true;
+}
+
+/* called with _io_lock held. Returns false if the connection broke. Devices the
+   service failed to install are no longer the client's, those it turned down for
+   now are kept to be installed on the next check */
+bool USBClerkClient::reinstall()
+{
+    USBClerkDriverOp op = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+        USB_CLERK_DRIVER_SESSION_INSTALL, sizeof(USBClerkDriverOp)}};
+    USBClerkReplyEx reply;
+    USBClerkDevices::iterator iter = _session_devs.begin();
+
+    while (iter != _session_devs.end()) {
+        op.vid = iter->vid;
+        op.pid = iter->pid;
+        if (!_transport->transact(&op, sizeof(op), &reply, 0) || !valid_reply(&reply)) {
+            return false;
+        }
+        if (reply.status == USB_CLERK_STATUS_SUCCESS ||
+                reply.status == USB_CLERK_STATUS_BUSY ||
+                reply.status == USB_CLERK_STATUS_THROTTLED) {
+            iter++;
+        } else {
+            iter = _session_devs.erase(iter);
+        }
+    }
+    return true;
+}
+
+/* called with _io_lock held. Sends the request again once on a new connection. On
+   failure reply is USB_CLERK_STATUS_DISCONNECTED */
+bool USBClerkClient::transact(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                              UINT32 timeout)
+{
+    for (int i = 0; i < 2; i++) {
+        memset(reply, 0, sizeof(*reply));
+        if (!_connected && !reconnect()) {
+            break;
+        }
+        if (_transport->transact(request, size, reply, timeout) && valid_reply(reply)) {
+            _service_version = reply->hdr.version;
+            _last_io = tick();
+            return true;
+        }
+        _transport->close();
+        _connected = false;
+    }
+    memset(reply, 0, sizeof(*reply));
+    reply->status = USB_CLERK_STATUS_DISCONNECTED;
+    return false;
+}
+
+UINT32 USBClerkClient::run(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout,
+                           USBClerkReplyEx* reply)
+{
+    USBClerkReplyEx local;
+    UINT32 status;
+
+    lock(&_io_lock);
+    status = run_locked(type, vid, pid, timeout, reply ? reply : &local);
+    unlock(&_io_lock);
+    return status;
+}
+
+/* services before CLIENT_VERSION_OP_EX only know USBClerkDriverOp, which is enough
+   unless there is a deadline */
+UINT32 USBClerkClient::run_locked(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout,
+                                  USBClerkReplyEx* reply)
+{
+    USBClerkDriverOpEx op = {{USB_CLERK_MAGIC, USB_CLERK_VERSION, type,
+        sizeof(USBClerkDriverOpEx)}, vid, pid, 0, timeout};
+
+    if (!timeout) {
+        op.hdr.size = sizeof(USBClerkDriverOp);
+    }
+    transact(&op, op.hdr.size, reply, timeout ? timeout + USB_CLERK_CLIENT_GRACE : 0);
+    if (reply->status == USB_CLERK_STATUS_SUCCESS) {
+        track(type, vid, pid);
+    }
+    return reply->status;
+}
+
+/* returns USB_CLERK_STATUS_SUCCESS if all succeeded, else the first failure, with
+   the stages of all devices in reply */
+UINT32 USBClerkClient::run_batch(UINT16 type, const USBClerkDevice* devs, int count,
+                                 UINT32 timeout, USBClerkReplyEx* reply)
+{
+    USBClerkDriverBatch batch = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
+        USB_CLERK_DRIVER_BATCH, sizeof(USBClerkDriverBatch)}};
+    USBClerkReplyEx local, part;
+    int i = 0, n;
+
+    if (!reply) {
+        reply = &local;
+    }
+    memset(reply, 0, sizeof(*reply));
+    reply->status = USB_CLERK_STATUS_SUCCESS;
+    lock(&_io_lock);
+    while (i < count) {
+        /* single operations until the service is known to support batches, the first
+           one tells its version */
+        if (_service_version < CLIENT_VERSION_BATCH || count - i == 1) {
+            run_locked(type, devs[i].vid, devs[i].pid, timeout, &part);
+            i++;
+        } else {
+            n = count - i < USB_CLERK_BATCH_MAX ? count - i : USB_CLERK_BATCH_MAX;
+            batch.op_type = type;
+            batch.count = n;
+            batch.timeout = timeout;
+            memcpy(batch.devs, devs + i, n * sizeof(USBClerkDevice));
+            transact(&batch, sizeof(batch), &part,
+                     timeout ? timeout + USB_CLERK_CLIENT_GRACE : 0);
+            for (int j = 0; j < n && part.status == USB_CLERK_STATUS_SUCCESS; j++) {
+                track(type, devs[i + j].vid, devs[i + j].pid);
+            }
+            i += n;
+        }
+        add_reply(reply, &part);
+    }
+    unlock(&_io_lock);
+    return reply->status;
+}
+
+/* called with _io_lock held, after a successful operation. Session installs need the
+   worker for keepalives */
+void USBClerkClient::track(UINT16 type, UINT16 vid, UINT16 pid)
+{
+    USBClerkDevices::iterator iter;
+    USBClerkDevice dev = {vid, pid};
+
+    for (iter = _session_devs.begin(); iter != _session_devs.end(); iter++) {
+        if (iter->vid == vid && iter->pid == pid) {
+            break;
+        }
+    }
+    switch (type) {
+    case USB_CLERK_DRIVER_SESSION_INSTALL:
+        if (iter == _session_devs.end()) {
+            _session_devs.push_back(dev);
+        }
+        lock(&_lock);
+        start_worker();
+        unlock(&_lock);
+        break;
+    case USB_CLERK_DRIVER_REMOVE:
+        if (iter != _session_devs.end()) {
+            _session_devs.erase(iter);
+        }
+        break;
+    }
+}
+
+/* older services have no idle timeout & close the pipe on keepalives. A lost
+   connection is reopened right away, to install the session devices again */
+void USBClerkClient::keepalive()
+{
+    USBClerkHeader hdr = {USB_CLERK_MAGIC, USB_CLERK_VERSION, USB_CLERK_KEEPALIVE,
+                          sizeof(USBClerkHeader)};
+    USBClerkReplyEx reply;
+
+    lock(&_io_lock);
+    if (_session_devs.empty()) {
+        _recheck = false;
+    } else {
+        if (!_connected) {
+            reconnect();
+        } else if (_recheck && tick() - _recheck_time >= USB_CLERK_CLIENT_SETTLE) {
+            _recheck = false;
+            if (!reinstall()) {
+                _transport->close();
+                _connected = false;
+            }
+        } else if (_service_version >= CLIENT_VERSION_KEEPALIVE &&
+                   tick() - _last_io >= USB_CLERK_CLIENT_KEEPALIVE / 2) {
+            transact(&hdr, sizeof(hdr), &reply, USB_CLERK_CLIENT_GRACE);
+        }
+    }
+    unlock(&_io_lock);
+}
+
+bool USBClerkClient::submit(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout,
+                            USBClerkCompletion done, void* opaque)
+{
+    USBClerkRequest request = {type, vid, pid, timeout, done, opaque};
+
+    lock(&_lock);
+    if (_stop || !start_worker()) {
+        unlock(&_lock);
+        return false;
+    }
+    _queue.push_back(request);
+    event_reset(&_idle);
+    event_signal(&_wake);
+    unlock(&_lock);
+    return true;
+}
+
+void USBClerkClient::flush()
+{
+    lock(&_lock);
+    while (_worker && (!_queue.empty() || _busy)) {
+        event_wait(&_idle, &_lock, 0);
+    }
+    unlock(&_lock);
+}
+
+/* called with _lock held */
+bool USBClerkClient::start_worker()
+{
+    if (_worker) {
+        return true;
+    }
+#ifdef _WIN32
+    _thread = CreateThread(NULL, 0, worker_thread, this, 0, NULL);
+    _worker = (_thread != NULL);
+#else
+    _worker = (pthread_create(&_thread, NULL, worker_thread, this) == 0);
+#endif
+    return _worker;
+}
+
+#ifdef _WIN32
+DWORD WINAPI USBClerkClient::worker_thread(LPVOID param)
+#else
+void* USBClerkClient::worker_thread(void* param)
+#endif
+{
+    ((USBClerkClient*)param)->worker();
+    return 0;
+}
+
+/* a failed batch does not tell which devices failed, single operations do. They
+   would not get through when the service turned the batch down as busy or throttled,
+   nor tell more when it was disconnected, timed out or cancelled */
+void USBClerkClient::process(USBClerkRequests* requests)
+{
+    USBClerkDevice devs[USB_CLERK_BATCH_MAX];
+    USBClerkRequest* first = &requests->front();
+    USBClerkRequests::iterator iter;
+    USBClerkReplyEx batch_reply, reply;
+    bool single = true;
+    int count = 0;
+
+    for (iter = requests->begin(); iter != requests->end(); iter++) {
+        devs[count].vid = iter->vid;
+        devs[count].pid = iter->pid;
+        count++;
+    }
+    /* run_batch() would send single operations to older services anyway */
+    if (count > 1 && _service_version >= CLIENT_VERSION_BATCH) {
+        single = run_batch(first->type, devs, count, first->timeout, &batch_reply) ==
+                 USB_CLERK_STATUS_FAILED;
+    }
+    for (iter = requests->begin(); iter != requests->end(); iter++) {
+        if (single) {
+            run(iter->type, iter->vid, iter->pid, iter->timeout, &reply);
+        }
+        if (iter->done) {
+            iter->done(iter->opaque, iter->vid, iter->pid, single ? &reply : &batch_reply);
+        }
+    }
+}
+
+/* consecutive queued operations of the same type & timeout go in one batch */
+void USBClerkClient::worker()
+{
+    USBClerkRequests requests;
+
+    lock(&_lock);
+    for (;;) {
+        while (_queue.empty() && !_stop) {
+            event_wait(&_wake, &_lock, _recheck ? USB_CLERK_CLIENT_SETTLE :
+                                                  USB_CLERK_CLIENT_KEEPALIVE);
+            if (_queue.empty() && !_stop) {
+                unlock(&_lock);
+                keepalive();
+                lock(&_lock);
+            }
+        }
+        if (_queue.empty()) {
+            break;
+        }
+        do {
+            requests.push_back(_queue.front());
+            _queue.pop_front();
+        } while (!_queue.empty() && requests.size() < USB_CLERK_BATCH_MAX &&
+                 _queue.front().type == requests.front().type &&
+                 _queue.front().timeout == requests.front().timeout);
+        _busy = requests.size();
+        unlock(&_lock);
+        process(&requests);
+        requests.clear();
+        lock(&_lock);
+        _busy = 0;
+        if (_queue.empty()) {
+            event_signal(&_idle);
+        }
+    }
+    /* flush() waiters see the worker gone */
+    event_signal(&_idle);
+    unlock(&_lock);
+}
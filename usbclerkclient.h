@@ -0,0 +1,157 @@
+#ifndef _H_USBCLERKCLIENT
+#define _H_USBCLERKCLIENT
+
+#include <list>
+#include "usbclerk.h"
+#ifdef _WIN32
+#include "shmring.h"
+typedef CRITICAL_SECTION USBClerkLock;
+typedef HANDLE USBClerkEvent;
+typedef HANDLE USBClerkThread;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t USBClerkLock;
+typedef pthread_cond_t USBClerkEvent;
+typedef pthread_t USBClerkThread;
+#endif
+
+/* client side statuses, never sent by the service */
+enum {
+    USB_CLERK_STATUS_DISCONNECTED = 0x100,  /* the service could not be reached */
+};
+
+#define USB_CLERK_CLIENT_KEEPALIVE  60000   /* ms between keepalives of an idle client */
+#define USB_CLERK_CLIENT_GRACE      5000    /* ms to wait for a reply past an op deadline */
+#define USB_CLERK_CLIENT_SETTLE     5000    /* ms after a reconnect to install the session
+                                               devices once more, see reconnect() */
+
+/* How the client reaches the service. transact() sends a request & reads its reply,
+   a USBClerkReply or USBClerkReplyEx as told by its header, waiting up to timeout ms,
+   0 for no limit. When it fails the connection state is unknown, so the client closes
+   it & connects again. */
+class USBClerkTransport {
+public:
+    virtual ~USBClerkTransport() {}
+    virtual bool connect() = 0;
+    virtual void close() = 0;
+    virtual bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                          UINT32 timeout) = 0;
+};
+
+#ifdef _WIN32
+/* The service pipe, opened for overlapped i/o so replies can be waited for with a
+   timeout. With use_ring, requests go through a shared memory ring when the service
+   supports it, while the pipe tells whether the service is still there. */
+class USBClerkPipeTransport : public USBClerkTransport {
+public:
+    USBClerkPipeTransport(bool use_ring, DWORD connect_timeout);
+    ~USBClerkPipeTransport();
+    bool connect();
+    void close();
+    bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply, UINT32 timeout);
+    bool ring() { return _ring; }
+    DWORD error() { return _error; }
+
+private:
+    bool open_pipe();
+    bool setup_ring();
+    bool transact_pipe(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                       UINT32 timeout);
+
+private:
+    HANDLE _pipe;
+    HANDLE _event;
+    ShmChannel _channel;
+    bool _use_ring;
+    bool _ring;
+    DWORD _connect_timeout;
+    DWORD _error;
+};
+#endif
+
+typedef void (*USBClerkCompletion)(void* opaque, UINT16 vid, UINT16 pid,
+                                   const USBClerkReplyEx* reply);
+
+typedef struct USBClerkRequest {
+    UINT16 type;
+    UINT16 vid;
+    UINT16 pid;
+    UINT32 timeout;
+    USBClerkCompletion done;
+    void* opaque;
+} USBClerkRequest;
+
+typedef std::list<USBClerkRequest> USBClerkRequests;
+typedef std::list<USBClerkDevice> USBClerkDevices;
+
+/* Driver operations over one persistent connection to the service, shared by the
+   threads of a client process. A broken connection is reopened & the request sent
+   again, as driver operations are idempotent; the session installs of the client are
+   installed again first, since the service removes them with the old connection, &
+   once more after USB_CLERK_CLIENT_SETTLE, in case it did so after the reinstall.
+   Operations return a USB_CLERK_STATUS_* value, and the reply if asked; the fields
+   past USBClerkReply stay zero with services before USB_CLERK_VERSION_REPLY_EX.
+   run_batch() sends up to USB_CLERK_BATCH_MAX devices per message when the service
+   supports batches. submit() queues an operation for a worker thread, which batches
+   queued operations of the same type & timeout and calls done on completion, in queue
+   order, with the reply, that of the whole batch unless it failed & the devices were
+   sent again one by one to tell which failed; flush() waits for the queue to empty.
+   While the client holds session installs, the worker also sends keepalives, so the
+   service does not close the connection as idle.
+   The transport is owned by the caller. */
+class USBClerkClient {
+public:
+    USBClerkClient(USBClerkTransport* transport);
+    ~USBClerkClient();
+    bool connect();
+    void close();
+    UINT32 run(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout = 0,
+               USBClerkReplyEx* reply = NULL);
+    UINT32 run_batch(UINT16 type, const USBClerkDevice* devs, int count,
+                     UINT32 timeout = 0, USBClerkReplyEx* reply = NULL);
+    bool submit(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout,
+                USBClerkCompletion done, void* opaque);
+    void flush();
+    UINT16 service_version() { return _service_version; }
+    unsigned reconnects() { return _reconnects; }
+
+private:
+    bool reconnect();
+    bool reinstall();
+    bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                  UINT32 timeout);
+    UINT32 run_locked(UINT16 type, UINT16 vid, UINT16 pid, UINT32 timeout,
+                      USBClerkReplyEx* reply);
+    void track(UINT16 type, UINT16 vid, UINT16 pid);
+    void keepalive();
+    bool start_worker();
+    void process(USBClerkRequests* requests);
+    void worker();
+#ifdef _WIN32
+    static DWORD WINAPI worker_thread(LPVOID param);
+#else
+    static void* worker_thread(void* param);
+#endif
+
+private:
+    USBClerkTransport* _transport;
+    USBClerkLock _io_lock;          /* the transport, connection state & session devices */
+    bool _connected;
+    bool _was_connected;
+    UINT16 _service_version;
+    unsigned _reconnects;
+    UINT32 _last_io;
+    USBClerkDevices _session_devs;
+    volatile bool _recheck;         /* the session devices are to be installed again */
+    UINT32 _recheck_time;
+    USBClerkLock _lock;             /* the queue & the worker */
+    USBClerkEvent _wake;
+    USBClerkEvent _idle;
+    USBClerkThread _thread;
+    bool _worker;
+    bool _stop;
+    int _busy;
+    USBClerkRequests _queue;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include "filteropt.h"
+#include "packedrule.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define FILTEROPT_MAX_POINTS    (1ULL << 32)
+#define FILTEROPT_MAX_RULES_LEN 65536
+#define FILTEROPT_BENCH_PROBES  4096
+#define FILTEROPT_BENCH_TIME    0.5
+
+static void usage()
+{
+    printf("Usage: usbclerk-filteropt [-a] [-b] [-t token_sep] [-r rule_sep] [rules]\n"
+           "Prints a minimal rule string equivalent to rules (read from stdin if not\n"
+           "given), and a report of the removed and merged rules on stderr.\n"
+           "-a - no matching rule allows the device (usbredirfilter_fl_default_allow)\n"
+           "-b - compare footprint & check time of the struct and packed rule layouts\n"
+           "-t - token separator, default \",\"\n"
+           "-r - rule separator, default \"|\"\n");
+}
+
+static double now_sec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+typedef struct BenchProbe {
+    uint8_t device_class;
+    uint16_t vendor_id;
+    uint16_t product_id;
+} BenchProbe;
+
+/* ns per check of either layout, over passes of all probes for FILTEROPT_BENCH_TIME */
+static double bench_check(const struct usbredirfilter_rule *rules, const PackedRule *packed,
+                          int rules_count, int flags, const BenchProbe *probes)
+{
+    volatile int sink = 0;
+    double start = now_sec(), elapsed;
+    long checks = 0;
+
+    do {
+        for (int i = 0; i < FILTEROPT_BENCH_PROBES; i++) {
+            if (packed) {
+                sink += packedrule_check(packed, rules_count, probes[i].device_class, 0, 0,
+                                         NULL, NULL, NULL, 0, probes[i].vendor_id,
+                                         probes[i].product_id, 0, flags);
+            } else {
+                sink += usbredirfilter_check(rules, rules_count, probes[i].device_class, 0, 0,
+                                             NULL, NULL, NULL, 0, probes[i].vendor_id,
+                                             probes[i].product_id, 0, flags);
+            }
+        }
+        checks += FILTEROPT_BENCH_PROBES;
+        elapsed = now_sec() - start;
+    } while (elapsed < FILTEROPT_BENCH_TIME);
+    return elapsed * 1e9 / checks;
+}
+
+/* probes mix devices named by the rules (matching at every depth) with unknown ones */
+static int bench(const struct usbredirfilter_rule *rules, int rules_count, int default_allow)
+{
+    static BenchProbe probes[FILTEROPT_BENCH_PROBES];
+    int flags = default_allow ? usbredirfilter_fl_default_allow : 0;
+    PackedRule *packed;
+    uint32_t seed = 1;
+    double struct_ns, packed_ns;
+    int i;
+
+    if (packedrule_from_rules(rules, rules_count, &packed)) {
+        fprintf(stderr, "Failed packing filter rules\n");
+        return 1;
+    }
+    for (i = 0; i < FILTEROPT_BENCH_PROBES; i++) {
+        const struct usbredirfilter_rule *rule;
+
+        seed = seed * 1103515245 + 12345;
+        probes[i].device_class = 1 + (seed >> 16) % 0xfe;
+        probes[i].vendor_id = seed >> 8;
+        probes[i].product_id = seed >> 4;
+        if (rules_count && (i & 1)) {
+            rule = &rules[(seed >> 8) % rules_count];
+            if (rule->device_class > 0 && rule->device_class != 0xef) {
+                probes[i].device_class = rule->device_class;
+            }
+            if (rule->vendor_id != -1) {
+                probes[i].vendor_id = rule->vendor_id;
+            }
+            if (rule->product_id != -1) {
+                probes[i].product_id = rule->product_id;
+            }
+        }
+        if (packedrule_check(packed, rules_count, probes[i].device_class, 0, 0, NULL, NULL,
+                             NULL, 0, probes[i].vendor_id, probes[i].product_id, 0, flags) !=
+            usbredirfilter_check(rules, rules_count, probes[i].device_class, 0, 0, NULL,
+                                 NULL, NULL, 0, probes[i].vendor_id, probes[i].product_id,
+                                 0, flags)) {
+            fprintf(stderr, "Packed rules differ for class 0x%02x %04x:%04x\n",
+                    probes[i].device_class, probes[i].vendor_id, probes[i].product_id);
+            free(packed);
+            return 1;
+        }
+    }
+    struct_ns = bench_check(rules, NULL, rules_count, flags, probes);
+    packed_ns = bench_check(NULL, packed, rules_count, flags, probes);
+    printf("struct: %d rules, %lu bytes, %.1f ns/check\n", rules_count,
+           (unsigned long)(sizeof(*rules) * rules_count), struct_ns);
+    printf("packed: %d rules, %lu bytes, %.1f ns/check (%.2fx)\n", rules_count,
+           (unsigned long)(sizeof(*packed) * rules_count), packed_ns,
+           packed_ns > 0 ? struct_ns / packed_ns : 0);
+    free(packed);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *token_sep = ",", *rule_sep = "|";
+    static char rules_str[FILTEROPT_MAX_RULES_LEN];
+    struct usbredirfilter_rule *rules, *opt_rules, counterexample;
+    int rules_count, opt_count;
+    int default_allow = 0;
+    bool benchmark = false;
+    FilterOptReport report;
+    char *opt_str;
+    int i, r;
+
+    /* rules start with "-1" for a wildcard class, so options are letters only */
+    for (i = 1; i < argc && argv[i][0] == '-' && isalpha(argv[i][1]); i++) {
+        if (!strcmp(argv[i], "-a")) {
+            default_allow = 1;
+        } else if (!strcmp(argv[i], "-b")) {
+            benchmark = true;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc && strlen(argv[i + 1]) == 1) {
+            token_sep = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc && strlen(argv[i + 1]) == 1) {
+            rule_sep = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (i < argc - 1) {
+        usage();
+        return 1;
+    }
+    if (i == argc - 1) {
+        strncpy(rules_str, argv[i], sizeof(rules_str) - 1);
+    } else if (!fgets(rules_str, sizeof(rules_str), stdin)) {
+        usage();
+        return 1;
+    }
+    rules_str[strcspn(rules_str, "\r\n")] = '\0';
+
+    r = usbredirfilter_string_to_rules(rules_str, token_sep, rule_sep, &rules, &rules_count);
+    if (r) {
+        fprintf(stderr, "Failed parsing filter rules: %d\n", r);
+        return 1;
+    }
+    if (benchmark) {
+        r = bench(rules, rules_count, default_allow);
+        free(rules);
+        return r;
+    }
+    r = filteropt_optimize(rules, rules_count, default_allow, &opt_rules, &opt_count,
+                           &report, stderr);
+    if (r) {
+        fprintf(stderr, "Failed optimizing filter rules: %d\n", r);
+        free(rules);
+        return 1;
+    }
+    r = filteropt_verify(rules, rules_count, opt_rules, opt_count, default_allow,
+                         FILTEROPT_MAX_POINTS, &report.checked_points, &counterexample);
+    if (r == -E2BIG) {
+        fprintf(stderr, "Rules too large to verify equivalence\n");
+    } else if (r == 0) {
+        /* a bug in the optimizer, never print a rule set with different verdicts */
+        fprintf(stderr, "Optimized rules differ for class 0x%02x %04x:%04x version 0x%04x\n",
+                counterexample.device_class, counterexample.vendor_id,
+                counterexample.product_id, counterexample.device_version_bcd);
+        free(opt_rules);
+        free(rules);
+        return 1;
+    }
+    report.verified = r;
+    /* rules_to_string does not give a terminated string for no rules, and no rules
+       is an empty rule string: everything gets the default verdict */
+    opt_str = NULL;
+    if (opt_count) {
+        opt_str = usbredirfilter_rules_to_string(opt_rules, opt_count, token_sep, rule_sep);
+        if (!opt_str) {
+            fprintf(stderr, "Failed converting filter rules\n");
+            free(opt_rules);
+            free(rules);
+            return 1;
+        }
+    }
+    /* rules_to_string terminates every rule, usbredirfilter_string_to_rules takes both */
+    printf("%s\n", opt_str ? opt_str : "");
+    fprintf(stderr, "%d rules, %d after optimization: %d shadowed, %d redundant, %d merged\n",
+            report.original_count, report.optimized_count, report.shadowed,
+            report.redundant, report.merged);
+    if (report.verified == 1) {
+        fprintf(stderr, "Equivalence verified over %llu points\n",
+                (unsigned long long)report.checked_points);
+    }
+    free(opt_str);
+    free(opt_rules);
+    free(rules);
+    return 0;
+}
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+#include "capture.h"
+#include "protocol.h"
+#include "trace.h"
+#include "usbclerkclient.h"
+
+#define REPLAY_CONNECT_TIMEOUT  5000    /* ms */
+#define REPLAY_REPLY_TIMEOUT    120000  /* ms */
+
+/* a captured request, with the reply the service gave & how long it took */
+typedef struct ReplayMessage {
+    uint64_t time;              /* us since the start of the capture */
+    std::vector<uint8_t> request;
+    bool replied;
+    USBClerkReplyEx reply;
+    uint64_t service_time;      /* us */
+} ReplayMessage;
+
+typedef struct ReplaySample {
+    uint16_t type;
+    bool ok;
+    uint64_t latency;           /* us */
+    uint64_t lag;               /* us the request was sent behind schedule */
+    uint64_t overhead;          /* us of latency past the captured service time, with -l */
+} ReplaySample;
+
+typedef struct ReplayConn {
+    uint32_t id;
+    uint64_t connect_time;
+    std::vector<ReplayMessage> messages;
+    std::vector<ReplaySample> samples;
+    uint32_t mismatches;        /* replies with another status than captured */
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} ReplayConn;
+
+typedef std::map<uint32_t, ReplayConn*> ReplayConns;
+
+static const char* type_names[] = {
+    "install", "remove", "reply", "session_install", "cancel", "ring_setup", "batch",
+    "keepalive",
+};
+
+/* 0 replays as fast as possible */
+static double speed = 1;
+static bool simulate;
+static bool use_ring;
+static uint64_t replay_start;
+
+/* Stands in for the service: checks each request as the service does, then gives the
+   captured reply after the captured service time, so the client side of a workload
+   can be replayed where the service cannot run. Nothing of the service runs, not its
+   dispatch, queue nor rate limits, so only the client side overhead is measured */
+class SimTransport : public USBClerkTransport {
+public:
+    SimTransport() : message (NULL) {}
+    bool connect() { return true; }
+    void close() {}
+    bool transact(const void* request, UINT32 size, USBClerkReplyEx* reply, UINT32 timeout);
+
+public:
+    ReplayMessage* message;
+};
+
+static void sleep_us(uint64_t us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(us / 1000));
+#else
+    struct timespec ts = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+
+    nanosleep(&ts, NULL);
+#endif
+}
+
+bool SimTransport::transact(const void* request, UINT32 size, USBClerkReplyEx* reply,
+                            UINT32 timeout)
+{
+    if (usb_clerk_check_message(request, size) != USB_CLERK_MSG_VALID || !message ||
+            !message->replied) {
+        return false;
+    }
+    sleep_us(message->service_time);
+    *reply = message->reply;
+    return true;
+}
+
+/* waits for the scaled capture time, returns how late that is */
+static uint64_t wait_until(uint64_t time)
+{
+    uint64_t due = replay_start + (speed ? (uint64_t)(time / speed) : 0);
+    uint64_t now = trace_now();
+
+    if (now < due) {
+        sleep_us(due - now);
+        now = trace_now();
+    }
+    return now > due ? now - due : 0;
+}
+
+static void replay_conn(ReplayConn* conn)
+{
+    SimTransport sim;
+#ifdef _WIN32
+    USBClerkPipeTransport pipe(use_ring, REPLAY_CONNECT_TIMEOUT);
+    USBClerkTransport* transport = simulate ? (USBClerkTransport*)&sim : &pipe;
+#else
+    USBClerkTransport* transport = &sim;
+#endif
+    USBClerkReplyEx reply;
+    bool connected;
+
+    wait_until(conn->connect_time);
+    connected = transport->connect();
+    for (unsigned i = 0; i < conn->messages.size(); i++) {
+        ReplayMessage* message = &conn->messages[i];
+        ReplaySample sample;
+        uint64_t start;
+
+        sample.type = ((USBClerkHeader*)&message->request[0])->type;
+        sample.lag = wait_until(message->time);
+        sim.message = message;
+        start = trace_now();
+        /* the service closes the pipe on bad messages, as it did when captured */
+        sample.ok = connected && transport->transact(&message->request[0],
+                                                     message->request.size(), &reply,
+                                                     REPLAY_REPLY_TIMEOUT);
+        sample.latency = trace_now() - start;
+        sample.overhead = sample.latency > message->service_time ?
+                          sample.latency - message->service_time : 0;
+        conn->samples.push_back(sample);
+        if (!sample.ok) {
+            transport->close();
+            connected = transport->connect();
+        } else if (message->replied && reply.status != message->reply.status) {
+            conn->mismatches++;
+        }
+    }
+    transport->close();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI replay_thread(LPVOID param)
+#else
+static void* replay_thread(void* param)
+#endif
+{
+    replay_conn((ReplayConn*)param);
+    return 0;
+}
+
+static ReplayConn* get_conn(ReplayConns* conns, uint32_t id, uint64_t time)
+{
+    ReplayConns::iterator iter = conns->find(id);
+    ReplayConn* conn;
+
+    if (iter != conns->end()) {
+        return iter->second;
+    }
+    conn = new ReplayConn;
+    conn->id = id;
+    conn->connect_time = time;
+    conn->mismatches = 0;
+    (*conns)[id] = conn;
+    return conn;
+}
+
+/* requests are replied in order on a connection, so a reply is for its oldest
+   request without one. Connections already open when the capture started begin with
+   their first request */
+static bool load(const char* path, ReplayConns* conns, uint32_t* messages)
+{
+    CaptureReader reader;
+    CaptureEvent* event = new CaptureEvent;
+    ReplayConn* conn;
+
+    if (!reader.open(path)) {
+        delete event;
+        return false;
+    }
+    *messages = 0;
+    while (reader.read(event)) {
+        conn = get_conn(conns, event->conn, event->time);
+        switch (event->kind) {
+        case CAPTURE_REQUEST: {
+            ReplayMessage message;
+
+            if (event->size < sizeof(USBClerkHeader)) {
+                break;
+            }
+            message.time = event->time;
+            message.request.assign(event->data, event->data + event->size);
+            message.replied = false;
+            memset(&message.reply, 0, sizeof(message.reply));
+            message.service_time = 0;
+            conn->messages.push_back(message);
+            (*messages)++;
+            break;
+        }
+        case CAPTURE_REPLY:
+            for (unsigned i = 0; i < conn->messages.size(); i++) {
+                ReplayMessage* message = &conn->messages[i];
+
+                if (!message->replied) {
+                    memcpy(&message->reply, event->data, event->size < sizeof(message->reply) ?
+                           event->size : sizeof(message->reply));
+                    message->replied = true;
+                    message->service_time = event->time - message->time;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    delete event;
+    return true;
+}
+
+static uint64_t percentile(std::vector<uint64_t>* values, int p)
+{
+    if (values->empty()) {
+        return 0;
+    }
+    return (*values)[(values->size() - 1) * p / 100];
+}
+
+static void report_line(const char* name, std::vector<uint64_t>* latencies, uint32_t failed)
+{
+    std::sort(latencies->begin(), latencies->end());
+    printf("%-16s %8u %8u %10llu %10llu %10llu %10llu\n", name,
+           (unsigned)latencies->size(), failed,
+           (unsigned long long)percentile(latencies, 50),
+           (unsigned long long)percentile(latencies, 90),
+           (unsigned long long)percentile(latencies, 99),
+           (unsigned long long)percentile(latencies, 100));
+}
+
+/* latencies of the replied requests, by message type & overall */
+static void report(ReplayConns* conns, uint64_t took)
+{
+    const int types = sizeof(type_names) / sizeof(type_names[0]);
+    std::vector<uint64_t> latencies[types + 1];
+    std::vector<uint64_t> all, lags, overheads;
+    uint32_t failed[types + 1] = {0};
+    uint32_t all_failed = 0, mismatches = 0;
+    ReplayConns::iterator iter;
+
+    for (iter = conns->begin(); iter != conns->end(); iter++) {
+        ReplayConn* conn = iter->second;
+
+        mismatches += conn->mismatches;
+        for (unsigned i = 0; i < conn->samples.size(); i++) {
+            ReplaySample* sample = &conn->samples[i];
+            int t = sample->type >= 1 && sample->type <= types ? sample->type - 1 : types;
+
+            lags.push_back(sample->lag);
+            if (!sample->ok) {
+                failed[t]++;
+                all_failed++;
+                continue;
+            }
+            latencies[t].push_back(sample->latency);
+            all.push_back(sample->latency);
+            overheads.push_back(sample->overhead);
+        }
+    }
+    printf("%-16s %8s %8s %10s %10s %10s %10s\n", "type", "replied", "failed", "p50 us",
+           "p90 us", "p99 us", "max us");
+    for (int t = 0; t <= types; t++) {
+        if (!latencies[t].empty() || failed[t]) {
+            report_line(t < types ? type_names[t] : "unknown", &latencies[t], failed[t]);
+        }
+    }
+    report_line("all", &all, all_failed);
+    std::sort(lags.begin(), lags.end());
+    printf("Replayed %u connections in %llums, %u replies differed from the capture\n",
+           (unsigned)conns->size(), (unsigned long long)(took / 1000), mismatches);
+    if (simulate) {
+        std::sort(overheads.begin(), overheads.end());
+        printf("Replied from the capture: the latencies are the captured service times plus\n"
+               "the client side overhead, the service itself was not exercised\n");
+        printf("Client side overhead: p50 %lluus, p99 %lluus, max %lluus\n",
+               (unsigned long long)percentile(&overheads, 50),
+               (unsigned long long)percentile(&overheads, 99),
+               (unsigned long long)percentile(&overheads, 100));
+    }
+    if (!speed) {
+        return;
+    }
+    printf("Sent behind schedule: p50 %lluus, p99 %lluus, max %lluus\n",
+           (unsigned long long)percentile(&lags, 50), (unsigned long long)percentile(&lags, 99),
+           (unsigned long long)percentile(&lags, 100));
+}
+
+static void usage()
+{
+    printf("Usage: usbclerk-replay [-s speed | -a] [-l] [-r] capture\n"
+           "Replays a capture of the service traffic, each connection from its own\n"
+           "thread, and reports the reply latencies.\n"
+           "-s - speed relative to the capture, default 1\n"
+           "-a - send each request as soon as the previous one of its connection is replied\n"
+           "-l - reply from the capture after the captured service time, instead of the\n"
+           "     service, the only backend off Windows. This measures only the client side\n"
+           "     overhead: the service dispatch, queue & rate limits do not run\n"
+           "-r - send requests through a shared memory ring\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ReplayConns conns;
+    ReplayConns::iterator iter;
+    const char* path = NULL;
+    uint32_t messages;
+
+#ifndef _WIN32
+    simulate = true;
+#endif
+    for (int i = 1; i < argc; i++) {
+        const char* arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "-s") && arg && atof(arg) > 0) {
+            speed = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-a")) {
+            speed = 0;
+        } else if (!strcmp(argv[i], "-l")) {
+            simulate = true;
+        } else if (!strcmp(argv[i], "-r")) {
+            use_ring = true;
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!path) {
+        usage();
+        return 1;
+    }
+    if (!load(path, &conns, &messages)) {
+        fprintf(stderr, "Cannot read capture %s\n", path);
+        return 1;
+    }
+    printf("Replaying %u requests of %u connections from %s\n", messages,
+           (unsigned)conns.size(), path);
+
+    replay_start = trace_now();
+    for (iter = conns.begin(); iter != conns.end(); iter++) {
+#ifdef _WIN32
+        iter->second->thread = CreateThread(NULL, 0, replay_thread, iter->second, 0, NULL);
+        if (!iter->second->thread) {
+#else
+        if (pthread_create(&iter->second->thread, NULL, replay_thread, iter->second)) {
+#endif
+            fprintf(stderr, "Failed starting the thread of connection %u\n", iter->first);
+            return 1;
+        }
+    }
+    for (iter = conns.begin(); iter != conns.end(); iter++) {
+#ifdef _WIN32
+        WaitForSingleObject(iter->second->thread, INFINITE);
+        CloseHandle(iter->second->thread);
+#else
+        pthread_join(iter->second->thread, NULL);
+#endif
+    }
+    report(&conns, trace_now() - replay_start);
+    for (iter = conns.begin(); iter != conns.end(); iter++) {
+        delete iter->second;
+    }
+    return 0;
+}
@@ -1,83 +1,117 @@
 #include <stdio.h>
 #include <conio.h>
 #include <tchar.h>
-#include "usbclerk.h"
+#include "usbclerkclient.h"
+
+#define CONNECT_TIMEOUT 5000
+
+static const char* error_names[] = {
+    "none", "service not ready", "device enumeration failed", "device not found",
+    "denied by filter rules", "driver prepare failed", "driver install failed",
+    "other installations pending", "WinUSB driver not installed", "uninstall failed",
+    "rescan failed",
+};
+
+static const char* stage_names[USB_CLERK_STAGES] = {
+    "queue", "filter", "enumerate", "prepare", "install", "rescan",
+};
+
+static void print_status(void* opaque, UINT16 vid, UINT16 pid, const USBClerkReplyEx* reply)
+{
+    bool verbose = opaque != NULL;
+
+    printf("%04x:%04x ", vid, pid);
+    switch (reply->status) {
+    case USB_CLERK_STATUS_SUCCESS:
+        printf("Completed successfully\n");
+        break;
+    case USB_CLERK_STATUS_BUSY:
+        printf("Service busy, retry later\n");
+        break;
+    case USB_CLERK_STATUS_THROTTLED:
+        printf("Too many driver operations, retry later\n");
+        break;
+    case USB_CLERK_STATUS_DISCONNECTED:
+        printf("Service disconnected\n");
+        break;
+    default:
+        if (reply->error < sizeof(error_names) / sizeof(error_names[0])) {
+            printf("Failed, %s (%d)\n", error_names[reply->error], (int)reply->native_error);
+        } else {
+            printf("Failed, error %u (%d)\n", reply->error, (int)reply->native_error);
+        }
+    }
+    if (verbose && reply->hdr.size == sizeof(USBClerkReplyEx)) {
+        printf("  %u install attempts,", reply->install_attempts);
+        for (int i = 0; i < USB_CLERK_STAGES; i++) {
+            printf(" %s %ums", stage_names[i], reply->stage_ms[i]);
+        }
+        printf("\n");
+    }
+}
 
 extern "C"
 int _tmain(int argc, TCHAR* argv[], TCHAR* envp[])
 {
-    HANDLE pipe;
-    USBClerkDriverOp dev = {{USB_CLERK_MAGIC, USB_CLERK_VERSION,
-        USB_CLERK_DRIVER_INSTALL, sizeof(USBClerkDriverOp)}};
-    USBClerkReply reply;
-    DWORD pipe_mode;
-    DWORD bytes = 0;
+    UINT16 type = USB_CLERK_DRIVER_INSTALL;
+    UINT16 vid, pid;
+    USBClerkReplyEx reply;
+    bool use_ring = false;
+    bool verbose = false;
     bool err = false;
     int i, devs = 0;
 
     for (i = 1; i < argc && !err; i++) {
         if (lstrcmpi(argv[i], TEXT("/t")) == 0) {
-            dev.hdr.type = USB_CLERK_DRIVER_SESSION_INSTALL;
+            type = USB_CLERK_DRIVER_SESSION_INSTALL;
         } else if (lstrcmpi(argv[i], TEXT("/u")) == 0) {
-            dev.hdr.type = USB_CLERK_DRIVER_REMOVE;
-        } else if (_stscanf(argv[i], TEXT("%hx:%hx"), &dev.vid, &dev.pid) == 2) {
+            type = USB_CLERK_DRIVER_REMOVE;
+        } else if (lstrcmpi(argv[i], TEXT("/r")) == 0) {
+            use_ring = true;
+        } else if (lstrcmpi(argv[i], TEXT("/v")) == 0) {
+            verbose = true;
+        } else if (_stscanf(argv[i], TEXT("%hx:%hx"), &vid, &pid) == 2) {
             devs++;
         } else {
             err = true;
         }
     }
-    if (argc < 2 || err || devs < argc - 2) {
-        printf("Usage: usbclerktest [/t][/u] vid:pid [vid1:pid1...]\n"
+    if (argc < 2 || err || devs < 1) {
+        printf("Usage: usbclerktest [/t][/u][/r][/v] vid:pid [vid1:pid1...]\n"
                "default - install driver for device vid:pid (in hex)\n"
                "/t - temporary install until session terminated\n"
-               "/u - uninstall driver\n");
+               "/u - uninstall driver\n"
+               "/r - send requests through a shared memory ring\n"
+               "/v - show where the service spent the time of each request\n");
         return 1;
     }
-    pipe = CreateFile(USB_CLERK_PIPE_NAME, GENERIC_READ | GENERIC_WRITE,
-                      0, NULL, OPEN_EXISTING, 0, NULL);
-    if (pipe == INVALID_HANDLE_VALUE) {
-        _tprintf(TEXT("Cannot open pipe %s: %lu\n"), USB_CLERK_PIPE_NAME, GetLastError());
+
+    USBClerkPipeTransport transport(use_ring, CONNECT_TIMEOUT);
+    USBClerkClient client(&transport);
+
+    if (!client.connect()) {
+        _tprintf(TEXT("Cannot open pipe %s: %lu\n"), USB_CLERK_PIPE_NAME, transport.error());
         return 1;
     }
-    pipe_mode = PIPE_READMODE_MESSAGE | PIPE_WAIT;
-    if (!SetNamedPipeHandleState(pipe, &pipe_mode, NULL, NULL)) {
-        printf("SetNamedPipeHandleState() failed: %lu\n", GetLastError());
-        return 1;
+    if (use_ring && !transport.ring()) {
+        printf("Shared memory ring not supported, using the pipe\n");
     }
-
-    for (i = 1; i < argc && !err; i++) {
-        if (_stscanf(argv[i], TEXT("%hx:%hx"), &dev.vid, &dev.pid) < 2) continue;
-        switch (dev.hdr.type) {
-        case USB_CLERK_DRIVER_SESSION_INSTALL:
-        case USB_CLERK_DRIVER_INSTALL:
-            printf("Signing & installing %04x:%04x...", dev.vid, dev.pid);
-            break;
-        case USB_CLERK_DRIVER_REMOVE:
-            printf("Removing %04x:%04x...", dev.vid, dev.pid);
-            break;
-        }
-        if (!TransactNamedPipe(pipe, &dev, sizeof(dev), &reply, sizeof(reply), &bytes, NULL)) {
-            printf("TransactNamedPipe() failed: %lu\n", GetLastError());
-            CloseHandle(pipe);
-            return 1;
-        }
-        if (reply.hdr.magic != USB_CLERK_MAGIC || reply.hdr.type != USB_CLERK_REPLY ||
-                reply.hdr.size != sizeof(USBClerkReply)) {
-            printf("Unknown message received, magic 0x%x type %u size %u\n",
-                   reply.hdr.magic, reply.hdr.type, reply.hdr.size);
-            return 1;
-        }
-        if (reply.status) {
-            printf("Completed successfully\n");
-        } else {
-            printf("Failed\n");
+    printf("%s %d device(s)...\n", type == USB_CLERK_DRIVER_REMOVE ? "Removing" :
+           "Signing & installing", devs);
+    /* the client sends queued devices to the service in batches */
+    for (i = 1; i < argc; i++) {
+        if (_stscanf(argv[i], TEXT("%hx:%hx"), &vid, &pid) < 2) continue;
+        if (!client.submit(type, vid, pid, 0, print_status, verbose ? &verbose : NULL)) {
+            client.run(type, vid, pid, 0, &reply);
+            print_status(verbose ? &verbose : NULL, vid, pid, &reply);
         }
     }
+    client.flush();
 
-    if (dev.hdr.type == USB_CLERK_DRIVER_SESSION_INSTALL) {
+    if (type == USB_CLERK_DRIVER_SESSION_INSTALL) {
         printf("Hit any key to terminate session\n");
         _getch();
     }
-    CloseHandle(pipe);
+    client.close();
     return 0;
 }
@@ -19,23 +19,99 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <share.h>
+#include <io.h>
+#include <fcntl.h>
 
-#define LOG_ROLL_SIZE (1024 * 1024)
+#define LOG_ARCHIVE_INTERVAL (60 * 1000)
 
 VDLog* VDLog::_log = NULL;
+LogSite* volatile VDLog::_sites = NULL;
+DWORD VDLog::_limit_window = LOG_LIMIT_WINDOW;
+LONG VDLog::_limit_burst = LOG_LIMIT_BURST;
+volatile LONG VDLog::_suppressed = 0;
 
-VDLog::VDLog(FILE* handle)
+VDLog::VDLog(FILE* handle, TCHAR* path)
     : _handle(handle)
+    , _stop(false)
+    , _roll_pending(false)
+    , _size(0)
+    , _open_time(time(NULL))
+    , _roll_size(LOG_ROLL_SIZE)
+    , _roll_age(LOG_ROLL_AGE)
+    , _generations(LOG_ROLL_GENERATIONS)
+    , _bytes_written(0)
+    , _rotations(0)
 {
     _log = this;
+    _tcsncpy(_path, path, MAX_PATH);
+    _path[MAX_PATH - 1] = TEXT('\0');
+    InitializeCriticalSection(&_lock);
+    _archive_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    _archive_thread = CreateThread(NULL, 0, archive_thread, this, 0, NULL);
 }
 
 VDLog::~VDLog()
 {
-    if (_log && _handle) {
+    if (_archive_thread) {
+        _stop = true;
+        SetEvent(_archive_event);
+        WaitForSingleObject(_archive_thread, INFINITE);
+        CloseHandle(_archive_thread);
+    }
+    if (_archive_event) {
+        CloseHandle(_archive_event);
+    }
+    if (_handle) {
         fclose(_handle);
+    }
+    if (_log == this) {
         _log = NULL;
     }
+    DeleteCriticalSection(&_lock);
+}
+
+/* the file is shared for delete, so it can be renamed by roll() while open */
+FILE* VDLog::open_file(TCHAR* path, DWORD* size)
+{
+    HANDLE file;
+    FILE* handle;
+    int fd;
+
+    file = CreateFile(path, GENERIC_READ | GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    *size = GetFileSize(file, NULL);
+    if (*size == INVALID_FILE_SIZE) {
+        *size = 0;
+    }
+    fd = _open_osfhandle((intptr_t)file, _O_APPEND | _O_TEXT);
+    if (fd == -1) {
+        CloseHandle(file);
+        return NULL;
+    }
+    handle = _fdopen(fd, "a+");
+    if (!handle) {
+        _close(fd);
+    }
+    return handle;
+}
+
+/* The live file is first renamed to path.0, then path.1 ... path.(N-1) move one
+   generation up, dropping path.N, and path.0 becomes path.1. Generations only shift
+   once the live file was renamed, so a failed roll loses none. */
+void VDLog::shift_files()
+{
+    TCHAR from[MAX_PATH];
+    TCHAR to[MAX_PATH];
+
+    for (int i = _generations - 1; i >= 0; i--) {
+        _sntprintf(from, MAX_PATH, TEXT("%s.%d"), _path, i);
+        _sntprintf(to, MAX_PATH, TEXT("%s.%d"), _path, i + 1);
+        MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING);
+    }
 }
 
 VDLog* VDLog::get(TCHAR* path)
@@ -50,29 +126,240 @@ VDLog* VDLog::get(TCHAR* path)
         size = GetFileSize(file, NULL);
         CloseHandle(file);
     }
+    FILE* handle = NULL;
+    VDLog* log = new VDLog(NULL, path);
     if (size != INVALID_FILE_SIZE && size > LOG_ROLL_SIZE) {
         TCHAR roll_path[MAX_PATH];
-        _sntprintf(roll_path, MAX_PATH, TEXT("%s.1"), path);
+        _sntprintf(roll_path, MAX_PATH, TEXT("%s.0"), path);
         if (!MoveFileEx(path, roll_path, MOVEFILE_REPLACE_EXISTING)) {
+            delete log;
             return NULL;
         }
+        log->shift_files();
     }
-    FILE* handle = _wfsopen(path, L"a+", _SH_DENYNO);
+    handle = open_file(path, &log->_size);
     if (!handle) {
+        delete log;
         return NULL;
     }
-    _log = new VDLog(handle);
-    return _log;
+    log->_handle = handle;
+    return log;
+}
+
+/* called once the service configuration is read, size is in bytes & age in seconds,
+   0 disables either */
+void VDLog::set_roll(DWORD size, DWORD age, int generations)
+{
+    EnterCriticalSection(&_lock);
+    _roll_size = size;
+    _roll_age = age;
+    _generations = generations > 0 ? generations : 1;
+    LeaveCriticalSection(&_lock);
 }
 
 void VDLog::printf(const char* format, ...)
 {
     va_list args;
+    int written;
 
+    EnterCriticalSection(&_lock);
     va_start(args, format);
-    vfprintf(_handle, format, args);
+    written = vfprintf(_handle, format, args);
     va_end(args);
     fflush(_handle);
+    if (written > 0) {
+        _size += written;
+        _bytes_written += written;
+    }
+    if (_roll_size && _size >= _roll_size && !_roll_pending) {
+        _roll_pending = true;
+        SetEvent(_archive_event);
+    }
+    LeaveCriticalSection(&_lock);
+}
+
+/* window in ms, burst in lines per window, either 0 disables limiting */
+void VDLog::set_limit(DWORD window, DWORD burst)
+{
+    _limit_window = window;
+    _limit_burst = (LONG)burst;
+}
+
+/* FNV-1a, never 0 as that marks a free message slot */
+static DWORD text_hash(const char* text)
+{
+    DWORD hash = 2166136261u;
+
+    while (*text) {
+        hash = (hash ^ (unsigned char)*text++) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+static void lock_site(LogSite* site)
+{
+    while (InterlockedExchange(&site->lock, 1)) {
+        Sleep(0);
+    }
+}
+
+static void unlock_site(LogSite* site)
+{
+    InterlockedExchange(&site->lock, 0);
+}
+
+static void log_repeated(LogSite* site, LogMessage* message)
+{
+    vd_printf("%s: \"%s\" repeated %ld times", site->function, message->text,
+              message->suppressed);
+}
+
+/* whether the site may log text now, with the times it dropped it since it last did.
+   A site joins the list of the archive thread when it first drops a line */
+bool VDLog::allow(LogSite* site, const char* text, LONG* repeated)
+{
+    DWORD now = GetTickCount();
+    DWORD hash = text_hash(text);
+    LogMessage* message = NULL;
+    LogMessage evicted;
+    LogSite* head;
+    bool allowed;
+
+    *repeated = 0;
+    if (!_limit_window || !_limit_burst) {
+        return true;
+    }
+    evicted.suppressed = 0;
+    lock_site(site);
+    for (int i = 0; i < LOG_SITE_MESSAGES; i++) {
+        LogMessage* m = &site->messages[i];
+
+        if (m->hash == hash && !strcmp(m->text, text)) {
+            message = m;
+            break;
+        }
+        /* else a free slot, or the one whose window started first */
+        if (!message || (message->hash && (!m->hash || now - m->start > now - message->start))) {
+            message = m;
+        }
+    }
+    if (message->hash != hash || strcmp(message->text, text)) {
+        if (message->hash && message->suppressed) {
+            evicted = *message;
+        }
+        message->hash = hash;
+        message->start = now;
+        message->count = 0;
+        message->suppressed = 0;
+        strncpy(message->text, text, LOG_MESSAGE_SIZE - 1);
+        message->text[LOG_MESSAGE_SIZE - 1] = '\0';
+    } else if (now - message->start >= _limit_window) {
+        message->start = now;
+        message->count = 0;
+    }
+    allowed = ++message->count <= _limit_burst;
+    if (allowed) {
+        *repeated = message->suppressed;
+        message->suppressed = 0;
+    } else {
+        message->suppressed++;
+        InterlockedIncrement(&_suppressed);
+    }
+    unlock_site(site);
+    if (evicted.suppressed) {
+        log_repeated(site, &evicted);
+    }
+    if (!allowed && !InterlockedExchange(&site->listed, 1)) {
+        do {
+            head = _sites;
+            site->next = head;
+        } while (InterlockedCompareExchangePointer((void* volatile*)&_sites, site, head) != head);
+    }
+    return allowed;
+}
+
+/* logs the dropped lines whose window is over, or all of them. They are copied out,
+   so the site is not locked while writing */
+void VDLog::report_repeated(bool all)
+{
+    DWORD now = GetTickCount();
+    LogMessage* reported = new LogMessage[LOG_SITE_MESSAGES];
+    int count;
+
+    for (LogSite* site = _sites; site; site = site->next) {
+        count = 0;
+        lock_site(site);
+        for (int i = 0; i < LOG_SITE_MESSAGES; i++) {
+            LogMessage* m = &site->messages[i];
+
+            if (!m->suppressed || (!all && now - m->start < _limit_window)) {
+                continue;
+            }
+            reported[count++] = *m;
+            m->suppressed = 0;
+        }
+        unlock_site(site);
+        for (int i = 0; i < count; i++) {
+            log_repeated(site, &reported[i]);
+        }
+    }
+    delete[] reported;
+}
+
+/* runs on the archive thread. The current file is renamed while open and replaced
+   by a new one, older generations are renamed once writers went on with it. Writers
+   only wait for the handle swap. */
+void VDLog::roll()
+{
+    TCHAR roll_path[MAX_PATH];
+    FILE* handle;
+    FILE* old_handle;
+    DWORD size;
+
+    /* on failure _roll_pending stays set, so writers do not wake this thread again
+       and the roll is retried on the next interval */
+    _sntprintf(roll_path, MAX_PATH, TEXT("%s.0"), _path);
+    if (!MoveFileEx(_path, roll_path, MOVEFILE_REPLACE_EXISTING)) {
+        return;
+    }
+    handle = open_file(_path, &size);
+    if (!handle) {
+        /* keep writing to the live file under its name */
+        MoveFileEx(roll_path, _path, 0);
+        return;
+    }
+    EnterCriticalSection(&_lock);
+    old_handle = _handle;
+    _handle = handle;
+    _size = size;
+    _open_time = time(NULL);
+    _rotations++;
+    _roll_pending = false;
+    LeaveCriticalSection(&_lock);
+    fclose(old_handle);
+    shift_files();
+    vd_printf("Log rolled, %I64u bytes written, %lu rotations", _bytes_written, _rotations);
+}
+
+DWORD WINAPI VDLog::archive_thread(LPVOID param)
+{
+    VDLog* log = (VDLog*)param;
+
+    for (;;) {
+        WaitForSingleObject(log->_archive_event, LOG_ARCHIVE_INTERVAL);
+        if (log->_stop) {
+            break;
+        }
+        if (!log->_handle) {
+            continue;
+        }
+        log->report_repeated(false);
+        if (log->_roll_pending ||
+                (log->_roll_age && time(NULL) - log->_open_time >= (time_t)log->_roll_age)) {
+            log->roll();
+        }
+    }
+    return 0;
 }
 
 void log_version()
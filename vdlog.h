@@ -25,18 +25,77 @@
 #include <time.h>
 #include <sys/timeb.h>
 
+#define LOG_ROLL_SIZE (1024 * 1024)
+#define LOG_ROLL_AGE (7 * 24 * 60 * 60)
+#define LOG_ROLL_GENERATIONS 5
+#define LOG_LIMIT_WINDOW (60 * 1000)
+#define LOG_LIMIT_BURST 5
+
+#define LOG_SITE_MESSAGES 4
+#define LOG_MESSAGE_SIZE 256
+
+typedef struct LogMessage {
+    DWORD hash;                 /* of text, 0 for a free slot */
+    DWORD start;                /* GetTickCount() at the window start */
+    LONG count;                 /* lines of the window */
+    LONG suppressed;            /* lines dropped & not reported yet */
+    char text[LOG_MESSAGE_SIZE];
+} LogMessage;
+
+/* A rate limited log call site. Each distinct formatted line of the site logs up to
+   the burst per window, then only counts, and the lines it dropped are logged once as
+   repeated N times, before the next time it logs or by the archive thread once the
+   window is over. A site follows its last LOG_SITE_MESSAGES lines, the least recent
+   is reported & replaced by a new one. Zero initialized & guarded by a spin lock, so
+   sites need no setup. */
+typedef struct LogSite {
+    volatile LONG lock;
+    volatile LONG listed;
+    const char* function;
+    LogMessage messages[LOG_SITE_MESSAGES];
+    struct LogSite* volatile next;
+} LogSite;
+
 class VDLog {
 public:
     ~VDLog();
     static VDLog* get(TCHAR* path = NULL);
     void printf(const char* format, ...);
+    void set_roll(DWORD size, DWORD age, int generations);
+    ULONGLONG bytes_written() { return _bytes_written; }
+    DWORD rotations() { return _rotations; }
+    static void set_limit(DWORD window, DWORD burst);
+    static bool allow(LogSite* site, const char* text, LONG* repeated);
+    void report_repeated(bool all);
+    static LONG suppressed() { return _suppressed; }
 
 private:
-    VDLog(FILE* handle);
+    VDLog(FILE* handle, TCHAR* path);
+    static FILE* open_file(TCHAR* path, DWORD* size);
+    void shift_files();
+    void roll();
+    static DWORD WINAPI archive_thread(LPVOID param);
 
 private:
     static VDLog* _log;
+    static LogSite* volatile _sites;
+    static DWORD _limit_window;
+    static LONG _limit_burst;
+    static volatile LONG _suppressed;
     FILE* _handle;
+    TCHAR _path[MAX_PATH];
+    CRITICAL_SECTION _lock;
+    HANDLE _archive_event;
+    HANDLE _archive_thread;
+    bool _stop;
+    bool _roll_pending;
+    DWORD _size;
+    time_t _open_time;
+    DWORD _roll_size;
+    DWORD _roll_age;
+    int _generations;
+    ULONGLONG _bytes_written;
+    DWORD _rotations;
 };
 
 enum {
@@ -57,7 +116,9 @@ static unsigned int log_level = LOG_INFO;
     printf("%ld::%s::%s,%.3d::%s::" format "\n", GetCurrentThreadId(), type, datetime, ms,       \
            __FUNCTION__, ## __VA_ARGS__);
 
+/* keeps the last error, so callers can still read it after logging a failure */
 #define LOG(type, format, ...) if (type >= log_level && type <= LOG_FATAL) {                    \
+    DWORD log_error = GetLastError();                                                           \
     VDLog* log = VDLog::get();                                                                  \
     const char *type_as_char[] = { "DEBUG", "INFO", "WARN", "ERROR", "FATAL" };                 \
     struct _timeb now;                                                                          \
@@ -71,9 +132,27 @@ static unsigned int log_level = LOG_INFO;
     } else {                                                                                    \
         PRINT_LINE(type_as_char[type], format, datetime_str, now.millitm, ## __VA_ARGS__);      \
     }                                                                                           \
+    SetLastError(log_error);                                                                    \
 }
  
+/* for lines which may repeat at a high rate, such as failures caused by clients. The
+   line is formatted first, as it is limited by its text */
+#define LOG_LIMITED(type, format, ...) if (type >= log_level && type <= LOG_FATAL) {            \
+    static LogSite log_site = {0, 0, __FUNCTION__};                                             \
+    char log_text[LOG_MESSAGE_SIZE];                                                            \
+    LONG log_repeated;                                                                          \
+    _snprintf(log_text, sizeof(log_text), format, ## __VA_ARGS__);                              \
+    log_text[sizeof(log_text) - 1] = '\0';                                                      \
+    if (VDLog::allow(&log_site, log_text, &log_repeated)) {                                     \
+        if (log_repeated) {                                                                     \
+            LOG(type, "\"%s\" repeated %ld times", log_text, log_repeated);                     \
+        }                                                                                       \
+        LOG(type, "%s", log_text);                                                              \
+    }                                                                                           \
+}
+
 #define vd_printf(format, ...) LOG(LOG_INFO, format, ## __VA_ARGS__)
+#define vd_printf_limited(format, ...) LOG_LIMITED(LOG_INFO, format, ## __VA_ARGS__)
 #define LOG_INFO(format, ...) LOG(LOG_INFO, format, ## __VA_ARGS__)
 #define LOG_WARN(format, ...) LOG(LOG_WARN, format, ## __VA_ARGS__)
 #define LOG_ERROR(format, ...) LOG(LOG_ERROR, format, ## __VA_ARGS__)
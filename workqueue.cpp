@@ -0,0 +1,325 @@
+#include "workqueue.h"
+#include "roundrobin.h"
+#include "vdlog.h"
+
+static const char* priority_names[WORK_PRIORITIES] = {"interactive", "normal", "background"};
+
+struct ItemOwner {
+    uint32_t operator()(WorkItem* item) const { return item->owner(); }
+};
+
+WorkItem::WorkItem(int priority)
+    : _refs (1)
+    , _submit_time (0)
+    , _queue_time (0)
+    , _priority (priority)
+    , _owner (0)
+    , _ran (false)
+{
+    _done = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+WorkItem::~WorkItem()
+{
+    if (_done) {
+        CloseHandle(_done);
+    }
+}
+
+void WorkItem::add_ref()
+{
+    InterlockedIncrement(&_refs);
+}
+
+void WorkItem::release()
+{
+    if (!InterlockedDecrement(&_refs)) {
+        delete this;
+    }
+}
+
+bool WorkItem::wait(DWORD timeout)
+{
+    return WaitForSingleObject(_done, timeout) == WAIT_OBJECT_0;
+}
+
+/* drops the queue reference, the item may be gone once this returns */
+void WorkItem::complete(bool ran)
+{
+    _ran = ran;
+    finished();
+    SetEvent(_done);
+    release();
+}
+
+WorkQueue::WorkQueue()
+    : _items_sem (NULL)
+    , _workers (NULL)
+    , _worker_count (0)
+    , _max_depth (0)
+    , _aging (0)
+    , _running (false)
+    , _depth_max (0)
+    , _active (0)
+    , _completed (0)
+    , _rejected (0)
+{
+    ZeroMemory(_stats, sizeof(_stats));
+    ZeroMemory(_last_owner, sizeof(_last_owner));
+    InitializeCriticalSection(&_lock);
+}
+
+WorkQueue::~WorkQueue()
+{
+    stop();
+    DeleteCriticalSection(&_lock);
+}
+
+/* workers are waited for at stop with a single WaitForMultipleObjects() */
+bool WorkQueue::start(int workers, int max_depth, DWORD aging)
+{
+    if (workers > MAXIMUM_WAIT_OBJECTS) {
+        vd_printf("%d workers requested, using %d", workers, MAXIMUM_WAIT_OBJECTS);
+        workers = MAXIMUM_WAIT_OBJECTS;
+    }
+    _items_sem = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    if (!_items_sem) {
+        vd_printf("CreateSemaphore() failed: %ld", GetLastError());
+        return false;
+    }
+    _max_depth = max_depth;
+    _aging = aging;
+    _running = true;
+    _workers = new HANDLE[workers];
+    for (_worker_count = 0; _worker_count < workers; _worker_count++) {
+        _workers[_worker_count] = CreateThread(NULL, 0, worker_thread, this, 0, NULL);
+        if (!_workers[_worker_count]) {
+            vd_printf("CreateThread() failed: %ld", GetLastError());
+            break;
+        }
+    }
+    if (!_worker_count) {
+        stop();
+        return false;
+    }
+    vd_printf("Started %d workers, queue limit %d, aging %lums", _worker_count, _max_depth,
+              _aging);
+    return true;
+}
+
+/* waits for the running items to finish, items still queued are completed without
+   being run */
+void WorkQueue::stop()
+{
+    WorkItem* item;
+
+    if (!_items_sem) {
+        return;
+    }
+    EnterCriticalSection(&_lock);
+    _running = false;
+    LeaveCriticalSection(&_lock);
+    ReleaseSemaphore(_items_sem, _worker_count, NULL);
+    if (_worker_count) {
+        WaitForMultipleObjects(_worker_count, _workers, TRUE, INFINITE);
+    }
+    for (int i = 0; i < _worker_count; i++) {
+        CloseHandle(_workers[i]);
+    }
+    delete [] _workers;
+    _workers = NULL;
+    _worker_count = 0;
+    for (int p = 0; p < WORK_PRIORITIES; p++) {
+        while (!_items[p].empty()) {
+            item = _items[p].front();
+            _items[p].pop_front();
+            item->complete(false);
+        }
+    }
+    CloseHandle(_items_sem);
+    _items_sem = NULL;
+    log_stats();
+}
+
+bool WorkQueue::submit(WorkItem* item)
+{
+    int depth;
+
+    EnterCriticalSection(&_lock);
+    if (!_running) {
+        LeaveCriticalSection(&_lock);
+        vd_printf_limited("Queue stopped, rejected");
+        return false;
+    }
+    depth = depth_locked();
+    if (_max_depth && depth >= _max_depth) {
+        _rejected++;
+        LeaveCriticalSection(&_lock);
+        /* the count is left to log_stats(), so repeated lines are alike & limited */
+        vd_printf_limited("Queue full, rejected (depth %d)", depth);
+        return false;
+    }
+    item->add_ref();
+    item->_submit_time = GetTickCount();
+    _items[item->_priority].push_back(item);
+    if (++depth > _depth_max) {
+        _depth_max = depth;
+    }
+    /* released under the lock, as stop() closes the semaphore once not running */
+    ReleaseSemaphore(_items_sem, 1, NULL);
+    LeaveCriticalSection(&_lock);
+    return true;
+}
+
+/* removes an item which was not picked by a worker yet, completing it without running */
+bool WorkQueue::cancel(WorkItem* item)
+{
+    bool found = false;
+
+    EnterCriticalSection(&_lock);
+    WorkItems* items = &_items[item->_priority];
+    for (WorkItems::iterator i = items->begin(); i != items->end(); i++) {
+        if (*i == item) {
+            items->erase(i);
+            found = true;
+            break;
+        }
+    }
+    LeaveCriticalSection(&_lock);
+    if (found) {
+        item->complete(false);
+    }
+    return found;
+}
+
+int WorkQueue::depth()
+{
+    int depth;
+
+    EnterCriticalSection(&_lock);
+    depth = depth_locked();
+    LeaveCriticalSection(&_lock);
+    return depth;
+}
+
+/* items queued or running */
+int WorkQueue::pending()
+{
+    int pending;
+
+    EnterCriticalSection(&_lock);
+    pending = depth_locked() + _active;
+    LeaveCriticalSection(&_lock);
+    return pending;
+}
+
+int WorkQueue::depth_locked()
+{
+    int depth = 0;
+
+    for (int p = 0; p < WORK_PRIORITIES; p++) {
+        depth += (int)_items[p].size();
+    }
+    return depth;
+}
+
+/* the oldest item of the owner following the last served one in the class, in owner
+   order, so a client queueing many items only gets its turn */
+WorkItems::iterator WorkQueue::next_owner_item(int priority)
+{
+    return next_owner(_items[priority].begin(), _items[priority].end(),
+                      _last_owner[priority], ItemOwner());
+}
+
+/* the next owner's item of the highest class, or the oldest front item that waited
+   longer than _aging in a lower class */
+WorkItem* WorkQueue::pop()
+{
+    DWORD now = GetTickCount();
+    int pick = -1, aged = -1;
+    DWORD aged_wait = 0;
+    WorkItem* item;
+
+    EnterCriticalSection(&_lock);
+    for (int p = 0; p < WORK_PRIORITIES; p++) {
+        if (_items[p].empty()) {
+            continue;
+        }
+        DWORD wait = now - _items[p].front()->_submit_time;
+        if (pick == -1) {
+            pick = p;
+        } else if (_aging && wait >= _aging && wait > aged_wait) {
+            aged = p;
+            aged_wait = wait;
+        }
+    }
+    if (pick == -1) {
+        LeaveCriticalSection(&_lock);
+        return NULL;
+    }
+    if (aged != -1) {
+        pick = aged;
+        _stats[pick].aged++;
+        item = _items[pick].front();
+        _items[pick].pop_front();
+    } else {
+        WorkItems::iterator next = next_owner_item(pick);
+        item = *next;
+        _items[pick].erase(next);
+    }
+    _last_owner[pick] = item->_owner;
+    /* counted before leaving the lock, so pending() never misses it */
+    InterlockedIncrement(&_active);
+    item->_queue_time = now - item->_submit_time;
+    _stats[pick].started++;
+    _stats[pick].wait_total += item->_queue_time;
+    if (item->_queue_time > _stats[pick].wait_max) {
+        _stats[pick].wait_max = item->_queue_time;
+    }
+    LeaveCriticalSection(&_lock);
+    return item;
+}
+
+const char* WorkQueue::priority_name(int priority)
+{
+    return priority_names[priority];
+}
+
+/* on stop(), and while running on request of the service */
+void WorkQueue::log_stats()
+{
+    EnterCriticalSection(&_lock);
+    vd_printf("Queue depth %d (max %d), active %ld, completed %lu, rejected %lu",
+              depth_locked(), _depth_max, _active, _completed, _rejected);
+    for (int p = 0; p < WORK_PRIORITIES; p++) {
+        ClassStats* stats = &_stats[p];
+        vd_printf("Queue class %s: depth %u, started %lu, aged %lu, wait avg %lums max %lums",
+                  priority_name(p), (unsigned)_items[p].size(), stats->started, stats->aged,
+                  stats->started ? (DWORD)(stats->wait_total / stats->started) : 0,
+                  stats->wait_max);
+    }
+    LeaveCriticalSection(&_lock);
+}
+
+DWORD WINAPI WorkQueue::worker_thread(LPVOID param)
+{
+    WorkQueue* queue = (WorkQueue*)param;
+    WorkItem* item;
+
+    for (;;) {
+        WaitForSingleObject(queue->_items_sem, INFINITE);
+        if (!queue->_running) {
+            break;
+        }
+        if (!(item = queue->pop())) {
+            continue;
+        }
+        item->run();
+        InterlockedDecrement(&queue->_active);
+        EnterCriticalSection(&queue->_lock);
+        queue->_completed++;
+        LeaveCriticalSection(&queue->_lock);
+        item->complete(true);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef _H_WORKQUEUE
+#define _H_WORKQUEUE
+
+#include <windows.h>
+#include <list>
+
+class WorkQueue;
+
+/* scheduling classes, served in this order */
+enum {
+    WORK_PRIORITY_INTERACTIVE,  /* a user is waiting on it */
+    WORK_PRIORITY_NORMAL,
+    WORK_PRIORITY_BACKGROUND,   /* cleanup nobody waits on */
+    WORK_PRIORITIES,
+};
+
+/* A unit of work executed by one of the WorkQueue workers. Items are heap allocated &
+   reference counted: the creator holds a reference and the queue another while the item
+   is queued or running, so a submitter may stop waiting and release() it while a
+   worker still runs it. finished() is called by the queue once the item ran or was
+   dropped, before waiters are woken. */
+class WorkItem {
+public:
+    WorkItem(int priority = WORK_PRIORITY_NORMAL);
+    virtual void run() = 0;
+    virtual void finished() {}
+    void add_ref();
+    void release();
+    bool wait(DWORD timeout = INFINITE);
+    bool ran() { return _ran; }
+    DWORD queue_time() { return _queue_time; }
+    int priority() { return _priority; }
+    void set_priority(int priority) { _priority = priority; }
+    DWORD owner() { return _owner; }
+    void set_owner(DWORD owner) { _owner = owner; }
+
+protected:
+    virtual ~WorkItem();
+
+private:
+    void complete(bool ran);
+
+private:
+    friend class WorkQueue;
+    volatile LONG _refs;
+    HANDLE _done;
+    DWORD _submit_time;
+    DWORD _queue_time;
+    int _priority;
+    DWORD _owner;
+    bool _ran;
+};
+
+typedef std::list<WorkItem*> WorkItems;
+
+/* Bounded pool of worker threads fed from a FIFO queue per priority class. Workers take
+   the highest class first, unless the oldest item of a lower class waited more than
+   aging ms, so background work is not starved. Within a class, owners (e.g. clients)
+   are served round-robin, FIFO for each owner. submit() rejects items once max_depth
+   items are already waiting, so callers can tell clients to back off. */
+class WorkQueue {
+public:
+    WorkQueue();
+    ~WorkQueue();
+    bool start(int workers, int max_depth, DWORD aging);
+    void stop();
+    bool submit(WorkItem* item);
+    bool cancel(WorkItem* item);
+    int depth();
+    int pending();
+    void log_stats();
+    static const char* priority_name(int priority);
+
+private:
+    static DWORD WINAPI worker_thread(LPVOID param);
+    WorkItem* pop();
+    WorkItems::iterator next_owner_item(int priority);
+    int depth_locked();
+
+private:
+    struct ClassStats {
+        ULONGLONG wait_total;
+        DWORD wait_max;
+        DWORD started;
+        DWORD aged;
+    };
+
+    CRITICAL_SECTION _lock;
+    HANDLE _items_sem;
+    WorkItems _items[WORK_PRIORITIES];
+    DWORD _last_owner[WORK_PRIORITIES];
+    HANDLE* _workers;
+    int _worker_count;
+    int _max_depth;
+    DWORD _aging;
+    bool _running;
+    int _depth_max;
+    LONG _active;
+    DWORD _completed;
+    DWORD _rejected;
+    ClassStats _stats[WORK_PRIORITIES];
+};
+
+#endif